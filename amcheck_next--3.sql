@@ -0,0 +1,86 @@
+/* amcheck_next--3.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION amcheck_next" to load this file. \quit
+
+--
+-- bt_index_check()
+--
+CREATE FUNCTION bt_index_check(index regclass,
+    heapallindexed boolean DEFAULT false)
+RETURNS VOID
+AS 'MODULE_PATHNAME', 'bt_index_check_next'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION bt_index_check(index regclass,
+    heapallindexed boolean, exact boolean)
+RETURNS VOID
+AS 'MODULE_PATHNAME', 'bt_index_check_next'
+LANGUAGE C STRICT;
+
+--
+-- bt_index_parent_check()
+--
+CREATE FUNCTION bt_index_parent_check(index regclass,
+    heapallindexed boolean DEFAULT false)
+RETURNS VOID
+AS 'MODULE_PATHNAME', 'bt_index_parent_check_next'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION bt_index_parent_check(index regclass,
+    heapallindexed boolean, exact boolean)
+RETURNS VOID
+AS 'MODULE_PATHNAME', 'bt_index_parent_check_next'
+LANGUAGE C STRICT;
+
+--
+-- bt_index_fingerprint()
+--
+CREATE FUNCTION bt_index_fingerprint(index regclass)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'bt_index_fingerprint_next'
+LANGUAGE C STRICT;
+
+--
+-- bt_index_fingerprint_probe()
+--
+CREATE FUNCTION bt_index_fingerprint_probe(index regclass, fingerprint bytea)
+RETURNS VOID
+AS 'MODULE_PATHNAME', 'bt_index_fingerprint_probe_next'
+LANGUAGE C STRICT;
+
+--
+-- bt_index_check_stats()
+--
+CREATE FUNCTION bt_index_check_stats(index regclass,
+    parentcheck boolean DEFAULT false,
+    OUT heap_tuples bigint,
+    OUT passes integer,
+    OUT bitset_bits bigint,
+    OUT bits_set bigint,
+    OUT estimated_index_tuples bigint,
+    OUT false_positive_rate float8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'bt_index_check_stats_next'
+LANGUAGE C STRICT;
+
+--
+-- bt_index_physical_check()
+--
+CREATE FUNCTION bt_index_physical_check(index regclass,
+    directio boolean DEFAULT false,
+    OUT direct_blocks bigint,
+    OUT buffered_blocks bigint)
+RETURNS record
+AS 'MODULE_PATHNAME', 'bt_index_physical_check_next'
+LANGUAGE C STRICT;
+
+-- Don't want these to be available to public
+REVOKE ALL ON FUNCTION bt_index_check(regclass, boolean) FROM PUBLIC;
+REVOKE ALL ON FUNCTION bt_index_parent_check(regclass, boolean) FROM PUBLIC;
+REVOKE ALL ON FUNCTION bt_index_check(regclass, boolean, boolean) FROM PUBLIC;
+REVOKE ALL ON FUNCTION bt_index_parent_check(regclass, boolean, boolean) FROM PUBLIC;
+REVOKE ALL ON FUNCTION bt_index_fingerprint(regclass) FROM PUBLIC;
+REVOKE ALL ON FUNCTION bt_index_fingerprint_probe(regclass, bytea) FROM PUBLIC;
+REVOKE ALL ON FUNCTION bt_index_check_stats(regclass, boolean) FROM PUBLIC;
+REVOKE ALL ON FUNCTION bt_index_physical_check(regclass, boolean) FROM PUBLIC;
@@ -0,0 +1,647 @@
+/*-------------------------------------------------------------------------
+ *
+ * bloombench.c
+ *		Microbenchmark and error-rate harness for bloomfilter.c
+ *
+ * For every combination of filter kind, element count, element width, memory
+ * budget and load, reports the cost per element of adding elements to a
+ * filter, of probing the filter for elements that were added, and of batch
+ * probes for elements that weren't added.  Also reports hardware cache misses
+ * per element where the kernel makes them available, and the false positive
+ * rate actually observed next to the rate that bloom_stats() estimates.
+ * Memory is reported per element twice: the size of the finished filter, and
+ * the most memory in use at once while creating the filter and adding its
+ * elements, which for a static filter includes bloom_freeze().  That's what
+ * the filter must fit into a memory budget.  Bitsets that are mapped from
+ * the kernel aren't counted in the latter.
+ *
+ * The load is the number of elements added as a percentage of the number the
+ * filter was sized for.  There is no way to ask for a particular number of
+ * hash functions; that follows from the bits available per element, so
+ * sweeping memory budget and load sweeps it too.  It's reported as "k".
+ *
+ * Every element that was added must be found again, so a false negative is
+ * reported as an error.  Bloom and scalable filters are also checked by
+ * adding half of the elements to each of two filters created with the same
+ * arguments, and combining them with bloom_union().  Every element must then
+ * be found in the union, and a static filter must never be compatible with
+ * another filter.  Bloom filters are also filled by several threads at once
+ * in shared memory, which must come out the same as a private filter.
+ *
+ * Portions Copyright (c) 2016-2020, Peter Geoghegan
+ * Portions Copyright (c) 1996-2020, The PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  amcheck_next/bench/bloombench.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bloomfilter.h"
+
+/* Elements are generated up front, within this many bytes */
+#define MAX_ELEM_BYTES		(INT64CONST(1) << 30)
+#define BATCH_SIZE			64
+#define MAX_LIST			16
+#define SHARED_THREADS		4
+
+typedef enum bench_kind
+{
+	KIND_BLOOM,
+	KIND_SCALABLE,
+	KIND_STATIC
+} bench_kind;
+
+static const char *const kind_names[] = {"bloom", "scalable", "static"};
+
+/* A comma-separated list of values from the command line */
+typedef struct bench_list
+{
+	int64		values[MAX_LIST];
+	int			nvalues;
+} bench_list;
+
+/* Result of one phase: time and cache misses per element */
+typedef struct bench_phase
+{
+	double		ns;
+	double		misses;
+} bench_phase;
+
+/* One thread's share of the elements added to a shared filter */
+typedef struct bench_share
+{
+	pthread_t	thread;
+	bloom_filter *filter;
+	unsigned char *elems;
+	int64		nelems;
+	int			width;
+} bench_share;
+
+static int	misses_fd = -1;
+
+/* Allocation counters maintained by the shim */
+Size		shim_allocated = 0;
+Size		shim_peak = 0;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Open hardware cache miss counter for this process, if possible.  Counting
+ * is often unavailable in containers and virtual machines.
+ */
+static void
+misses_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	misses_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static uint64
+misses_read(void)
+{
+	uint64		count;
+
+	if (misses_fd < 0 || read(misses_fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+
+	return count;
+}
+
+/*
+ * Fill buffer with pseudo-random bytes (xorshift64*)
+ */
+static void
+fill_random(unsigned char *buf, size_t len, uint64 *state)
+{
+	size_t		i;
+
+	for (i = 0; i < len; i++)
+	{
+		*state ^= *state >> 12;
+		*state ^= *state << 25;
+		*state ^= *state >> 27;
+		buf[i] = (unsigned char) ((*state * UINT64CONST(2685821657736338717)) >> 56);
+	}
+}
+
+/*
+ * Generate nelems random elements of width bytes.  Each starts with its own
+ * serial number, so that elements are distinct, and none of the elements
+ * generated with a later first serial number were added.
+ */
+static unsigned char *
+make_elements(int64 nelems, int width, int64 first, uint64 *state)
+{
+	unsigned char *elems = palloc((size_t) nelems * width);
+	int64		i;
+
+	fill_random(elems, (size_t) nelems * width, state);
+	for (i = 0; i < nelems; i++)
+	{
+		int64		serial = first + i;
+
+		memcpy(elems + (size_t) i * width, &serial, sizeof(serial));
+	}
+
+	return elems;
+}
+
+static bool
+parse_list(const char *arg, bench_list *list)
+{
+	char	   *end;
+
+	list->nvalues = 0;
+	for (;;)
+	{
+		if (list->nvalues == MAX_LIST)
+			return false;
+		list->values[list->nvalues++] = strtoll(arg, &end, 10);
+		if (end == arg)
+			return false;
+		if (*end == '\0')
+			return true;
+		if (*end != ',')
+			return false;
+		arg = end + 1;
+	}
+}
+
+static bool
+parse_kinds(const char *arg, bench_list *list)
+{
+	list->nvalues = 0;
+	while (*arg)
+	{
+		size_t		len = strcspn(arg, ",");
+		int			kind;
+
+		for (kind = 0; kind <= KIND_STATIC; kind++)
+		{
+			if (strlen(kind_names[kind]) == len &&
+				strncmp(arg, kind_names[kind], len) == 0)
+				break;
+		}
+		if (kind > KIND_STATIC || list->nvalues == MAX_LIST)
+			return false;
+		list->values[list->nvalues++] = kind;
+		arg += len;
+		if (*arg == ',')
+			arg++;
+	}
+
+	return list->nvalues > 0;
+}
+
+static void
+phase_begin(double *start, uint64 *misses)
+{
+	*misses = misses_read();
+	*start = now_ns();
+}
+
+static void
+phase_end(bench_phase *phase, double start, uint64 misses, int64 nelems)
+{
+	phase->ns += (now_ns() - start) / nelems;
+	phase->misses += (double) (misses_read() - misses) / nelems;
+}
+
+static void
+print_misses(double misses)
+{
+	if (misses_fd < 0)
+		printf(" %8s", "-");
+	else
+		printf(" %8.2f", misses);
+}
+
+/*
+ * Create filter of kind, or return NULL when a static filter won't fit
+ */
+static bloom_filter *
+create_filter(bench_kind kind, int64 estimate, int mem_kb, uint64 seed)
+{
+	switch (kind)
+	{
+		case KIND_BLOOM:
+			return bloom_create(estimate, mem_kb, seed);
+		case KIND_SCALABLE:
+			return bloom_create_scalable(estimate, mem_kb, seed);
+		default:
+			return bloom_create_static(estimate, mem_kb, seed);
+	}
+}
+
+/*
+ * Check bloom_compatible() and bloom_union() for one combination.  Returns
+ * false on a false negative, or when filters that should be compatible
+ * aren't.
+ */
+static bool
+check_union(bench_kind kind, unsigned char *elems, int64 nelems, int width,
+			int64 estimate, int mem_kb)
+{
+	bloom_filter *a = create_filter(kind, estimate, mem_kb, 0);
+	bloom_filter *b = create_filter(kind, estimate, mem_kb, 0);
+	int64		half = nelems / 2;
+	bool		ok = true;
+	int64		i;
+
+	if (!a || !b)
+		goto done;
+
+	if (kind == KIND_STATIC)
+	{
+		if (bloom_compatible(a, b))
+		{
+			printf("\nstatic filters reported as compatible\n");
+			ok = false;
+		}
+		goto done;
+	}
+
+	for (i = 0; i < nelems; i++)
+		bloom_add_element(i < half ? a : b, elems + (size_t) i * width, width);
+
+	/* Scalable filters that have grown can't be combined */
+	if (!bloom_compatible(a, b))
+	{
+		if (kind == KIND_SCALABLE)
+			goto done;
+		printf("\nfilters created with the same arguments reported as incompatible\n");
+		ok = false;
+		goto done;
+	}
+
+	bloom_union(a, b);
+	for (i = 0; i < nelems; i++)
+	{
+		if (bloom_lacks_element(a, elems + (size_t) i * width, width))
+		{
+			printf("\nfalse negative for element " INT64_FORMAT " of union\n", i);
+			ok = false;
+			break;
+		}
+	}
+
+done:
+	if (a)
+		bloom_free(a);
+	if (b)
+		bloom_free(b);
+
+	return ok;
+}
+
+/*
+ * Add one thread's share of the elements to a shared filter, in batches
+ */
+static void *
+add_share(void *arg)
+{
+	bench_share *share = (bench_share *) arg;
+	unsigned char *elemptrs[BATCH_SIZE];
+	size_t		lens[BATCH_SIZE];
+	int64		i;
+
+	for (i = 0; i < share->nelems; i += BATCH_SIZE)
+	{
+		int			n = Min(share->nelems - i, BATCH_SIZE);
+		int			j;
+
+		for (j = 0; j < n; j++)
+		{
+			elemptrs[j] = share->elems + (size_t) (i + j) * share->width;
+			lens[j] = share->width;
+		}
+		bloom_add_elements_batch(share->filter, n, elemptrs, lens, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Check a Bloom filter in shared memory that SHARED_THREADS threads fill at
+ * once.  Each thread adds its own share of the elements, so bits in the same
+ * word are often set concurrently.  Every element must then be found, and
+ * exactly as many bits must be set as in a private filter with the same
+ * elements, which rules out lost updates.  Returns false otherwise.
+ */
+static bool
+check_shared(unsigned char *elems, int64 nelems, int width, int64 estimate,
+			 int mem_kb)
+{
+	bench_share shares[SHARED_THREADS];
+	Size		size = bloom_shared_size(estimate, mem_kb);
+	void	   *mem;
+	bloom_filter *shared;
+	bloom_filter *private;
+	bloom_filter_stats sharedstats;
+	bloom_filter_stats privatestats;
+	bool		ok = true;
+	int64		i;
+	int			t;
+
+	mem = aligned_alloc(64, TYPEALIGN(64, size));
+	if (mem == NULL)
+	{
+		fprintf(stderr, "out of memory (requested %zu bytes)\n", size);
+		exit(1);
+	}
+	shared = bloom_init_shared(mem, estimate, mem_kb, 0);
+
+	for (t = 0; t < SHARED_THREADS; t++)
+	{
+		int64		first = nelems * t / SHARED_THREADS;
+
+		shares[t].filter = shared;
+		shares[t].elems = elems + (size_t) first * width;
+		shares[t].nelems = nelems * (t + 1) / SHARED_THREADS - first;
+		shares[t].width = width;
+		if (pthread_create(&shares[t].thread, NULL, add_share, &shares[t]) != 0)
+		{
+			fprintf(stderr, "could not create thread\n");
+			exit(1);
+		}
+	}
+	for (t = 0; t < SHARED_THREADS; t++)
+		pthread_join(shares[t].thread, NULL);
+
+	for (i = 0; i < nelems; i++)
+	{
+		if (bloom_lacks_element(shared, elems + (size_t) i * width, width))
+		{
+			printf("\nfalse negative for element " INT64_FORMAT " of shared filter\n", i);
+			ok = false;
+			break;
+		}
+	}
+
+	private = bloom_create(estimate, mem_kb, 0);
+	for (i = 0; i < nelems; i++)
+		bloom_add_element(private, elems + (size_t) i * width, width);
+	bloom_stats(shared, &sharedstats);
+	bloom_stats(private, &privatestats);
+	if (ok && sharedstats.bits_set != privatestats.bits_set)
+	{
+		printf("\nshared filter has " INT64_FORMAT " bits set, private filter has " INT64_FORMAT "\n",
+			   (int64) sharedstats.bits_set, (int64) privatestats.bits_set);
+		ok = false;
+	}
+
+	bloom_free(private);
+	free(mem);
+
+	return ok;
+}
+
+/*
+ * Benchmark one combination.  Returns false on a false negative.
+ */
+static bool
+bench_one(bench_kind kind, int64 nelems, int width, int mem_kb, int load,
+		  int64 nprobes, int repeats, uint64 *rstate)
+{
+	int64		estimate = Max(1, nelems * 100 / load);
+	unsigned char *elems;
+	unsigned char *probes;
+	bench_phase add = {0, 0};
+	bench_phase probe = {0, 0};
+	bench_phase batch = {0, 0};
+	double		build = 0;
+	bloom_filter_stats stats;
+	int64		falsepos = 0;
+	int			rep;
+
+	printf("%-8s %10lld %6d %8d %5d%%", kind_names[kind], (long long) nelems,
+		   width, mem_kb, load);
+
+	if ((int64) (nelems + nprobes) * width > MAX_ELEM_BYTES)
+	{
+		printf("  skipped: elements need more than %lld MB\n",
+			   (long long) (MAX_ELEM_BYTES >> 20));
+		return true;
+	}
+
+	elems = make_elements(nelems, width, 0, rstate);
+	probes = make_elements(nprobes, width, nelems, rstate);
+
+	for (rep = 0; rep < repeats; rep++)
+	{
+		bloom_filter *filter;
+		unsigned char *elemptrs[BATCH_SIZE];
+		size_t		lens[BATCH_SIZE];
+		bool		lacks[BATCH_SIZE];
+		double		start;
+		uint64		misses;
+		Size		base = shim_allocated;
+		int64		i;
+
+		shim_peak = base;
+		filter = create_filter(kind, estimate, mem_kb, rep);
+		if (!filter)
+		{
+			printf("  skipped: exceeds memory budget\n");
+			goto done;
+		}
+
+		/* Static filter is built by bloom_freeze(), so count that too */
+		phase_begin(&start, &misses);
+		for (i = 0; i < nelems; i++)
+			bloom_add_element(filter, elems + (size_t) i * width, width);
+		if (kind == KIND_STATIC && !bloom_freeze(filter))
+		{
+			printf("  skipped: overflowed memory budget\n");
+			bloom_free(filter);
+			goto done;
+		}
+		phase_end(&add, start, misses, Max(nelems, 1));
+		build += (double) (shim_peak - base) / Max(nelems, 1);
+
+		phase_begin(&start, &misses);
+		for (i = 0; i < nelems; i++)
+		{
+			if (bloom_lacks_element(filter, elems + (size_t) i * width, width))
+			{
+				printf("\nfalse negative for element " INT64_FORMAT "\n", i);
+				return false;
+			}
+		}
+		phase_end(&probe, start, misses, Max(nelems, 1));
+
+		phase_begin(&start, &misses);
+		for (i = 0; i < nprobes; i += BATCH_SIZE)
+		{
+			int			n = Min(nprobes - i, BATCH_SIZE);
+			int			j;
+
+			for (j = 0; j < n; j++)
+			{
+				elemptrs[j] = probes + (size_t) (i + j) * width;
+				lens[j] = width;
+			}
+			bloom_lacks_elements_batch(filter, n, elemptrs, lens, NULL, lacks);
+			for (j = 0; j < n; j++)
+				falsepos += !lacks[j];
+		}
+		phase_end(&batch, start, misses, Max(nprobes, 1));
+
+		bloom_stats(filter, &stats);
+		bloom_free(filter);
+	}
+
+	if (!check_union(kind, elems, nelems, width, estimate, mem_kb))
+		return false;
+	if (kind == KIND_BLOOM &&
+		!check_shared(elems, nelems, width, estimate, mem_kb))
+		return false;
+
+	printf(" %3d %7.2f %7.2f %8.1f", stats.hash_funcs,
+		   (double) stats.bits / Max(nelems, 1), build / repeats,
+		   add.ns / repeats);
+	print_misses(add.misses / repeats);
+	printf(" %8.1f", probe.ns / repeats);
+	print_misses(probe.misses / repeats);
+	printf(" %8.1f", batch.ns / repeats);
+	print_misses(batch.misses / repeats);
+	printf(" %8.4f %8.4f\n",
+		   100.0 * falsepos / ((double) Max(nprobes, 1) * repeats),
+		   100.0 * stats.false_positive_rate);
+
+done:
+	pfree(elems);
+	pfree(probes);
+
+	return true;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+			"Usage: %s [OPTION]...\n"
+			"Each option other than -p and -r takes a comma-separated list.\n"
+			"  -f KINDS    filter kinds: bloom, scalable, static (default all)\n"
+			"  -n COUNTS   elements added (default 100000,1000000)\n"
+			"  -w WIDTHS   element width in bytes, at least 8 (default 16,64)\n"
+			"  -m KB       memory budget in kB (default 1024,65536)\n"
+			"  -l LOADS    elements added as %% of elements expected (default 100)\n"
+			"  -p PROBES   probes for elements not added (default 1000000)\n"
+			"  -r REPEATS  runs averaged for each combination (default 3)\n",
+			progname);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64		rstate = UINT64CONST(88172645463325252);
+	bench_list	kinds = {{KIND_BLOOM, KIND_SCALABLE, KIND_STATIC}, 3};
+	bench_list	counts = {{100000, 1000000}, 2};
+	bench_list	widths = {{16, 64}, 2};
+	bench_list	mems = {{1024, 65536}, 2};
+	bench_list	loads = {{100}, 1};
+	int64		nprobes = 1000000;
+	int			repeats = 3;
+	int			c;
+	int			f,
+				n,
+				w,
+				m,
+				l;
+
+	while ((c = getopt(argc, argv, "f:n:w:m:l:p:r:")) != -1)
+	{
+		bool		ok;
+
+		switch (c)
+		{
+			case 'f':
+				ok = parse_kinds(optarg, &kinds);
+				break;
+			case 'n':
+				ok = parse_list(optarg, &counts);
+				break;
+			case 'w':
+				ok = parse_list(optarg, &widths);
+				for (w = 0; ok && w < widths.nvalues; w++)
+					ok = widths.values[w] >= (int64) sizeof(int64);
+				break;
+			case 'm':
+				ok = parse_list(optarg, &mems);
+				for (m = 0; ok && m < mems.nvalues; m++)
+					ok = mems.values[m] > 0 && mems.values[m] <= INT_MAX;
+				break;
+			case 'l':
+				ok = parse_list(optarg, &loads);
+				for (l = 0; ok && l < loads.nvalues; l++)
+					ok = loads.values[l] > 0;
+				break;
+			case 'p':
+				nprobes = strtoll(optarg, NULL, 10);
+				ok = nprobes >= 0;
+				break;
+			case 'r':
+				repeats = atoi(optarg);
+				ok = repeats > 0;
+				break;
+			default:
+				ok = false;
+				break;
+		}
+		if (!ok)
+			usage(argv[0]);
+	}
+	if (optind < argc)
+		usage(argv[0]);
+
+	misses_open();
+
+	printf("%-8s %10s %6s %8s %6s %3s %7s %7s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+		   "kind", "elements", "width", "mem kB", "load", "k", "bits/el",
+		   "build B", "add ns", "misses", "probe ns", "misses", "batch ns", "misses",
+		   "fp %", "est fp %");
+
+	for (f = 0; f < kinds.nvalues; f++)
+		for (n = 0; n < counts.nvalues; n++)
+			for (w = 0; w < widths.nvalues; w++)
+				for (m = 0; m < mems.nvalues; m++)
+					for (l = 0; l < loads.nvalues; l++)
+					{
+						fflush(stdout);
+						if (!bench_one(kinds.values[f], counts.values[n],
+									   widths.values[w], mems.values[m],
+									   loads.values[l], nprobes, repeats,
+									   &rstate))
+							return 1;
+					}
+
+	return 0;
+}
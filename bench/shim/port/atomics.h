@@ -0,0 +1,33 @@
+/*-------------------------------------------------------------------------
+ *
+ * atomics.h
+ *	  Minimal stand-in for the backend's port/atomics.h
+ *
+ * Only the 64-bit fetch-or that shared Bloom filters use is provided, on top
+ * of the compiler's __atomic builtins.
+ *
+ * Portions Copyright (c) 2016-2020, Peter Geoghegan
+ * Portions Copyright (c) 1996-2020, The PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  amcheck_next/bench/shim/port/atomics.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef ATOMICS_H
+#define ATOMICS_H
+
+#define PG_HAVE_ATOMIC_U64_SUPPORT
+
+typedef struct pg_atomic_uint64
+{
+	volatile uint64 value;
+} pg_atomic_uint64;
+
+static inline uint64
+pg_atomic_fetch_or_u64(volatile pg_atomic_uint64 *ptr, uint64 or_)
+{
+	return __atomic_fetch_or(&ptr->value, or_, __ATOMIC_SEQ_CST);
+}
+
+#endif							/* ATOMICS_H */
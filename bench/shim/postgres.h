@@ -0,0 +1,117 @@
+/*-------------------------------------------------------------------------
+ *
+ * postgres.h
+ *	  Minimal stand-in for the backend's postgres.h, sufficient to build
+ *	  bloomfilter.c outside of the server for benchmarking
+ *
+ * Only the handful of definitions that bloomfilter.c actually relies on are
+ * provided.  Memory is allocated with malloc(), and there is no memory
+ * context machinery at all.  Bytes allocated are counted, along with their
+ * high-water mark, so that the benchmark can report the memory that building
+ * a filter takes.  Bitsets that bloomfilter.c maps from the kernel aren't
+ * counted.
+ *
+ * Portions Copyright (c) 2016-2020, Peter Geoghegan
+ * Portions Copyright (c) 1996-2020, The PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  amcheck_next/bench/shim/postgres.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef POSTGRES_H
+#define POSTGRES_H
+
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
+typedef int64_t int64;
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+typedef size_t Size;
+
+#define PG_VERSION_NUM			100000
+#define SIZEOF_SIZE_T			__SIZEOF_SIZE_T__
+
+#define INT64CONST(x)			(x##LL)
+#define UINT64CONST(x)			(x##ULL)
+#define INT64_FORMAT			"%" PRId64
+#define BITS_PER_BYTE			8
+#define FLEXIBLE_ARRAY_MEMBER	/* empty */
+
+#define Min(x, y)				((x) < (y) ? (x) : (y))
+#define Max(x, y)				((x) > (y) ? (x) : (y))
+#define TYPEALIGN(ALIGNVAL,LEN)  \
+	(((uintptr_t) (LEN) + ((ALIGNVAL) - 1)) & ~((uintptr_t) ((ALIGNVAL) - 1)))
+
+#define likely(x)				__builtin_expect((x) != 0, 1)
+#define unlikely(x)				__builtin_expect((x) != 0, 0)
+
+#ifdef USE_ASSERT_CHECKING
+#define Assert(condition)		assert(condition)
+#else
+#define Assert(condition)		((void) true)
+#endif
+
+#define WARNING					19
+#define ERROR					20
+#define elog(elevel, ...) \
+	do { \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+		if ((elevel) >= ERROR) \
+			exit(1); \
+	} while (0)
+
+/* Defined by the benchmark program */
+extern Size shim_allocated;
+extern Size shim_peak;
+
+static inline void
+shim_count(Size oldsize, Size newsize)
+{
+	shim_allocated += newsize - oldsize;
+	if (shim_allocated > shim_peak)
+		shim_peak = shim_allocated;
+}
+
+static inline void *
+shim_alloc(Size size, bool zero)
+{
+	void	   *ptr = zero ? calloc(1, size) : malloc(size);
+
+	if (ptr == NULL)
+	{
+		fprintf(stderr, "out of memory (requested %zu bytes)\n", size);
+		exit(1);
+	}
+	shim_count(0, malloc_usable_size(ptr));
+
+	return ptr;
+}
+
+static inline void
+shim_free(void *ptr)
+{
+	shim_count(malloc_usable_size(ptr), 0);
+	free(ptr);
+}
+
+#define palloc(sz)				shim_alloc((sz), false)
+#define palloc0(sz)				shim_alloc((sz), true)
+#define pfree(ptr)				shim_free(ptr)
+
+#endif							/* POSTGRES_H */
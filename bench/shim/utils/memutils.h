@@ -0,0 +1,46 @@
+/*-------------------------------------------------------------------------
+ *
+ * memutils.h
+ *	  Minimal stand-in for the backend's utils/memutils.h
+ *
+ * There is only one "memory context", which is malloc() itself.
+ *
+ * Portions Copyright (c) 2016-2020, Peter Geoghegan
+ * Portions Copyright (c) 1996-2020, The PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  amcheck_next/bench/shim/utils/memutils.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef MEMUTILS_H
+#define MEMUTILS_H
+
+typedef void *MemoryContext;
+
+#define CurrentMemoryContext	((MemoryContext) NULL)
+
+#define MemoryContextAlloc(cxt, sz)		shim_alloc((sz), false)
+#define MemoryContextAllocHuge(cxt, sz)	shim_alloc((sz), false)
+#define MemoryContextAllocZero(cxt, sz)	shim_alloc((sz), true)
+
+/*
+ * Always allocates a new chunk and copies, which is the worst case for the
+ * realloc() that the backend uses for large chunks, so that the peak allows
+ * for both chunks
+ */
+static inline void *
+repalloc_huge(void *ptr, Size size)
+{
+	void	   *newptr = shim_alloc(size, false);
+	Size		oldsize = malloc_usable_size(ptr);
+
+	memcpy(newptr, ptr, Min(oldsize, size));
+	shim_free(ptr);
+
+	return newptr;
+}
+
+#define repalloc(ptr, sz)				repalloc_huge((ptr), (sz))
+
+#endif							/* MEMUTILS_H */
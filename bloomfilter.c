@@ -24,6 +24,24 @@
  * caller many authoritative lookups, such as expensive probes of a much larger
  * on-disk structure.
  *
+ * Large bitsets use a "blocked" layout, where all k bits for an element are
+ * confined to a single cache line sized block of the bitset.  This costs a
+ * little accuracy, but bounds the number of cache misses (and TLB misses) per
+ * operation at one, rather than k.  See "Cache-, Hash- and Space-Efficient
+ * Bloom Filters" (Putze, Sanders & Singler, 2007) for details.  Small bitsets
+ * that are likely to stay cache resident use the standard layout.
+ *
+ * Static filters, from fusefilter.c, are an alternative to Bloom filters for
+ * sets whose elements are all added before any are probed.  Functions that
+ * add and probe elements work with either kind of filter, by dispatching
+ * through the kind's filter_ops (see filterops.h).
+ *
+ * A Bloom filter can also be created in shared memory, so that several
+ * processes can add elements to the same filter concurrently.  Bits are then
+ * set using atomic operations.  Alternatively, processes can each fill a
+ * private filter, and then combine the filters with bloom_union(), provided
+ * that all filters were created with the same arguments.
+ *
  * Portions Copyright (c) 2016-2020, Peter Geoghegan
  * Portions Copyright (c) 1996-2020, The PostgreSQL Global Development Group
  * Portions Copyright (c) 1994, The Regents of the University of California
@@ -36,28 +54,293 @@
 #include "postgres.h"
 
 #include <math.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "filterops.h"
+#if defined(FRONTEND) || PG_VERSION_NUM >= 90500
+#include "port/atomics.h"
+#endif
+#include "utils/memutils.h"
 
-#include "access/hash.h"
-#include "bloomfilter.h"
+/*
+ * Batch routines can use AVX2 to generate bit positions and test bits for
+ * several elements at once, and to count bits set.  Whether or not the CPU
+ * supports AVX2 is checked at runtime, on first use.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USE_AVX2_WITH_RUNTIME_CHECK
+#include <immintrin.h>
+#endif
 
 #define MAX_HASH_FUNCS		10
 
+/*
+ * Blocked layout parameters.  A block is one 64 byte cache line, which is
+ * addressed as 8 64-bit words.  Bitsets of BLOOM_BLOCKED_MIN_BYTES or more are
+ * unlikely to stay cache resident, and so use the blocked layout.
+ */
+#define BLOOM_BLOCK_BYTES		64
+#define BLOOM_BLOCK_BITS		(BLOOM_BLOCK_BYTES * BITS_PER_BYTE)
+#define BLOOM_BLOCKED_MIN_BYTES	(UINT64CONST(32) * 1024 * 1024)
+
+/*
+ * Smallest bitset for filters from bloom_create(), and for the first slice of
+ * filters from bloom_create_scalable().  Scalable filters can afford to trust
+ * a small total_elems estimate, since they grow when it is exceeded.
+ */
+#define BLOOM_MIN_BYTES			(UINT64CONST(1024) * 1024)
+#define BLOOM_SCALABLE_MIN_BYTES	UINT64CONST(8192)
+
+/*
+ * Bitsets of at least BLOOM_MAPPED_MIN_BYTES are mapped directly from the
+ * kernel, rather than being allocated along with the rest of the filter.  The
+ * kernel zeroes each page on first touch, so there is no up-front memset(),
+ * and transparent huge pages are requested, to reduce TLB misses.  Explicit
+ * huge pages (MAP_HUGETLB) aren't used, since those that the administrator
+ * reserved are meant for shared_buffers.
+ *
+ * Each mapping is owned by a small memory context of its own, a child of the
+ * context that the filter was allocated in, which shows up in
+ * MemoryContextStats() output.  The mapping is released when that context is
+ * deleted, so it cannot leak on error.  Memory context reset callbacks first
+ * appeared in PostgreSQL 9.5.
+ */
+#if !defined(WIN32) && (defined(FRONTEND) || PG_VERSION_NUM >= 90500)
+#define BLOOM_USE_MMAP
+#define BLOOM_MAPPED_MIN_BYTES	(UINT64CONST(32) * 1024 * 1024)
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS			MAP_ANON
+#endif
+#endif
+
+/*
+ * Filters in shared memory set bits with an atomic OR, since other processes
+ * may be setting bits in the same word.  That's only possible where 64-bit
+ * atomics are native, since simulated atomics need a spinlock alongside each
+ * word.  port/atomics.h first appeared in PostgreSQL 9.5.
+ */
+#if defined(PG_HAVE_ATOMIC_U64_SUPPORT) && \
+	!defined(PG_HAVE_ATOMIC_U64_SIMULATION)
+#define BLOOM_USE_SHARED
+#endif
+
+/*
+ * Ranged filters divide a blocked bitset into segments of this many blocks.
+ * Segments are 256KB, which is small enough to stay cache resident while
+ * elements with nearby range keys are probed.
+ */
+#define BLOOM_SEGMENT_BLOCKS	4096
+#define BLOOM_SEGMENT_BITS		(BLOOM_SEGMENT_BLOCKS * BLOOM_BLOCK_BITS)
+
+/*
+ * A ranged filter is only enabled when a sample of range keys hits at least
+ * half of this many equal divisions of the range key space.  That rules out
+ * elements bunched up in a small part of it.
+ */
+#define BLOOM_RANGE_DIVISIONS	16
+
+/*
+ * Most elements that one segment of a ranged filter may take, as a multiple
+ * of its fair share of the slice's elements, in percent.  A segment with a
+ * quarter more than its fair share has a false positive rate two to three
+ * times that of the slice as a whole.
+ */
+#define BLOOM_SEGMENT_SLACK		125
+
+/*
+ * Largest bitset, as a power of two number of bits.  2^36 bits is 8GB, which
+ * is enough to get the standard false positive rate for 4 billion elements.
+ * Platforms with a 32-bit size_t are limited to a 512MB bitset.
+ */
+#if SIZEOF_SIZE_T > 4
+#define MAX_BLOOM_POWER			36
+#else
+#define MAX_BLOOM_POWER			32
+#endif
+
+/*
+ * Serialized Bloom filter header.  Bitset follows immediately.
+ *
+ * hash64() values vary across platforms, so a hash of a fixed element is
+ * stored alongside the seed.  A filter can only be deserialized on a platform
+ * that produces the same hash.
+ */
+#define BLOOM_SERIALIZED_MAGIC	0x424C4F4D	/* "BLOM" */
+#define BLOOM_CHECK_ELEM		"amcheck_next"
+
+/*
+ * Bitset mapped from the kernel.  This is allocated in the mapping's own
+ * memory context, whose reset callback list links through it until the
+ * context is deleted.
+ */
+typedef struct bloom_mapping
+{
+	void	   *addr;
+	Size		size;
+#ifndef FRONTEND
+	MemoryContext context;
+	MemoryContextCallback callback;
+#endif
+} bloom_mapping;
+
+typedef struct bloom_serialized
+{
+	uint32		magic;
+	int32		k_hash_funcs;
+	uint32		blocked;
+	uint32		slice;
+	uint64		seed;
+	uint64		m;
+	uint64		nranges;
+	uint64		checkhash;
+} bloom_serialized;
+
 struct bloom_filter
 {
-	/* K hash functions are used, seeded by caller's seed */
+	/* Kind is FILTER_BLOOM, and elements are hashed with caller's seed */
+	filter_header hdr;
+	/* K hash functions are used */
 	int			k_hash_funcs;
-	uint64		seed;
-	/* m is bitset size, in bits.  Must be a power of two <= 2^32.  */
+	/* Are all k bits for an element confined to one block? */
+	bool		blocked;
+	/* Is filter in shared memory, requiring atomic bit setting? */
+	bool		shared;
+	/* m is bitset size, in bits.  Must be a power of two <= 2^36.  */
 	uint64		m;
-	unsigned char bitset[FLEXIBLE_ARRAY_MEMBER];
+	/* Range keys are < nranges, or 0 when filter isn't ranged */
+	uint64		nranges;
+	/* Bitset segments used by ranged filter, or 0 when not in use */
+	uint64		nsegments;
+	uint64		ranges_per_segment;
+	/* Ranged filters only: elements added to each segment */
+	int64	   *segment_elems;
+
+	/*
+	 * Scalable filters are a chain of slices, each with its own bitset.  A
+	 * new, larger slice is added once the last slice is full.  Fields that
+	 * concern the chain as a whole are only maintained in the first slice.
+	 */
+	bool		scalable;
+	/* Position of slice in chain, starting from 0 */
+	int			slice;
+	/* Elements added to slice, and number it takes before growing (-1: any) */
+	int64		nelems;
+	int64		capacity;
+	/* Next slice in chain */
+	bloom_filter *next;
+	/* First slice only: last slice, context, and bytes left for new slices */
+	bloom_filter *last;
+	MemoryContext context;
+	uint64		budget;
+	/* Mapped bitset, or NULL when bitset follows */
+	bloom_mapping *mapping;
+	/* Bitset proper starts at first BLOOM_BLOCK_BYTES boundary */
+	uint64		words[FLEXIBLE_ARRAY_MEMBER];
 };
 
+/*
+ * Bit positions for a batch of elements.  Position i of batch element j is
+ * stored at [i][j], so that positions for several elements can be generated
+ * and tested together.
+ */
+typedef uint64 batch_positions[MAX_HASH_FUNCS][FILTER_BATCH_SIZE];
+
+static void bitset_add_hashes(bloom_filter *filter, int nhashes,
+				  uint64 *hashes, uint64 *ranges);
+static void bitset_lacks_hashes(bloom_filter *filter, int nhashes,
+					uint64 *hashes, uint64 *ranges, bool *lacks);
+static bool bitset_freeze(bloom_filter *filter);
+static void bitset_stats(bloom_filter *filter, bloom_filter_stats *stats);
+static void bitset_free(bloom_filter *filter);
+static uint64 bloom_target_bits(int64 total_elems, int bloom_work_mem,
+				  uint64 min_bytes);
+static Size bloom_alloc_size(uint64 bitset_bits);
+static bloom_filter *bloom_alloc(MemoryContext context, uint64 bitset_bits);
+#ifdef BLOOM_USE_MMAP
+static void bloom_unmap(void *arg);
+#endif
+static void bloom_init(bloom_filter *filter, uint64 bitset_bits,
+		   int64 total_elems, uint64 seed);
 static int	my_bloom_power(uint64 target_bitset_bits);
 static int	optimal_k(uint64 bitset_bits, int64 total_elems);
-static void k_hashes(bloom_filter *filter, uint32 *hashes, unsigned char *elem,
-		 size_t len);
-static inline uint32 mod_m(uint32 a, uint64 m);
-static uint32 sdbmhash(unsigned char *elem, size_t len);
+static void k_hashes(bloom_filter *filter, uint64 *hashes, int stride,
+		 uint64 hash);
+static void k_hashes_batch_choose(bloom_filter *filter, uint64 *hashvals,
+					  int nelems, batch_positions positions);
+static void k_hashes_batch_scalar(bloom_filter *filter, uint64 *hashvals,
+					  int nelems, batch_positions positions);
+static void test_bits_batch_choose(bloom_filter *filter, uint64 *bitset,
+					   batch_positions positions, int nelems,
+					   bool *lacks);
+static void test_bits_batch_scalar(bloom_filter *filter, uint64 *bitset,
+					   batch_positions positions, int nelems,
+					   bool *lacks);
+static uint64 popcount_words_choose(uint64 *words, uint64 nwords);
+static uint64 popcount_words_scalar(uint64 *words, uint64 nwords);
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+static void k_hashes_batch_avx2(bloom_filter *filter, uint64 *hashvals,
+					int nelems, batch_positions positions);
+static void test_bits_batch_avx2(bloom_filter *filter, uint64 *bitset,
+					 batch_positions positions, int nelems,
+					 bool *lacks);
+static uint64 popcount_words_avx2(uint64 *words, uint64 nwords);
+#endif
+static inline uint64 mod_m(uint64 a, uint64 m);
+static void slice_set_ranges(bloom_filter *slice, uint64 nranges,
+				 MemoryContext context);
+static bool ranges_spread(uint64 nranges, uint64 *sample, int nsample);
+static uint64 segment_bits_set(bloom_filter *slice, uint64 segment);
+static inline uint64 range_segment(bloom_filter *slice, uint64 range);
+static inline uint64 segment_hash(bloom_filter *filter, uint64 hash,
+			 uint64 range);
+static inline uint64 slice_hash(bloom_filter *slice, uint64 hash);
+static bloom_filter *add_slice(bloom_filter *filter, int nelems);
+static int64 slice_capacity(bloom_filter *slice);
+static uint64 slice_bits_set(bloom_filter *slice);
+static inline uint64 *bloom_bitset(bloom_filter *filter);
+static inline void set_bits(bloom_filter *filter, uint64 *bitset,
+		 uint64 *hashes, int stride);
+static inline bool test_bits(bloom_filter *filter, uint64 *bitset,
+		  uint64 *hashes, int stride);
+static inline void prefetch_bits(bloom_filter *filter, uint64 *bitset,
+			  uint64 *hashes, int stride, bool forwrite);
+static uint64 hash64(unsigned char *elem, size_t len, uint64 seed);
+
+/*
+ * Batch routines for generating bit positions and testing bits.  These start
+ * out pointing to a routine that chooses the best implementation for the
+ * current CPU on first call.  All implementations must produce exactly the
+ * same bit positions as k_hashes().
+ */
+static void (*k_hashes_batch) (bloom_filter *filter, uint64 *hashvals,
+							   int nelems, batch_positions positions) =
+	k_hashes_batch_choose;
+static void (*test_bits_batch) (bloom_filter *filter, uint64 *bitset,
+								batch_positions positions, int nelems,
+								bool *lacks) = test_bits_batch_choose;
+static uint64 (*popcount_words) (uint64 *words, uint64 nwords) =
+	popcount_words_choose;
+
+static const filter_ops bitset_filter_ops = {
+	bitset_add_hashes,
+	bitset_lacks_hashes,
+	bitset_freeze,
+	bitset_stats,
+	bitset_free
+};
+
+/* Ops of each kind of filter, indexed by filter_kind */
+static const filter_ops *const filter_kind_ops[] = {
+	&bitset_filter_ops,			/* FILTER_BLOOM */
+	&fuse_filter_ops			/* FILTER_FUSE */
+};
+
+#define FILTER_OPS(filter) \
+	(filter_kind_ops[((filter_header *) (filter))->kind])
+#define FILTER_IS_BLOOM(filter) \
+	(((filter_header *) (filter))->kind == FILTER_BLOOM)
 
 /*
  * Create Bloom filter in caller's memory context.  We aim for a false positive
@@ -73,11 +356,12 @@ static uint32 sdbmhash(unsigned char *elem, size_t len);
  * bloom_work_mem is sized in KB, in line with the general work_mem convention.
  * This determines the size of the underlying bitset (trivial bookkeeping space
  * isn't counted).  The bitset is always sized as a power of two number of
- * bits, and the largest possible bitset is 512MB (2^32 bits).  The
+ * bits, and the largest possible bitset is 8GB (2^36 bits).  The
  * implementation allocates only enough memory to target its standard false
  * positive rate, using a simple formula with caller's total_elems estimate as
  * an input.  The bitset might be as small as 1MB, even when bloom_work_mem is
- * much higher.
+ * much higher.  Bitsets of BLOOM_BLOCKED_MIN_BYTES or more use the blocked
+ * layout.
  *
  * The Bloom filter is seeded using a value provided by the caller.  Using a
  * distinct seed value on every call makes it unlikely that the same false
@@ -90,84 +374,288 @@ bloom_filter *
 bloom_create(int64 total_elems, int bloom_work_mem, uint64 seed)
 {
 	bloom_filter *filter;
-	int			bloom_power;
-	uint64		bitset_bytes;
 	uint64		bitset_bits;
 
-	/*
-	 * Aim for two bytes per element; this is sufficient to get a false
-	 * positive rate below 1%, independent of the size of the bitset or total
-	 * number of elements.  Also, if rounding down the size of the bitset to
-	 * the next lowest power of two turns out to be a significant drop, the
-	 * false positive rate still won't exceed 2% in almost all cases.
-	 */
-	bitset_bytes = Min(bloom_work_mem * UINT64CONST(1024), total_elems * 2);
-	bitset_bytes = Max(1024 * 1024, bitset_bytes);
+	bitset_bits = bloom_target_bits(total_elems, bloom_work_mem,
+									BLOOM_MIN_BYTES);
 
-	/*
-	 * Size in bits should be the highest power of two <= target.  bitset_bits
-	 * is uint64 because PG_UINT32_MAX is 2^32 - 1, not 2^32
-	 */
-	bloom_power = my_bloom_power(bitset_bytes * BITS_PER_BYTE);
-	bitset_bits = UINT64CONST(1) << bloom_power;
-	bitset_bytes = bitset_bits / BITS_PER_BYTE;
+	/* Allocate bloom filter with unset bitset.  May exceed MaxAllocSize. */
+	filter = bloom_alloc(CurrentMemoryContext, bitset_bits);
+	bloom_init(filter, bitset_bits, total_elems, seed);
 
-	/* Allocate bloom filter with unset bitset */
-	filter = palloc0(offsetof(bloom_filter, bitset) +
-					 sizeof(unsigned char) * bitset_bytes);
-	filter->k_hash_funcs = optimal_k(bitset_bits, total_elems);
-	filter->seed = seed;
-	filter->m = bitset_bits;
+	return filter;
+}
+
+/*
+ * Create scalable Bloom filter in caller's memory context.
+ *
+ * Arguments are the same as bloom_create(), and the filter starts out the
+ * same size as a filter from bloom_create() would be, except that it may be
+ * as small as BLOOM_SCALABLE_MIN_BYTES rather than 1MB.  When more elements
+ * are added than total_elems anticipated, the filter grows by adding slices
+ * with bitsets that are twice as large as the last one, and with one more
+ * hash function.  The false positive rate of each slice at capacity is about
+ * half that of the last slice, so the overall false positive rate stays
+ * bounded.  Slices never use more than bloom_work_mem in total; once that is
+ * used up, the last slice takes all further elements, at the expense of a
+ * rising false positive rate.  bloom_stats() estimates the rate actually
+ * achieved.
+ *
+ * Scalable filters are useful when total_elems could be a significant
+ * underestimate, since a filter that gets far more elements than it was
+ * sized for is all but useless.
+ */
+bloom_filter *
+bloom_create_scalable(int64 total_elems, int bloom_work_mem, uint64 seed)
+{
+	bloom_filter *filter;
+	uint64		bitset_bits;
+	uint64		budget = bloom_work_mem * UINT64CONST(1024);
+
+	bitset_bits = bloom_target_bits(total_elems, bloom_work_mem,
+									BLOOM_SCALABLE_MIN_BYTES);
+
+	filter = bloom_alloc(CurrentMemoryContext, bitset_bits);
+	bloom_init(filter, bitset_bits, total_elems, seed);
+
+	filter->scalable = true;
+	filter->capacity = slice_capacity(filter);
+	filter->context = CurrentMemoryContext;
+	filter->budget = budget - Min(budget, filter->m / BITS_PER_BYTE);
 
 	return filter;
 }
 
 /*
- * Free Bloom filter
+ * Prepare filter for probes, once all elements have been added.  No more
+ * elements may be added afterwards.
+ *
+ * A static filter is built from the elements added to it here.  Returns false
+ * when it couldn't be, because more elements were added than fit in the
+ * memory budget, or, very rarely, because construction failed repeatedly.
+ * Caller should then fall back on a Bloom filter.  Bloom filters can be
+ * probed at any time, so always return true.
+ */
+bool
+bloom_freeze(bloom_filter *filter)
+{
+	return FILTER_OPS(filter)->freeze(filter);
+}
+
+/*
+ * Number of partitions that a set of total_elems elements must be split into
+ * so that a Bloom filter limited to bloom_work_mem can fingerprint each
+ * partition at our standard false positive rate.
+ *
+ * Callers that fingerprint each partition in turn should pass the number of
+ * elements in one partition to bloom_create().
+ */
+int
+bloom_partitions(int64 total_elems, int bloom_work_mem)
+{
+	uint64		max_bytes;
+	uint64		npartitions;
+
+	/* Largest bitset that bloom_work_mem permits, in bytes */
+	max_bytes = bloom_target_bits(bloom_work_mem * INT64CONST(1024),
+								  bloom_work_mem,
+								  BLOOM_MIN_BYTES) / BITS_PER_BYTE;
+
+	npartitions = (total_elems * UINT64CONST(2) + max_bytes - 1) / max_bytes;
+
+	return (int) Max(1, Min(npartitions, INT_MAX));
+}
+
+/*
+ * Size of shared memory needed for a filter from bloom_init_shared(), given
+ * the same arguments as bloom_create()
+ */
+Size
+bloom_shared_size(int64 total_elems, int bloom_work_mem)
+{
+	return bloom_alloc_size(bloom_target_bits(total_elems, bloom_work_mem,
+											  BLOOM_MIN_BYTES));
+}
+
+/*
+ * Initialize Bloom filter in caller's shared memory, which must be at least
+ * bloom_shared_size() bytes, and aligned to a BLOOM_BLOCK_BYTES boundary in
+ * every process that maps it.
+ *
+ * Sizing and seeding work just as they do for bloom_create().  Any process
+ * that maps the memory may add elements to the filter concurrently.
+ * Processes that probe the filter must only do so once all processes have
+ * finished adding elements.  Shared filters can't be made ranged, and are
+ * released along with their memory, rather than by calling bloom_free().
+ */
+bloom_filter *
+bloom_init_shared(void *mem, int64 total_elems, int bloom_work_mem,
+				  uint64 seed)
+{
+#ifdef BLOOM_USE_SHARED
+	bloom_filter *filter = (bloom_filter *) mem;
+	uint64		bitset_bits;
+
+	Assert(TYPEALIGN(BLOOM_BLOCK_BYTES, mem) == (uintptr_t) mem);
+
+	bitset_bits = bloom_target_bits(total_elems, bloom_work_mem,
+									BLOOM_MIN_BYTES);
+
+	/* Shared memory isn't zeroed, so unset bitset explicitly */
+	memset(filter, 0, bloom_alloc_size(bitset_bits));
+	bloom_init(filter, bitset_bits, total_elems, seed);
+	filter->shared = true;
+
+	return filter;
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("shared Bloom filters require native 64-bit atomic operations")));
+	return NULL;				/* keep compiler quiet */
+#endif
+}
+
+#ifndef FRONTEND
+
+/*
+ * Create Bloom filter in a new dynamic shared memory segment.
+ *
+ * The segment is returned in *segment, so that caller can pass its handle to
+ * other processes that need to attach to the filter with
+ * bloom_attach_shared().  See bloom_init_shared() for details.  Callers
+ * release the filter by detaching from the segment.
+ */
+bloom_filter *
+bloom_create_shared(int64 total_elems, int bloom_work_mem, uint64 seed,
+					dsm_segment **segment)
+{
+#ifdef BLOOM_USE_SHARED
+	*segment = dsm_create(bloom_shared_size(total_elems, bloom_work_mem), 0);
+
+	return bloom_init_shared(dsm_segment_address(*segment), total_elems,
+							 bloom_work_mem, seed);
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("shared Bloom filters require native 64-bit atomic operations")));
+	return NULL;				/* keep compiler quiet */
+#endif
+}
+
+/*
+ * Attach to Bloom filter created in another process by bloom_create_shared()
+ */
+bloom_filter *
+bloom_attach_shared(dsm_handle handle, dsm_segment **segment)
+{
+	bloom_filter *filter;
+
+	*segment = dsm_attach(handle);
+	if (*segment == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not attach to shared Bloom filter segment")));
+
+	filter = (bloom_filter *) dsm_segment_address(*segment);
+	Assert(filter->shared);
+
+	return filter;
+}
+
+#endif							/* FRONTEND */
+
+/*
+ * Free filter
  */
 void
 bloom_free(bloom_filter *filter)
 {
-	pfree(filter);
+	FILTER_OPS(filter)->free(filter);
 }
 
 /*
- * Add element to Bloom filter
+ * Make filter ranged.  Must be called before any elements are added.
+ *
+ * Elements added to and probed in a ranged filter come with a range key,
+ * which must be less than nranges, such as the heap block that an index tuple
+ * points to.  All of the bits for elements whose range keys fall in one
+ * contiguous run of keys are confined to one small segment of the bitset.
+ * Probing elements in range key order therefore works through the bitset one
+ * cache resident segment at a time, instead of touching a random part of a
+ * large bitset for each element.
+ *
+ * This only works out when elements are spread fairly evenly across range
+ * keys, since a segment that gets more than its share of elements has a
+ * higher false positive rate.  Caller may pass a sample of the range keys of
+ * the elements it expects to add.  The filter is left unranged when the
+ * sample is bunched up in a small part of the range key space.  Caller should
+ * still check bloom_ranges_overflowed() once all elements have been added,
+ * since a sample can't rule out every uneven spread.
+ *
+ * Only bitsets with the blocked layout are ever large enough to benefit from
+ * this, so other slices of a scalable filter ignore range keys.  So do slices
+ * with fewer range keys than segments.
+ *
+ * Returns false when filter was left unranged, in which case range keys are
+ * ignored by every slice.
  */
-void
-bloom_add_element(bloom_filter *filter, unsigned char *elem, size_t len)
+bool
+bloom_set_ranges(bloom_filter *filter, uint64 nranges, uint64 *sample,
+				 int nsample)
 {
-	uint32		hashes[MAX_HASH_FUNCS];
-	int			i;
+	Assert(filter->next == NULL);
+	Assert(FILTER_IS_BLOOM(filter) && !filter->shared);
 
-	k_hashes(filter, hashes, elem, len);
+	if (sample && !ranges_spread(nranges, sample, nsample))
+		nranges = 0;
 
-	/* Map a bit-wise address to a byte-wise address + bit offset */
-	for (i = 0; i < filter->k_hash_funcs; i++)
-	{
-		filter->bitset[hashes[i] >> 3] |= 1 << (hashes[i] & 7);
-	}
+	slice_set_ranges(filter, nranges,
+					 filter->context ? filter->context : CurrentMemoryContext);
+
+	return nranges > 0;
 }
 
 /*
- * Test if Bloom filter definitely lacks element.
+ * Did any segment of a ranged filter get so many more elements than its fair
+ * share that its false positive rate is well above the rest of the filter's?
  *
- * Returns true if the element is definitely not in the set of elements
- * observed by bloom_add_element().  Otherwise, returns false, indicating that
- * element is probably present in set.
+ * A segment's fair share is the number of elements at which about half of its
+ * bits are set, or the average across segments of its slice, if more.  When
+ * this returns true, caller should add all elements to an unranged filter
+ * instead.
+ *
+ * Besides elements whose range keys are bunched up, this catches a scalable
+ * filter that grew while elements were being added in range key order.  Each
+ * slice only has elements from part of the range key space then, so only
+ * some of its segments are used.
  */
 bool
-bloom_lacks_element(bloom_filter *filter, unsigned char *elem, size_t len)
+bloom_ranges_overflowed(bloom_filter *filter)
 {
-	uint32		hashes[MAX_HASH_FUNCS];
-	int			i;
+	bloom_filter *slice;
 
-	k_hashes(filter, hashes, elem, len);
+	if (!FILTER_IS_BLOOM(filter))
+		return false;
 
-	/* Map a bit-wise address to a byte-wise address + bit offset */
-	for (i = 0; i < filter->k_hash_funcs; i++)
+	for (slice = filter; slice; slice = slice->next)
 	{
-		if (!(filter->bitset[hashes[i] >> 3] & (1 << (hashes[i] & 7))))
+		int64		total = 0;
+		int64		most = 0;
+		int64		fair;
+		uint64		i;
+
+		if (slice->nsegments == 0)
+			continue;
+
+		for (i = 0; i < slice->nsegments; i++)
+		{
+			total += slice->segment_elems[i];
+			most = Max(most, slice->segment_elems[i]);
+		}
+
+		fair = (int64) (BLOOM_SEGMENT_BITS * log(2.0) / slice->k_hash_funcs);
+		fair = Max(fair, total / (int64) slice->nsegments);
+		if (most * 100 > fair * BLOOM_SEGMENT_SLACK)
 			return true;
 	}
 
@@ -175,154 +663,1472 @@ bloom_lacks_element(bloom_filter *filter, unsigned char *elem, size_t len)
 }
 
 /*
- * What proportion of bits are currently set?
- *
- * Returns proportion, expressed as a multiplier of filter size.  That should
- * generally be close to 0.5, even when we have more than enough memory to
- * ensure a false positive rate within target 1% to 2% band, since more hash
- * functions are used as more memory is available per element.
+ * Prefetch the bitset segment that follows the segment for range key range,
+ * ahead of probes for elements from the next run of range keys.
  *
- * This is the only instrumentation that is low overhead enough to appear in
- * debug traces.  When debugging Bloom filter code, it's likely to be far more
- * interesting to directly test the false positive rate.
+ * Returns the first range key of the segment prefetched, which is where
+ * caller should call here again when probing in range key order.  Filters
+ * that don't use segments, including every filter that isn't a Bloom filter,
+ * return the largest possible range key.
  */
-double
-bloom_prop_bits_set(bloom_filter *filter)
+uint64
+bloom_prefetch_range(bloom_filter *filter, uint64 range)
 {
-	int			bitset_bytes = filter->m / BITS_PER_BYTE;
-	uint64		bits_set = 0;
-	int			i;
+	uint64		nextrange = ~UINT64CONST(0);
+	bloom_filter *slice;
 
-	for (i = 0; i < bitset_bytes; i++)
+	if (!FILTER_IS_BLOOM(filter))
+		return nextrange;
+
+	for (slice = filter; slice; slice = slice->next)
 	{
-		unsigned char byte = filter->bitset[i];
+		unsigned char *bitset = (unsigned char *) bloom_bitset(slice);
+		uint64		segment;
+		uint64		offset;
 
-		while (byte)
-		{
-			bits_set++;
-			byte &= (byte - 1);
-		}
+		if (slice->nsegments == 0)
+			continue;
+
+		segment = Min(range / slice->ranges_per_segment,
+					  slice->nsegments - 1) + 1;
+		if (segment >= slice->nsegments)
+			continue;
+
+		bitset += segment * (BLOOM_SEGMENT_BITS / BITS_PER_BYTE);
+		for (offset = 0;
+			 offset < BLOOM_SEGMENT_BITS / BITS_PER_BYTE;
+			 offset += BLOOM_BLOCK_BYTES)
+			filter_prefetch(bitset + offset, 0);
+
+		nextrange = Min(nextrange, segment * slice->ranges_per_segment);
 	}
 
-	return bits_set / (double) filter->m;
+	return nextrange;
 }
 
 /*
- * Which element in the sequence of powers of two is less than or equal to
- * target_bitset_bits?
+ * Add element to filter
+ */
+void
+bloom_add_element(bloom_filter *filter, unsigned char *elem, size_t len)
+{
+	uint64		hash = hash64(elem, len, ((filter_header *) filter)->seed);
+
+	FILTER_OPS(filter)->add_hashes(filter, 1, &hash, NULL);
+}
+
+/*
+ * Add a batch of elements to filter
  *
- * Value returned here must be generally safe as the basis for actual bitset
- * size.
+ * Equivalent to calling bloom_add_element() for each element in turn, but
+ * cache misses are overlapped by prefetching the bits for many elements
+ * before setting any of them.
  *
- * Bitset is never allowed to exceed 2 ^ 32 bits (512MB).  This is sufficient
- * for the needs of all current callers, and allows us to use 32-bit hash
- * functions.  It also makes it easy to stay under the MaxAllocSize restriction
- * (caller needs to leave room for non-bitset fields that appear before
- * flexible array member, so a 1GB bitset would use an allocation that just
- * exceeds MaxAllocSize).
+ * ranges holds each element's range key when filter is ranged, and may be
+ * NULL otherwise.
  */
-static int
-my_bloom_power(uint64 target_bitset_bits)
+void
+bloom_add_elements_batch(bloom_filter *filter, int nelems,
+						 unsigned char **elems, size_t *lens,
+						 uint64 *ranges)
 {
-	int			bloom_power = -1;
+	const filter_ops *ops = FILTER_OPS(filter);
+	uint64		seed = ((filter_header *) filter)->seed;
+	uint64		hashvals[FILTER_BATCH_SIZE];
+	int			start;
 
-	while (target_bitset_bits > 0 && bloom_power < 32)
+	for (start = 0; start < nelems; start += FILTER_BATCH_SIZE)
 	{
-		bloom_power++;
-		target_bitset_bits >>= 1;
-	}
+		int			n = Min(nelems - start, FILTER_BATCH_SIZE);
+		int			i;
 
-	return bloom_power;
+		for (i = 0; i < n; i++)
+			hashvals[i] = hash64(elems[start + i], lens[start + i], seed);
+
+		ops->add_hashes(filter, n, hashvals, ranges ? ranges + start : NULL);
+	}
 }
 
 /*
- * Determine optimal number of hash functions based on size of filter in bits,
- * and projected total number of elements.  The optimal number is the number
- * that minimizes the false positive rate.
+ * Test if filter definitely lacks element.
+ *
+ * Returns true if the element is definitely not in the set of elements
+ * observed by bloom_add_element().  Otherwise, returns false, indicating that
+ * element is probably present in set.
  */
-static int
-optimal_k(uint64 bitset_bits, int64 total_elems)
+bool
+bloom_lacks_element(bloom_filter *filter, unsigned char *elem, size_t len)
 {
-	int			k = rint(log(2.0) * bitset_bits / total_elems);
+	uint64		hash = hash64(elem, len, ((filter_header *) filter)->seed);
+	bool		lacks;
 
-	return Max(1, Min(k, MAX_HASH_FUNCS));
+	FILTER_OPS(filter)->lacks_hashes(filter, 1, &hash, NULL, &lacks);
+
+	return lacks;
 }
 
 /*
- * Generate k hash values for element.
+ * Test if filter definitely lacks each element in a batch.
  *
- * Caller passes array, which is filled-in with k values determined by hashing
- * caller's element.
+ * Sets lacks[i] to the value that bloom_lacks_element() would return for
+ * elems[i].  Cache misses are overlapped by prefetching the bits for many
+ * elements before testing any of them.
  *
- * Only 2 real independent hash functions are actually used to support an
- * interface of up to MAX_HASH_FUNCS hash functions; enhanced double hashing is
- * used to make this work.  The main reason we prefer enhanced double hashing
- * to classic double hashing is that the latter has an issue with collisions
- * when using power of two sized bitsets.  See Dillinger & Manolios for full
- * details.
+ * ranges holds each element's range key when filter is ranged, and may be
+ * NULL otherwise.
  */
-static void
-k_hashes(bloom_filter *filter, uint32 *hashes, unsigned char *elem, size_t len)
+void
+bloom_lacks_elements_batch(bloom_filter *filter, int nelems,
+						   unsigned char **elems, size_t *lens,
+						   uint64 *ranges, bool *lacks)
 {
-	uint32		x, y;
-	uint64		m;
-	int			i;
-
-	x = DatumGetUInt32(hash_any(elem, len));
-	y = (filter->k_hash_funcs > 1 ? sdbmhash(elem, len) : 0);
-	m = filter->m;
-
-	/*
-	 * Mix seed value using XOR.  Mixing with addition instead would defeat the
-	 * purpose of having a seed (false positives would never change for a given
-	 * set of input elements).
-	 */
-	x ^= (uint32) filter->seed;
-	x = mod_m(x, m);
-	y = mod_m(y, m);
+	const filter_ops *ops = FILTER_OPS(filter);
+	uint64		seed = ((filter_header *) filter)->seed;
+	uint64		hashvals[FILTER_BATCH_SIZE];
+	int			start;
 
-	/* Accumulate hashes */
-	hashes[0] = x;
-	for (i = 1; i < filter->k_hash_funcs; i++)
+	for (start = 0; start < nelems; start += FILTER_BATCH_SIZE)
 	{
-		x = mod_m(x + y, m);
-		y = mod_m(y + i, m);
+		int			n = Min(nelems - start, FILTER_BATCH_SIZE);
+		int			i;
+
+		for (i = 0; i < n; i++)
+			hashvals[i] = hash64(elems[start + i], lens[start + i], seed);
 
-		hashes[i] = x;
+		ops->lacks_hashes(filter, n, hashvals, ranges ? ranges + start : NULL,
+						  lacks + start);
 	}
 }
 
 /*
- * A Calculate "val MOD m" inexpensively.
- *
- * Assumes that m (which is bitset size) is a power of two.
+ * Can filters be combined with bloom_union()?
  *
- * Using a power of two number of bits for bitset size allows us to use bitwise
- * AND operations to calculate the modulo of a hash value.  It's also a simple
- * way of avoiding the modulo bias effect.
+ * Filters are compatible when they have the same bitset size, the same
+ * number of hash functions, the same layout, the same seed, and the same
+ * range keys.  This is always the case for filters created with the same
+ * arguments, unless they're scalable filters that have grown.  Filters that
+ * aren't Bloom filters are never compatible.
  */
-static inline uint32
-mod_m(uint32 val, uint64 m)
+bool
+bloom_compatible(bloom_filter *a, bloom_filter *b)
 {
-	Assert(((m - 1) & m) == 0);
-
-	return val & (m - 1);
+	return FILTER_IS_BLOOM(a) && FILTER_IS_BLOOM(b) &&
+		a->m == b->m && a->k_hash_funcs == b->k_hash_funcs &&
+		a->blocked == b->blocked && a->hdr.seed == b->hdr.seed &&
+		a->nranges == b->nranges && a->next == NULL && b->next == NULL;
 }
 
 /*
- * Hash function is taken from sdbm, a public-domain reimplementation of the
- * ndbm database library.
+ * Add all elements observed by src to dst
+ *
+ * This is a bitwise OR of src's bitset into dst's bitset, which is written as
+ * a simple loop over 64-bit words so that the compiler can vectorize it,
+ * unless dst is in shared memory.  Caller must not concurrently add elements
+ * to src.  dst and src must be distinct filters, since the bitsets are assumed
+ * not to overlap.
  */
-static uint32
-sdbmhash(unsigned char *elem, size_t len)
+void
+bloom_union(bloom_filter *dst, bloom_filter *src)
 {
-	uint32	hash = 0;
-	int		i;
+	uint64	   *restrict dstbits = bloom_bitset(dst);
+	uint64	   *restrict srcbits = bloom_bitset(src);
+	uint64		nwords = dst->m / 64;
+	uint64		i;
+
+	Assert(dst != src);
+
+	if (!bloom_compatible(dst, src))
+		elog(ERROR, "cannot union incompatible Bloom filters");
 
-	for (i = 0; i < len; elem++, i++)
+#ifdef BLOOM_USE_SHARED
+	if (dst->shared)
 	{
-		hash = (*elem) + (hash << 6) + (hash << 16) - hash;
+		/* Other processes may be setting bits in dst concurrently */
+		for (i = 0; i < nwords; i++)
+		{
+			if (srcbits[i] != 0)
+				pg_atomic_fetch_or_u64((pg_atomic_uint64 *) &dstbits[i],
+									   srcbits[i]);
+		}
+
+		return;
+	}
+#endif
+
+	for (i = 0; i < nwords; i++)
+		dstbits[i] |= srcbits[i];
+
+	for (i = 0; i < dst->nsegments; i++)
+		dst->segment_elems[i] += src->segment_elems[i];
+}
+
+/*
+ * Size of serialized representation of filter, in bytes.  Only Bloom filters
+ * can be serialized.
+ */
+Size
+bloom_serialized_size(bloom_filter *filter)
+{
+	Size		size = 0;
+
+	Assert(FILTER_IS_BLOOM(filter));
+
+	/* Each slice of a scalable filter is serialized in turn */
+	for (; filter; filter = filter->next)
+		size += sizeof(bloom_serialized) + filter->m / BITS_PER_BYTE;
+
+	return size;
+}
+
+/*
+ * Serialize filter into caller's buffer, which must be at least
+ * bloom_serialized_size() bytes.  Buffer need not be aligned.
+ */
+void
+bloom_serialize(bloom_filter *filter, char *dest)
+{
+	for (; filter; filter = filter->next)
+	{
+		bloom_serialized hdr;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = BLOOM_SERIALIZED_MAGIC;
+		hdr.k_hash_funcs = filter->k_hash_funcs;
+		hdr.blocked = filter->blocked;
+		hdr.slice = filter->slice;
+		hdr.seed = filter->hdr.seed;
+		hdr.m = filter->m;
+		hdr.nranges = filter->nranges;
+		hdr.checkhash = hash64((unsigned char *) BLOOM_CHECK_ELEM,
+							   strlen(BLOOM_CHECK_ELEM), filter->hdr.seed);
+
+		memcpy(dest, &hdr, sizeof(hdr));
+		memcpy(dest + sizeof(hdr), bloom_bitset(filter),
+			   filter->m / BITS_PER_BYTE);
+		dest += sizeof(hdr) + filter->m / BITS_PER_BYTE;
+	}
+}
+
+/*
+ * Create Bloom filter in caller's memory context from the serialized
+ * representation produced by bloom_serialize(), which need not be aligned.
+ *
+ * Returns NULL when src is not a valid serialized filter, or when it was
+ * serialized on a platform whose hash values differ from ours.
+ */
+bloom_filter *
+bloom_deserialize(const char *src, Size len)
+{
+	bloom_filter *first = NULL;
+	bloom_filter *last = NULL;
+
+	/* Deserialize each slice in turn */
+	while (len > 0)
+	{
+		bloom_serialized hdr;
+		bloom_filter *filter;
+
+		if (len < sizeof(hdr))
+			goto invalid;
+		memcpy(&hdr, src, sizeof(hdr));
+
+		if (hdr.magic != BLOOM_SERIALIZED_MAGIC ||
+			hdr.k_hash_funcs < 1 || hdr.k_hash_funcs > MAX_HASH_FUNCS ||
+			hdr.m < BLOOM_BLOCK_BITS ||
+			hdr.m > (UINT64CONST(1) << MAX_BLOOM_POWER) ||
+			((hdr.m - 1) & hdr.m) != 0 ||
+			hdr.blocked != (hdr.m / BITS_PER_BYTE >= BLOOM_BLOCKED_MIN_BYTES) ||
+			hdr.slice != (last ? last->slice + 1 : 0) ||
+			(last && (hdr.seed != last->hdr.seed ||
+					  hdr.nranges != last->nranges)) ||
+			len < sizeof(hdr) + hdr.m / BITS_PER_BYTE)
+			goto invalid;
+
+		if (hdr.checkhash != hash64((unsigned char *) BLOOM_CHECK_ELEM,
+									strlen(BLOOM_CHECK_ELEM), hdr.seed))
+			goto invalid;
+
+		filter = bloom_alloc(CurrentMemoryContext, hdr.m);
+		filter->hdr.kind = FILTER_BLOOM;
+		filter->hdr.seed = hdr.seed;
+		filter->k_hash_funcs = hdr.k_hash_funcs;
+		filter->blocked = hdr.blocked;
+		filter->slice = hdr.slice;
+		filter->m = hdr.m;
+		slice_set_ranges(filter, hdr.nranges, CurrentMemoryContext);
+		memcpy(bloom_bitset(filter), src + sizeof(hdr), hdr.m / BITS_PER_BYTE);
+
+		if (last)
+			last->next = filter;
+		else
+			first = filter;
+		last = filter;
+
+		src += sizeof(hdr) + hdr.m / BITS_PER_BYTE;
+		len -= sizeof(hdr) + hdr.m / BITS_PER_BYTE;
+	}
+
+	return first;
+
+invalid:
+	if (first)
+		bloom_free(first);
+	return NULL;
+}
+
+/*
+ * What proportion of bits are currently set?
+ *
+ * Returns proportion, expressed as a multiplier of filter size.  That should
+ * generally be close to 0.5, even when we have more than enough memory to
+ * ensure a false positive rate within target 1% to 2% band, since more hash
+ * functions are used as more memory is available per element.
+ *
+ * This is the only instrumentation that is low overhead enough to appear in
+ * debug traces.  When debugging Bloom filter code, it's likely to be far more
+ * interesting to directly test the false positive rate.
+ */
+double
+bloom_prop_bits_set(bloom_filter *filter)
+{
+	uint64		bits_set = 0;
+	uint64		bits = 0;
+
+	Assert(FILTER_IS_BLOOM(filter));
+
+	for (; filter; filter = filter->next)
+	{
+		bits_set += slice_bits_set(filter);
+		bits += filter->m;
+	}
+
+	return bits_set / (double) Max(bits, 1);
+}
+
+/*
+ * Summarize filter in *stats: the total size of its bitsets or fingerprints,
+ * the estimated number of distinct elements added, and the estimated false
+ * positive rate for probes of elements that were never added.  Bloom filters
+ * also report the number of bits set, and static filters the width of their
+ * fingerprints.
+ *
+ * Static filters must have been frozen.  Bloom filters examine every bit,
+ * so this should only be called once all elements have been added.
+ */
+void
+bloom_stats(bloom_filter *filter, bloom_filter_stats *stats)
+{
+	memset(stats, 0, sizeof(bloom_filter_stats));
+	FILTER_OPS(filter)->stats(filter, stats);
+}
+
+/*
+ * Add elements with hash values hashes to Bloom filter.  Bits for every
+ * element are prefetched before any are set, unless there's just one.
+ */
+static void
+bitset_add_hashes(bloom_filter *filter, int nhashes, uint64 *hashes,
+				  uint64 *ranges)
+{
+	uint64		hashvals[FILTER_BATCH_SIZE];
+	batch_positions positions;
+	bloom_filter *slice;
+	uint64	   *bitset;
+	int			i;
+
+	Assert(nhashes <= FILTER_BATCH_SIZE);
+
+	slice = add_slice(filter, nhashes);
+	bitset = bloom_bitset(slice);
+	for (i = 0; i < nhashes; i++)
+		hashvals[i] = slice_hash(slice, hashes[i]);
+
+	/* Ranged filters need range keys */
+	if (slice->nsegments > 0)
+	{
+		Assert(ranges != NULL);
+		for (i = 0; i < nhashes; i++)
+		{
+			hashvals[i] = segment_hash(slice, hashvals[i], ranges[i]);
+			slice->segment_elems[range_segment(slice, ranges[i])]++;
+		}
+	}
+
+	if (nhashes == 1)
+	{
+		k_hashes(slice, &positions[0][0], 1, hashvals[0]);
+		set_bits(slice, bitset, &positions[0][0], 1);
+		return;
+	}
+
+	k_hashes_batch(slice, hashvals, nhashes, positions);
+
+	for (i = 0; i < nhashes; i++)
+		prefetch_bits(slice, bitset, &positions[0][i], FILTER_BATCH_SIZE,
+					  true);
+
+	for (i = 0; i < nhashes; i++)
+		set_bits(slice, bitset, &positions[0][i], FILTER_BATCH_SIZE);
+}
+
+/*
+ * Test if Bloom filter definitely lacks elements with hash values hashes.
+ * Bits for every element are prefetched before any are tested, unless
+ * there's just one.
+ */
+static void
+bitset_lacks_hashes(bloom_filter *filter, int nhashes, uint64 *hashes,
+					uint64 *ranges, bool *lacks)
+{
+	uint64		hashvals[FILTER_BATCH_SIZE];
+	bool		slicelacks[FILTER_BATCH_SIZE];
+	batch_positions positions;
+	bloom_filter *slice;
+	int			i;
+
+	Assert(nhashes <= FILTER_BATCH_SIZE);
+
+	/* Element is only definitely absent when it's absent from every slice */
+	for (slice = filter; slice; slice = slice->next)
+	{
+		uint64	   *bitset = bloom_bitset(slice);
+
+		for (i = 0; i < nhashes; i++)
+			hashvals[i] = slice_hash(slice, hashes[i]);
+
+		/* Ranged filters need range keys */
+		if (slice->nsegments > 0)
+		{
+			Assert(ranges != NULL);
+			for (i = 0; i < nhashes; i++)
+				hashvals[i] = segment_hash(slice, hashvals[i], ranges[i]);
+		}
+
+		if (nhashes == 1)
+		{
+			k_hashes(slice, &positions[0][0], 1, hashvals[0]);
+			lacks[0] = (slice == filter || lacks[0]) &&
+				!test_bits(slice, bitset, &positions[0][0], 1);
+			continue;
+		}
+
+		k_hashes_batch(slice, hashvals, nhashes, positions);
+
+		for (i = 0; i < nhashes; i++)
+			prefetch_bits(slice, bitset, &positions[0][i], FILTER_BATCH_SIZE,
+						  false);
+
+		test_bits_batch(slice, bitset, positions, nhashes, slicelacks);
+
+		for (i = 0; i < nhashes; i++)
+			lacks[i] = (slice == filter || lacks[i]) && slicelacks[i];
+	}
+}
+
+/*
+ * Bloom filters can be probed as soon as elements are added
+ */
+static bool
+bitset_freeze(bloom_filter *filter)
+{
+	return true;
+}
+
+/*
+ * Free Bloom filter
+ */
+static void
+bitset_free(bloom_filter *filter)
+{
+	/* Shared filters are released along with their memory */
+	Assert(!filter->shared);
+
+	while (filter)
+	{
+		bloom_filter *next = filter->next;
+
+		if (filter->segment_elems)
+			pfree(filter->segment_elems);
+#ifdef BLOOM_USE_MMAP
+		if (filter->mapping)
+		{
+#ifdef FRONTEND
+			bloom_unmap(filter->mapping);
+			pfree(filter->mapping);
+#else
+			/* Unmaps bitset through reset callback, and frees mapping */
+			MemoryContextDelete(filter->mapping->context);
+#endif
+		}
+#endif
+		pfree(filter);
+		filter = next;
+	}
+}
+
+/*
+ * Summarize Bloom filter in *stats.
+ *
+ * The number of distinct elements in each slice is estimated from the
+ * proportion of its bits that are set (Swamidass & Baldi, 2007).  A slice
+ * with every bit set is treated as though one bit was still unset.  The
+ * false positive rate estimate assumes that bits are set independently,
+ * which slightly flatters blocked filters.  Ranged slices are estimated one
+ * segment at a time, and contribute the rate of their worst segment.
+ *
+ * Like bloom_prop_bits_set(), this examines every bit, so should only be
+ * called once all elements have been added.
+ */
+static void
+bitset_stats(bloom_filter *filter, bloom_filter_stats *stats)
+{
+	double		prop_lacks = 1.0;
+
+	for (; filter; filter = filter->next)
+	{
+		uint64		bits_set = 0;
+		double		rate = 0.0;
+		uint64		segment;
+		double		prop;
+
+		stats->bits += filter->m;
+		stats->hash_funcs += filter->k_hash_funcs;
+
+		if (filter->nsegments == 0)
+		{
+			bits_set = slice_bits_set(filter);
+			prop = Min(bits_set, filter->m - 1) / (double) filter->m;
+			stats->elements += -((double) filter->m / filter->k_hash_funcs) *
+				log(1.0 - prop);
+			rate = pow(prop, filter->k_hash_funcs);
+		}
+
+		/*
+		 * Each segment of a ranged slice is effectively a filter of its own.
+		 * A probe's chance of being a false positive depends on which segment
+		 * it lands in, so report the worst segment's rate.
+		 */
+		for (segment = 0; segment < filter->nsegments; segment++)
+		{
+			uint64		segment_set = segment_bits_set(filter, segment);
+
+			bits_set += segment_set;
+			prop = Min(segment_set, BLOOM_SEGMENT_BITS - 1) /
+				(double) BLOOM_SEGMENT_BITS;
+			stats->elements += -((double) BLOOM_SEGMENT_BITS /
+								 filter->k_hash_funcs) * log(1.0 - prop);
+			rate = Max(rate, pow(prop, filter->k_hash_funcs));
+		}
+
+		stats->bits_set += bits_set;
+
+		/* A probe is a false positive when it's one in any slice */
+		prop_lacks *= 1.0 - rate;
+	}
+
+	stats->false_positive_rate = 1.0 - prop_lacks;
+}
+
+/*
+ * Determine bitset size in bits for bloom_create() caller's arguments, given
+ * the smallest bitset size in bytes that is worth having
+ */
+static uint64
+bloom_target_bits(int64 total_elems, int bloom_work_mem, uint64 min_bytes)
+{
+	uint64		bitset_bytes;
+
+	/*
+	 * Aim for two bytes per element; this is sufficient to get a false
+	 * positive rate below 1%, independent of the size of the bitset or total
+	 * number of elements.  Also, if rounding down the size of the bitset to
+	 * the next lowest power of two turns out to be a significant drop, the
+	 * false positive rate still won't exceed 2% in almost all cases.
+	 */
+	bitset_bytes = Min(bloom_work_mem * UINT64CONST(1024), total_elems * 2);
+	bitset_bytes = Max(min_bytes, bitset_bytes);
+
+	/* Size in bits should be the highest power of two <= target */
+	return UINT64CONST(1) << my_bloom_power(bitset_bytes * BITS_PER_BYTE);
+}
+
+/*
+ * Size of allocation needed for a Bloom filter with a bitset_bits bitset.
+ * This leaves enough slop to align the bitset to a block boundary.
+ */
+static Size
+bloom_alloc_size(uint64 bitset_bits)
+{
+	return offsetof(bloom_filter, words) + BLOOM_BLOCK_BYTES +
+		sizeof(unsigned char) * (bitset_bits / BITS_PER_BYTE);
+}
+
+/*
+ * Allocate filter with a zeroed bitset_bits bitset in context.  Fields are
+ * zeroed, but caller must initialize them with bloom_init().
+ */
+static bloom_filter *
+bloom_alloc(MemoryContext context, uint64 bitset_bits)
+{
+	bloom_filter *filter;
+	Size		size;
+
+#ifdef BLOOM_USE_MMAP
+	if (bitset_bits / BITS_PER_BYTE >= BLOOM_MAPPED_MIN_BYTES)
+	{
+		bloom_mapping *mapping;
+		void	   *addr;
+#ifndef FRONTEND
+		MemoryContext mapcontext;
+		MemoryContext oldcontext;
+#endif
+
+		/* Allocate everything that can fail with ERROR before mapping */
+		size = offsetof(bloom_filter, words);
+		filter = MemoryContextAllocHuge(context, size);
+		memset(filter, 0, size);
+#ifdef FRONTEND
+		mapping = palloc(sizeof(bloom_mapping));
+#else
+		mapcontext = AllocSetContextCreate(context,
+										   "Bloom filter mapping",
+#if PG_VERSION_NUM >= 110000
+										   ALLOCSET_SMALL_SIZES);
+#else
+										   ALLOCSET_SMALL_MINSIZE,
+										   ALLOCSET_SMALL_INITSIZE,
+										   ALLOCSET_SMALL_MAXSIZE);
+#endif
+		oldcontext = MemoryContextSwitchTo(mapcontext);
+		mapping = palloc(sizeof(bloom_mapping));
+		mapping->context = mapcontext;
+#if PG_VERSION_NUM >= 110000
+		/* Identify mapping's size in MemoryContextStats() output */
+		MemoryContextSetIdentifier(mapcontext,
+								   psprintf(UINT64_FORMAT " bytes mapped",
+											bitset_bits / BITS_PER_BYTE));
+#endif
+		MemoryContextSwitchTo(oldcontext);
+#endif
+		mapping->size = bitset_bits / BITS_PER_BYTE;
+
+		addr = mmap(NULL, mapping->size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr != MAP_FAILED)
+		{
+#ifdef MADV_HUGEPAGE
+			(void) madvise(addr, mapping->size, MADV_HUGEPAGE);
+#endif
+			mapping->addr = addr;
+#ifndef FRONTEND
+			mapping->callback.func = bloom_unmap;
+			mapping->callback.arg = mapping;
+			MemoryContextRegisterResetCallback(mapcontext, &mapping->callback);
+#if PG_VERSION_NUM >= 130000
+			/* Charge mapping to its context, like any other allocation */
+			mapcontext->mem_allocated += mapping->size;
+#endif
+#endif
+			filter->mapping = mapping;
+			return filter;
+		}
+
+		/* Use palloc() after all, just as with smaller bitsets */
+#ifdef FRONTEND
+		pfree(mapping);
+#else
+		MemoryContextDelete(mapcontext);
+#endif
+		pfree(filter);
+	}
+#endif
+
+	size = bloom_alloc_size(bitset_bits);
+	filter = MemoryContextAllocHuge(context, size);
+	memset(filter, 0, size);
+
+	return filter;
+}
+
+#ifdef BLOOM_USE_MMAP
+/*
+ * Unmap bitset, on bloom_free() or when its memory context goes away,
+ * whichever comes first.  This can be called while a memory context is
+ * reset, so failure is only reported as a WARNING.
+ */
+static void
+bloom_unmap(void *arg)
+{
+	bloom_mapping *mapping = (bloom_mapping *) arg;
+
+	if (mapping->addr != NULL)
+	{
+		if (munmap(mapping->addr, mapping->size) != 0)
+			elog(WARNING, "could not unmap Bloom filter bitset: %m");
+#if !defined(FRONTEND) && PG_VERSION_NUM >= 130000
+		mapping->context->mem_allocated -= mapping->size;
+#endif
+		mapping->addr = NULL;
+	}
+}
+#endif
+
+/*
+ * Initialize filter's fields, given memory from bloom_alloc(), or zeroed
+ * memory of at least bloom_alloc_size(bitset_bits) bytes
+ */
+static void
+bloom_init(bloom_filter *filter, uint64 bitset_bits, int64 total_elems,
+		   uint64 seed)
+{
+	filter->hdr.kind = FILTER_BLOOM;
+	filter->hdr.seed = seed;
+	filter->k_hash_funcs = optimal_k(bitset_bits, total_elems);
+	filter->blocked = (bitset_bits / BITS_PER_BYTE >= BLOOM_BLOCKED_MIN_BYTES);
+	filter->shared = false;
+	filter->m = bitset_bits;
+	filter->nranges = 0;
+	filter->nsegments = 0;
+	filter->ranges_per_segment = 0;
+	filter->segment_elems = NULL;
+	filter->scalable = false;
+	filter->slice = 0;
+	filter->nelems = 0;
+	filter->capacity = -1;
+	filter->next = NULL;
+	filter->last = NULL;
+	filter->context = NULL;
+	filter->budget = 0;
+}
+
+/*
+ * Get slice of filter that next nelems elements should be added to.
+ *
+ * This is the last slice of a scalable filter, which is first grown when it
+ * would otherwise go over capacity.  Other filters have only one slice.
+ */
+static bloom_filter *
+add_slice(bloom_filter *filter, int nelems)
+{
+	bloom_filter *last;
+	bloom_filter *slice;
+	uint64		bitset_bits;
+
+	if (!filter->scalable)
+		return filter;
+
+	last = filter->last ? filter->last : filter;
+	if (last->capacity < 0 || last->nelems + nelems <= last->capacity)
+	{
+		last->nelems += nelems;
+		return last;
+	}
+
+	/*
+	 * Double the size of the last bitset, or use whatever memory remains if
+	 * that's less.  Once the remaining memory won't fit a minimal bitset, the
+	 * last slice takes all further elements.
+	 */
+	bitset_bits = Min(last->m * 2, UINT64CONST(1) << MAX_BLOOM_POWER);
+	while (bitset_bits / BITS_PER_BYTE > filter->budget)
+		bitset_bits >>= 1;
+	if (bitset_bits / BITS_PER_BYTE < BLOOM_SCALABLE_MIN_BYTES)
+	{
+		last->capacity = -1;
+		last->nelems += nelems;
+		return last;
+	}
+
+	slice = bloom_alloc(filter->context, bitset_bits);
+	bloom_init(slice, bitset_bits, 1, filter->hdr.seed);
+	slice->k_hash_funcs = Min(last->k_hash_funcs + 1, MAX_HASH_FUNCS);
+	slice->scalable = true;
+	slice->slice = last->slice + 1;
+	slice->capacity = slice_capacity(slice);
+	slice->nelems = nelems;
+	slice_set_ranges(slice, filter->nranges, filter->context);
+
+	filter->budget -= bitset_bits / BITS_PER_BYTE;
+	filter->last = slice;
+	last->next = slice;
+
+	return slice;
+}
+
+/*
+ * Number of elements that slice takes before a scalable filter grows.  This
+ * is the point at which about half of its bits are expected to be set, which
+ * is where the false positive rate is 2^-k.
+ */
+static int64
+slice_capacity(bloom_filter *slice)
+{
+	return (int64) (slice->m * log(2.0) / slice->k_hash_funcs);
+}
+
+/*
+ * Number of bits set in slice's bitset
+ */
+static uint64
+slice_bits_set(bloom_filter *slice)
+{
+	return popcount_words(bloom_bitset(slice), slice->m / 64);
+}
+
+/*
+ * Number of bits set in one segment of ranged slice's bitset
+ */
+static uint64
+segment_bits_set(bloom_filter *slice, uint64 segment)
+{
+	uint64	   *words = bloom_bitset(slice);
+
+	return popcount_words(words + segment * (BLOOM_SEGMENT_BITS / 64),
+						  BLOOM_SEGMENT_BITS / 64);
+}
+
+/*
+ * Make slice ranged, with nranges range keys, when it's large enough to
+ * benefit.  Per-segment element counts are allocated in context.  nranges of
+ * 0 leaves slice unranged.
+ */
+static void
+slice_set_ranges(bloom_filter *slice, uint64 nranges, MemoryContext context)
+{
+	uint64		nsegments = slice->m / BLOOM_SEGMENT_BITS;
+
+	slice->nranges = nranges;
+	slice->nsegments = 0;
+	slice->ranges_per_segment = 0;
+	if (!slice->blocked || nranges == 0 || nranges < nsegments)
+		return;
+
+	slice->nsegments = nsegments;
+	slice->ranges_per_segment = (nranges + nsegments - 1) / nsegments;
+	slice->segment_elems = MemoryContextAllocZero(context,
+												  sizeof(int64) * nsegments);
+}
+
+/*
+ * Are the range keys in sample spread across the range key space, rather
+ * than bunched up in a small part of it?
+ *
+ * Range keys from the same part of the space tend to be sampled together, so
+ * this only looks for the sample hitting at least half of a small number of
+ * equal divisions of the space.  That's enough to catch elements that are
+ * confined to a narrow band of range keys.
+ */
+static bool
+ranges_spread(uint64 nranges, uint64 *sample, int nsample)
+{
+	bool		hit[BLOOM_RANGE_DIVISIONS];
+	int			nhit = 0;
+	int			i;
+
+	if (nranges == 0)
+		return false;
+
+	memset(hit, 0, sizeof(hit));
+	for (i = 0; i < nsample; i++)
+	{
+		uint64		division;
+
+		division = Min(sample[i], nranges - 1) /
+			((nranges + BLOOM_RANGE_DIVISIONS - 1) / BLOOM_RANGE_DIVISIONS);
+		if (!hit[division])
+		{
+			hit[division] = true;
+			nhit++;
+		}
+	}
+
+	return nhit * 2 >= Min(nsample, BLOOM_RANGE_DIVISIONS);
+}
+
+/*
+ * Which element in the sequence of powers of two is less than or equal to
+ * target_bitset_bits?
+ *
+ * Value returned here must be generally safe as the basis for actual bitset
+ * size.
+ *
+ * Bitset is never allowed to exceed 2 ^ MAX_BLOOM_POWER bits.  Bitsets larger
+ * than 512MB (2 ^ 32 bits) need bit positions that exceed the range of uint32,
+ * and need an allocation that exceeds MaxAllocSize.
+ */
+static int
+my_bloom_power(uint64 target_bitset_bits)
+{
+	int			bloom_power = -1;
+
+	while (target_bitset_bits > 0 && bloom_power < MAX_BLOOM_POWER)
+	{
+		bloom_power++;
+		target_bitset_bits >>= 1;
+	}
+
+	return bloom_power;
+}
+
+/*
+ * Determine optimal number of hash functions based on size of filter in bits,
+ * and projected total number of elements.  The optimal number is the number
+ * that minimizes the false positive rate.
+ */
+static int
+optimal_k(uint64 bitset_bits, int64 total_elems)
+{
+	int			k = rint(log(2.0) * bitset_bits / total_elems);
+
+	return Max(1, Min(k, MAX_HASH_FUNCS));
+}
+
+/*
+ * Generate k hash values for element.
+ *
+ * Caller passes array, which is filled-in with k values determined by hashing
+ * caller's element.
+ *
+ * Only 2 real independent hash functions are actually used to support an
+ * interface of up to MAX_HASH_FUNCS hash functions; enhanced double hashing is
+ * used to make this work.  The two hash values are the two halves of a single
+ * 64-bit hash of the element.  The main reason we prefer enhanced double
+ * hashing to classic double hashing is that the latter has an issue with
+ * collisions when using power of two sized bitsets.  See Dillinger & Manolios
+ * for full details.
+ *
+ * Bitsets of more than 2^32 bits need more than 32 bits from each hash value.
+ * The second value is the first value rotated by 32 bits, so the extra high
+ * bits of each value are the low bits of the other.  Distinct 64-bit hashes
+ * still always produce distinct pairs of values.
+ *
+ * With the blocked layout, the first hash value selects a block, and the k
+ * values are generated within that block by enhanced double hashing.  Values
+ * returned are bit positions within the entire bitset in either case.
+ *
+ * Caller passes the element's hash64() value, which must use the filter's
+ * seed as its seed.  Merely mixing the seed into the final hash value with
+ * XOR or addition would defeat the purpose of having a seed with the blocked
+ * layout (false positives would never change for a given set of input
+ * elements).  The ith value is stored at hashes[i * stride].
+ */
+static void
+k_hashes(bloom_filter *filter, uint64 *hashes, int stride, uint64 hash)
+{
+	uint64		x, y;
+	uint64		m;
+	int			i;
+
+	x = hash;
+	y = (hash >> 32) | (hash << 32);
+	m = filter->m;
+
+	if (filter->blocked)
+	{
+		uint64		block;
+
+		/*
+		 * Block is determined by first hash.  Positions within block come from
+		 * the second hash, so that elements that land in the same block don't
+		 * also share bit positions.
+		 */
+		block = mod_m(x, m / BLOOM_BLOCK_BITS);
+		x = mod_m(y, BLOOM_BLOCK_BITS);
+		y = mod_m(y >> 16, BLOOM_BLOCK_BITS);
+
+		hashes[0] = block * BLOOM_BLOCK_BITS + x;
+		for (i = 1; i < filter->k_hash_funcs; i++)
+		{
+			x = mod_m(x + y, BLOOM_BLOCK_BITS);
+			y = mod_m(y + i, BLOOM_BLOCK_BITS);
+
+			hashes[i * stride] = block * BLOOM_BLOCK_BITS + x;
+		}
+
+		return;
+	}
+
+	x = mod_m(x, m);
+	y = mod_m(y, m);
+
+	/* Accumulate hashes */
+	hashes[0] = x;
+	for (i = 1; i < filter->k_hash_funcs; i++)
+	{
+		x = mod_m(x + y, m);
+		y = mod_m(y + i, m);
+
+		hashes[i * stride] = x;
+	}
+}
+
+/*
+ * Choose the best k_hashes_batch, test_bits_batch and popcount_words
+ * implementations for the current CPU, and call through to the chosen
+ * implementation
+ */
+static void
+choose_batch_impl(void)
+{
+	k_hashes_batch = k_hashes_batch_scalar;
+	test_bits_batch = test_bits_batch_scalar;
+	popcount_words = popcount_words_scalar;
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		k_hashes_batch = k_hashes_batch_avx2;
+		test_bits_batch = test_bits_batch_avx2;
+		popcount_words = popcount_words_avx2;
+	}
+#endif
+}
+
+static void
+k_hashes_batch_choose(bloom_filter *filter, uint64 *hashvals, int nelems,
+					  batch_positions positions)
+{
+	choose_batch_impl();
+	k_hashes_batch(filter, hashvals, nelems, positions);
+}
+
+static void
+test_bits_batch_choose(bloom_filter *filter, uint64 *bitset,
+					   batch_positions positions, int nelems, bool *lacks)
+{
+	choose_batch_impl();
+	test_bits_batch(filter, bitset, positions, nelems, lacks);
+}
+
+static uint64
+popcount_words_choose(uint64 *words, uint64 nwords)
+{
+	choose_batch_impl();
+	return popcount_words(words, nwords);
+}
+
+/*
+ * Generate k bit positions for each element in a batch, given the elements'
+ * hash64() values
+ */
+static void
+k_hashes_batch_scalar(bloom_filter *filter, uint64 *hashvals, int nelems,
+					  batch_positions positions)
+{
+	int			i;
+
+	for (i = 0; i < nelems; i++)
+		k_hashes(filter, &positions[0][i], FILTER_BATCH_SIZE, hashvals[i]);
+}
+
+/*
+ * Test if all bits are set for each element in a batch, setting lacks[i] for
+ * each element that is definitely not in the set
+ */
+static void
+test_bits_batch_scalar(bloom_filter *filter, uint64 *bitset,
+					   batch_positions positions, int nelems, bool *lacks)
+{
+	int			i;
+
+	for (i = 0; i < nelems; i++)
+		lacks[i] = !test_bits(filter, bitset, &positions[0][i],
+							  FILTER_BATCH_SIZE);
+}
+
+/*
+ * Count the bits set in an array of nwords words
+ */
+static uint64
+popcount_words_scalar(uint64 *words, uint64 nwords)
+{
+	uint64		bits_set = 0;
+	uint64		i;
+
+	for (i = 0; i < nwords; i++)
+	{
+#ifdef __GNUC__
+		bits_set += __builtin_popcountll(words[i]);
+#else
+		uint64		word = words[i];
+
+		/* Count bits in each 2, 4, then 8 bit field, and sum the bytes */
+		word -= (word >> 1) & UINT64CONST(0x5555555555555555);
+		word = (word & UINT64CONST(0x3333333333333333)) +
+			((word >> 2) & UINT64CONST(0x3333333333333333));
+		word = (word + (word >> 4)) & UINT64CONST(0x0f0f0f0f0f0f0f0f);
+		bits_set += (word * UINT64CONST(0x0101010101010101)) >> 56;
+#endif
+	}
+
+	return bits_set;
+}
+
+#ifdef USE_AVX2_WITH_RUNTIME_CHECK
+
+/*
+ * AVX2 implementation of k_hashes_batch_scalar().
+ *
+ * Generates positions for 4 elements at a time, using the same arithmetic as
+ * k_hashes() within each 64-bit lane.  Any remaining elements are handled by
+ * k_hashes().
+ */
+__attribute__((target("avx2")))
+static void
+k_hashes_batch_avx2(bloom_filter *filter, uint64 *hashvals, int nelems,
+					batch_positions positions)
+{
+	int			k = filter->k_hash_funcs;
+	int			j;
+
+	for (j = 0; j + 4 <= nelems; j += 4)
+	{
+		__m256i		hash = _mm256_loadu_si256((__m256i *) &hashvals[j]);
+		/* Swap 32-bit halves of each lane, like k_hashes() rotation */
+		__m256i		rot = _mm256_shuffle_epi32(hash, _MM_SHUFFLE(2, 3, 0, 1));
+		__m256i		base;
+		__m256i		mask;
+		__m256i		x, y;
+		int			i;
+
+		if (filter->blocked)
+		{
+			__m256i		blockmask;
+
+			blockmask = _mm256_set1_epi64x(filter->m / BLOOM_BLOCK_BITS - 1);
+			mask = _mm256_set1_epi64x(BLOOM_BLOCK_BITS - 1);
+			/* Multiply block number by BLOOM_BLOCK_BITS (2^9) */
+			base = _mm256_slli_epi64(_mm256_and_si256(hash, blockmask), 9);
+			x = _mm256_and_si256(rot, mask);
+			y = _mm256_and_si256(_mm256_srli_epi64(rot, 16), mask);
+		}
+		else
+		{
+			mask = _mm256_set1_epi64x(filter->m - 1);
+			base = _mm256_setzero_si256();
+			x = _mm256_and_si256(hash, mask);
+			y = _mm256_and_si256(rot, mask);
+		}
+
+		_mm256_storeu_si256((__m256i *) &positions[0][j],
+							_mm256_add_epi64(base, x));
+		for (i = 1; i < k; i++)
+		{
+			x = _mm256_and_si256(_mm256_add_epi64(x, y), mask);
+			y = _mm256_and_si256(_mm256_add_epi64(y, _mm256_set1_epi64x(i)),
+								 mask);
+			_mm256_storeu_si256((__m256i *) &positions[i][j],
+								_mm256_add_epi64(base, x));
+		}
 	}
 
+	for (; j < nelems; j++)
+		k_hashes(filter, &positions[0][j], FILTER_BATCH_SIZE, hashvals[j]);
+}
+
+/*
+ * AVX2 implementation of test_bits_batch_scalar().
+ *
+ * Tests the bits of 4 elements at a time, using gathers to fetch the bitset
+ * words that contain each element's ith bit.
+ */
+__attribute__((target("avx2")))
+static void
+test_bits_batch_avx2(bloom_filter *filter, uint64 *bitset,
+					 batch_positions positions, int nelems, bool *lacks)
+{
+	const __m256i one = _mm256_set1_epi64x(1);
+	const __m256i bitmask = _mm256_set1_epi64x(63);
+	int			k = filter->k_hash_funcs;
+	int			j;
+
+	for (j = 0; j + 4 <= nelems; j += 4)
+	{
+		__m256i		missing = _mm256_setzero_si256();
+		int			lanes;
+		int			i;
+
+		for (i = 0; i < k; i++)
+		{
+			__m256i		pos = _mm256_loadu_si256((__m256i *) &positions[i][j]);
+			__m256i		words;
+			__m256i		bits;
+
+			words = _mm256_i64gather_epi64((const long long *) bitset,
+										   _mm256_srli_epi64(pos, 6), 8);
+			bits = _mm256_sllv_epi64(one, _mm256_and_si256(pos, bitmask));
+			missing = _mm256_or_si256(missing,
+									  _mm256_cmpeq_epi64(_mm256_and_si256(words, bits),
+														 _mm256_setzero_si256()));
+
+			/* Stop early once every lane is known to be missing a bit */
+			if (_mm256_movemask_pd(_mm256_castsi256_pd(missing)) == 0xf)
+				break;
+		}
+
+		lanes = _mm256_movemask_pd(_mm256_castsi256_pd(missing));
+		for (i = 0; i < 4; i++)
+			lacks[j + i] = (lanes & (1 << i)) != 0;
+	}
+
+	for (; j < nelems; j++)
+		lacks[j] = !test_bits(filter, bitset, &positions[0][j],
+							  FILTER_BATCH_SIZE);
+}
+
+/*
+ * AVX2 implementation of popcount_words_scalar().
+ *
+ * Looks up the number of bits set in each nibble of 4 words at a time in a
+ * 16 entry table, and sums the per-byte counts into 64-bit lanes (Mula,
+ * Kurz & Lemire, "Faster Population Counts Using AVX2 Instructions", 2018).
+ * Any remaining words are handled by popcount_words_scalar().
+ */
+__attribute__((target("avx2")))
+static uint64
+popcount_words_avx2(uint64 *words, uint64 nwords)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+											1, 2, 2, 3, 2, 3, 3, 4,
+											0, 1, 1, 2, 1, 2, 2, 3,
+											1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i		total = _mm256_setzero_si256();
+	uint64		lanes[4];
+	uint64		j;
+
+	for (j = 0; j + 4 <= nwords; j += 4)
+	{
+		__m256i		v = _mm256_loadu_si256((__m256i *) &words[j]);
+		__m256i		counts;
+
+		counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup,
+													 _mm256_and_si256(v, low)),
+								 _mm256_shuffle_epi8(lookup,
+													 _mm256_and_si256(_mm256_srli_epi16(v, 4),
+																	  low)));
+		total = _mm256_add_epi64(total,
+								 _mm256_sad_epu8(counts,
+												 _mm256_setzero_si256()));
+	}
+
+	_mm256_storeu_si256((__m256i *) lanes, total);
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		popcount_words_scalar(words + j, nwords - j);
+}
+
+#endif							/* USE_AVX2_WITH_RUNTIME_CHECK */
+
+/*
+ * Derive element's hash for a slice of a scalable filter from its hash64()
+ * value, so that each slice uses independent bit positions.  The first slice
+ * uses the hash64() value as-is.  Other slices remix the hash offset by the
+ * slice number.
+ */
+static inline uint64
+slice_hash(bloom_filter *slice, uint64 hash)
+{
+	if (slice->slice == 0)
+		return hash;
+
+	return fmix64(hash + slice->slice * UINT64CONST(0x9E3779B97F4A7C15));
+}
+
+/*
+ * Segment of ranged slice that range key's elements are confined to
+ */
+static inline uint64
+range_segment(bloom_filter *slice, uint64 range)
+{
+	return Min(range / slice->ranges_per_segment, slice->nsegments - 1);
+}
+
+/*
+ * Adjust element's hash so that k_hashes() selects a block within the bitset
+ * segment for element's range key.
+ *
+ * Blocks are selected by the low bits of the hash, which aren't otherwise
+ * used with the blocked layout.  The bits that select a segment's worth of
+ * blocks are replaced with the segment number.
+ */
+static inline uint64
+segment_hash(bloom_filter *filter, uint64 hash, uint64 range)
+{
+	uint64		nblocks = filter->m / BLOOM_BLOCK_BITS;
+	uint64		segmentbits = (nblocks - 1) & ~((uint64) BLOOM_SEGMENT_BLOCKS - 1);
+	uint64		segment = range_segment(filter, range);
+
+	return (hash & ~segmentbits) | (segment * BLOOM_SEGMENT_BLOCKS);
+}
+
+/*
+ * A Calculate "val MOD m" inexpensively.
+ *
+ * Assumes that m (which is bitset size) is a power of two.
+ *
+ * Using a power of two number of bits for bitset size allows us to use bitwise
+ * AND operations to calculate the modulo of a hash value.  It's also a simple
+ * way of avoiding the modulo bias effect.
+ */
+static inline uint64
+mod_m(uint64 val, uint64 m)
+{
+	Assert(((m - 1) & m) == 0);
+
+	return val & (m - 1);
+}
+
+/*
+ * Set bits for element's k hash values
+ *
+ * Maps a bit-wise address to a word-wise address + bit offset.  Shared
+ * filters must use an atomic OR, since other processes may be setting other
+ * bits in the same word concurrently.
+ */
+static inline void
+set_bits(bloom_filter *filter, uint64 *bitset, uint64 *hashes, int stride)
+{
+	int			i;
+
+#ifdef BLOOM_USE_SHARED
+	if (filter->shared)
+	{
+		for (i = 0; i < filter->k_hash_funcs; i++)
+		{
+			uint64		pos = hashes[i * stride];
+			pg_atomic_uint64 *word = (pg_atomic_uint64 *) &bitset[pos >> 6];
+
+			pg_atomic_fetch_or_u64(word, UINT64CONST(1) << (pos & 63));
+		}
+
+		return;
+	}
+#endif
+
+	for (i = 0; i < filter->k_hash_funcs; i++)
+	{
+		uint64		pos = hashes[i * stride];
+
+		bitset[pos >> 6] |= UINT64CONST(1) << (pos & 63);
+	}
+}
+
+/*
+ * Are all bits for element's k hash values set?
+ */
+static inline bool
+test_bits(bloom_filter *filter, uint64 *bitset, uint64 *hashes, int stride)
+{
+	int			i;
+
+	for (i = 0; i < filter->k_hash_funcs; i++)
+	{
+		uint64		pos = hashes[i * stride];
+
+		if (!(bitset[pos >> 6] & (UINT64CONST(1) << (pos & 63))))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Prefetch the cache lines containing bits for element's k hash values
+ *
+ * With the blocked layout, all k bits are on the same cache line.
+ */
+static inline void
+prefetch_bits(bloom_filter *filter, uint64 *bitset, uint64 *hashes,
+			  int stride, bool forwrite)
+{
+	int			nlines = filter->blocked ? 1 : filter->k_hash_funcs;
+	int			i;
+
+	for (i = 0; i < nlines; i++)
+	{
+		uint64		pos = hashes[i * stride];
+
+		if (forwrite)
+			filter_prefetch(&bitset[pos >> 6], 1);
+		else
+			filter_prefetch(&bitset[pos >> 6], 0);
+	}
+}
+
+/*
+ * Get bitset, which is aligned to a block boundary within filter's allocation
+ */
+static inline uint64 *
+bloom_bitset(bloom_filter *filter)
+{
+	if (filter->mapping)
+		return (uint64 *) filter->mapping->addr;
+
+	return (uint64 *) TYPEALIGN(BLOOM_BLOCK_BYTES, filter->words);
+}
+
+/*
+ * 64-bit hash function, based on MurmurHash64A, a public domain hash function
+ * by Austin Appleby.
+ *
+ * Element is consumed a 64-bit word at a time, which is far cheaper than
+ * hashing a byte at a time for wide elements.  Note that the value returned
+ * for a given element and seed is not stable across platforms of differing
+ * endianness.
+ */
+static uint64
+hash64(unsigned char *elem, size_t len, uint64 seed)
+{
+	const uint64 mult = UINT64CONST(0xc6a4a7935bd1e995);
+	const int	r = 47;
+	uint64		hash = seed ^ (len * mult);
+	unsigned char *end = elem + (len & ~((size_t) 7));
+
+	for (; elem < end; elem += sizeof(uint64))
+	{
+		uint64		k;
+
+		/* Element need not be aligned */
+		memcpy(&k, elem, sizeof(uint64));
+
+		k *= mult;
+		k ^= k >> r;
+		k *= mult;
+
+		hash ^= k;
+		hash *= mult;
+	}
+
+	switch (len & 7)
+	{
+		case 7:
+			hash ^= (uint64) elem[6] << 48;
+			/* FALLTHROUGH */
+		case 6:
+			hash ^= (uint64) elem[5] << 40;
+			/* FALLTHROUGH */
+		case 5:
+			hash ^= (uint64) elem[4] << 32;
+			/* FALLTHROUGH */
+		case 4:
+			hash ^= (uint64) elem[3] << 24;
+			/* FALLTHROUGH */
+		case 3:
+			hash ^= (uint64) elem[2] << 16;
+			/* FALLTHROUGH */
+		case 2:
+			hash ^= (uint64) elem[1] << 8;
+			/* FALLTHROUGH */
+		case 1:
+			hash ^= (uint64) elem[0];
+			hash *= mult;
+	}
+
+	hash ^= hash >> r;
+	hash *= mult;
+	hash ^= hash >> r;
+
 	return hash;
 }
@@ -15,15 +15,70 @@
 #ifndef BLOOMFILTER_H
 #define BLOOMFILTER_H
 
+#ifndef FRONTEND
+#include "storage/dsm.h"
+#endif
+
 typedef struct bloom_filter bloom_filter;
 
+/* Summary of filter's state, from bloom_stats() */
+typedef struct bloom_filter_stats
+{
+	/* Total size of bitsets, or of a static filter's fingerprints, in bits */
+	uint64		bits;
+	/* Bloom filters only: number of bits set */
+	uint64		bits_set;
+	/* Static filters only: width of each fingerprint, in bits */
+	int			fingerprint_bits;
+	/* Estimated number of distinct elements added */
+	double		elements;
+	/*
+	 * Estimated probability that probe of an element never added succeeds,
+	 * in the worst segment of a ranged filter
+	 */
+	double		false_positive_rate;
+	/* Hash functions used, summed across slices of a scalable filter */
+	int			hash_funcs;
+} bloom_filter_stats;
+
 extern bloom_filter *bloom_create(int64 total_elems, int bloom_work_mem,
 			 uint64 seed);
+extern bloom_filter *bloom_create_scalable(int64 total_elems,
+					  int bloom_work_mem, uint64 seed);
+extern bloom_filter *bloom_create_static(int64 total_elems,
+						int bloom_work_mem, uint64 seed);
+extern bool bloom_freeze(bloom_filter *filter);
+extern Size bloom_shared_size(int64 total_elems, int bloom_work_mem);
+extern bloom_filter *bloom_init_shared(void *mem, int64 total_elems,
+					  int bloom_work_mem, uint64 seed);
+#ifndef FRONTEND
+extern bloom_filter *bloom_create_shared(int64 total_elems, int bloom_work_mem,
+					uint64 seed, dsm_segment **segment);
+extern bloom_filter *bloom_attach_shared(dsm_handle handle,
+					dsm_segment **segment);
+#endif
 extern void bloom_free(bloom_filter *filter);
+extern int	bloom_partitions(int64 total_elems, int bloom_work_mem);
+extern bool bloom_set_ranges(bloom_filter *filter, uint64 nranges,
+				 uint64 *sample, int nsample);
+extern bool bloom_ranges_overflowed(bloom_filter *filter);
+extern uint64 bloom_prefetch_range(bloom_filter *filter, uint64 range);
 extern void bloom_add_element(bloom_filter *filter, unsigned char *elem,
 				  size_t len);
+extern void bloom_add_elements_batch(bloom_filter *filter, int nelems,
+						 unsigned char **elems, size_t *lens,
+						 uint64 *ranges);
 extern bool bloom_lacks_element(bloom_filter *filter, unsigned char *elem,
 					size_t len);
+extern void bloom_lacks_elements_batch(bloom_filter *filter, int nelems,
+						   unsigned char **elems, size_t *lens,
+						   uint64 *ranges, bool *lacks);
+extern bool bloom_compatible(bloom_filter *a, bloom_filter *b);
+extern void bloom_union(bloom_filter *dst, bloom_filter *src);
+extern Size bloom_serialized_size(bloom_filter *filter);
+extern void bloom_serialize(bloom_filter *filter, char *dest);
+extern bloom_filter *bloom_deserialize(const char *src, Size len);
 extern double bloom_prop_bits_set(bloom_filter *filter);
+extern void bloom_stats(bloom_filter *filter, bloom_filter_stats *stats);
 
 #endif							/* BLOOMFILTER_H */
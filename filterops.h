@@ -0,0 +1,92 @@
+/*-------------------------------------------------------------------------
+ *
+ * filterops.h
+ *	  Interface between bloomfilter.c and each kind of filter
+ *
+ * bloomfilter.h's functions accept any kind of filter.  Each kind begins
+ * with a filter_header, whose kind selects the filter_ops that the functions
+ * common to every kind dispatch through.  Elements are hashed once, by the
+ * common functions, so that each kind only ever sees hash values.  Functions
+ * that only make sense for Bloom filters, such as bloom_union(), check the
+ * kind themselves.
+ *
+ * Portions Copyright (c) 2016-2020, Peter Geoghegan
+ * Portions Copyright (c) 1996-2020, The PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  amcheck_next/filterops.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef FILTEROPS_H
+#define FILTEROPS_H
+
+#include "bloomfilter.h"
+
+/*
+ * Kinds of filter.  A filter records its kind, rather than a pointer to its
+ * ops, since shared filters are used by processes that may have loaded this
+ * library at different addresses.
+ */
+typedef enum filter_kind
+{
+	FILTER_BLOOM,				/* Bloom filter, from bloomfilter.c */
+	FILTER_FUSE					/* Binary fuse filter, from fusefilter.c */
+} filter_kind;
+
+typedef struct filter_header
+{
+	filter_kind kind;
+	/* Seed for hashing elements */
+	uint64		seed;
+} filter_header;
+
+/*
+ * Elements are hashed, and passed to each kind of filter, in batches of at
+ * most this many.  Filters hash and prefetch the whole batch before going on
+ * to add or test any of its elements.
+ */
+#define FILTER_BATCH_SIZE		32
+
+#if defined(__GNUC__) || defined(__INTEL_COMPILER)
+#define filter_prefetch(addr, rw)	__builtin_prefetch((addr), (rw))
+#else
+#define filter_prefetch(addr, rw)	((void) (addr))
+#endif
+
+typedef struct filter_ops
+{
+	/* Add elements with hash values hashes, and range keys ranges */
+	void		(*add_hashes) (bloom_filter *filter, int nhashes,
+							   uint64 *hashes, uint64 *ranges);
+
+	/* Set lacks[i] when element with hashes[i] was definitely never added */
+	void		(*lacks_hashes) (bloom_filter *filter, int nhashes,
+								 uint64 *hashes, uint64 *ranges, bool *lacks);
+
+	/* Prepare filter for probes, once every element was added */
+	bool		(*freeze) (bloom_filter *filter);
+
+	void		(*stats) (bloom_filter *filter, bloom_filter_stats *stats);
+	void		(*free) (bloom_filter *filter);
+} filter_ops;
+
+extern const filter_ops fuse_filter_ops;
+
+/*
+ * Finalization step of MurmurHash3's 64-bit variant
+ */
+static inline uint64
+fmix64(uint64 hash)
+{
+	hash ^= hash >> 33;
+	hash *= UINT64CONST(0xff51afd7ed558ccd);
+	hash ^= hash >> 33;
+	hash *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+#endif							/* FILTEROPS_H */
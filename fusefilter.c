@@ -0,0 +1,796 @@
+/*-------------------------------------------------------------------------
+ *
+ * fusefilter.c
+ *		Static filters, for sets whose elements are all added before any
+ *		are probed
+ *
+ * Static filters are binary fuse filters ("Binary Fuse Filters: Fast and
+ * Smaller Than Xor Filters", Graf & Lemire, 2022).  They need only about 9
+ * bits per element for a false positive rate of 1/256, which is much less
+ * than a Bloom filter with the same false positive rate needs, and every
+ * probe touches just 3 fingerprints.  Elements are buffered as they're added,
+ * and the filter proper is built from them all at once by bloom_freeze().
+ *
+ * Building a filter takes several times more memory than the finished filter
+ * does, which bounds the number of elements that fit in a memory budget.
+ * Most of that goes on work arrays that are several times larger than the
+ * set of keys being built.  Large sets are therefore divided into shards of
+ * about FUSE_SHARD_KEYS keys each, which are built one at a time, reusing
+ * the same work arrays.  Each shard has its own part of the fingerprint
+ * array, and its own geometry and seed.  A probe selects its shard from the
+ * high bits of its hash value.  Past a few shards, building a filter needs
+ * little more than the buffered keys and the finished filter.
+ *
+ * Filters are created with bloom_create_static(), and are otherwise used
+ * through bloomfilter.h's functions common to every kind of filter.
+ *
+ * Portions Copyright (c) 2016-2020, Peter Geoghegan
+ * Portions Copyright (c) 1996-2020, The PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, The Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  amcheck_next/fusefilter.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <math.h>
+
+#include "filterops.h"
+#include "utils/memutils.h"
+
+/* Width of each fingerprint, which makes the false positive rate 2^-8 */
+#define FUSE_FINGERPRINT_BITS	8
+
+/*
+ * Target number of keys in each shard.  Shards of this size still need a
+ * fingerprint array only about 16% larger than their number of keys.
+ */
+#define FUSE_SHARD_KEYS			262144
+
+/*
+ * Keys are buffered in chunks of this many keys, so that the buffer grows
+ * without ever copying keys, and never has more than one chunk to spare
+ */
+#define FUSE_CHUNK_BITS			13
+#define FUSE_CHUNK_KEYS			(1 << FUSE_CHUNK_BITS)
+
+/*
+ * Bytes of memory needed to build a filter.  Every key takes FUSE_KEY_BYTES
+ * until the filter is built: its buffered hash value, and its share of the
+ * fingerprint array, allowing for the array being larger than the number of
+ * keys.  Each key of the largest shard takes FUSE_WORK_BYTES more, for the
+ * work arrays that build a shard.  bloombench reports the memory that
+ * building a filter actually takes.
+ */
+#define FUSE_KEY_BYTES			10
+#define FUSE_WORK_BYTES			26
+
+/*
+ * Largest segment, and maximum number of attempts at building each shard.
+ * Each attempt succeeds with high probability.
+ */
+#define FUSE_MAX_SEGMENT		262144
+#define FUSE_MAX_ATTEMPTS		100
+
+/* One shard of a built filter */
+typedef struct fuse_shard
+{
+	/* Seed that the shard was built with */
+	uint64		fuseseed;
+	/* First of shard's fingerprints, within filter's array */
+	uint64		offset;
+	/* Geometry, from fuse_geometry() */
+	uint64		segment_length;
+	uint64		segment_count_length;
+	uint64		array_length;
+} fuse_shard;
+
+typedef struct fuse_filter
+{
+	filter_header hdr;
+	MemoryContext context;
+
+	/*
+	 * Hash values of elements, buffered for building filter, and their
+	 * number, and the number that fit in the memory budget.  Once built,
+	 * chunks are no longer needed.
+	 */
+	uint64	  **chunks;
+	int			nchunks;
+	int			maxchunks;
+	int64		nkeys;
+	int64		keylimit;
+	bool		overflowed;
+	bool		frozen;
+	/* The built filter: distinct elements, shards, and fingerprints */
+	int64		nelems;
+	int			nshards;
+	fuse_shard *shards;
+	uint64		nfingerprints;
+	uint8	   *fingerprints;
+} fuse_filter;
+
+/* Work arrays for building one shard at a time */
+typedef struct fuse_work
+{
+	uint64	   *order;
+	uint64	   *t2hash;
+	uint32	   *alone;
+	uint8	   *t2count;
+	uint8	   *reverseh;
+	uint64	   *startpos;
+} fuse_work;
+
+/* Buffered key i */
+#define FUSE_KEY(filter, i) \
+	((filter)->chunks[(i) >> FUSE_CHUNK_BITS][(i) & (FUSE_CHUNK_KEYS - 1)])
+
+static void fuse_add_hashes(bloom_filter *filter, int nhashes, uint64 *hashes,
+				uint64 *ranges);
+static void fuse_lacks_hashes(bloom_filter *filter, int nhashes,
+				  uint64 *hashes, uint64 *ranges, bool *lacks);
+static bool fuse_freeze(bloom_filter *filter);
+static void fuse_stats(bloom_filter *filter, bloom_filter_stats *stats);
+static void fuse_free(bloom_filter *filter);
+static Size fuse_build_size(int64 nkeys);
+static void fuse_free_chunks(fuse_filter *filter);
+static void fuse_partition(fuse_filter *filter, int64 *bounds);
+static bool fuse_build_shard(fuse_filter *filter, fuse_shard *shard,
+				 fuse_work *work, int64 first, uint64 nkeys,
+				 uint64 *rngstate);
+static int	fuse_key_cmp(const void *a, const void *b);
+static void fuse_geometry(fuse_shard *shard, int64 nkeys);
+static inline fuse_shard *fuse_key_shard(fuse_filter *filter, uint64 hash);
+static inline void fuse_positions(fuse_shard *shard, uint64 hash,
+			   uint64 *positions);
+static inline uint8 fuse_fingerprint(uint64 hash);
+static inline uint64 mulhi64(uint64 a, uint64 b);
+
+const filter_ops fuse_filter_ops = {
+	fuse_add_hashes,
+	fuse_lacks_hashes,
+	fuse_freeze,
+	fuse_stats,
+	fuse_free
+};
+
+/*
+ * Create static filter in caller's memory context.
+ *
+ * Elements are added with bloom_add_element() or bloom_add_elements_batch(),
+ * as usual, but the filter can't be probed until bloom_freeze() has built it
+ * from all of the elements.  Static filters have a false positive rate of
+ * 2^-FUSE_FINGERPRINT_BITS (about 0.4%), and take about 9 bits per element
+ * once built.  Range keys are ignored, and static filters can't be
+ * serialized or combined with other filters.
+ *
+ * Returns NULL when total_elems suggests that bloom_work_mem won't be enough
+ * to build the filter.  Callers should fall back on a Bloom filter in that
+ * case.
+ */
+bloom_filter *
+bloom_create_static(int64 total_elems, int bloom_work_mem, uint64 seed)
+{
+	fuse_filter *filter;
+	Size		budget = bloom_work_mem * (Size) 1024;
+	Size		sharded = fuse_build_size(FUSE_SHARD_KEYS);
+	int64		keylimit;
+
+	/* Largest number of keys whose filter can be built within budget */
+	if (budget >= sharded)
+		keylimit = FUSE_SHARD_KEYS + (budget - sharded) / FUSE_KEY_BYTES;
+	else
+		keylimit = (budget - Min(budget, fuse_build_size(0))) /
+			(FUSE_KEY_BYTES + FUSE_WORK_BYTES);
+	keylimit = Min(keylimit, INT_MAX);
+
+	/* Leave some headroom for total_elems being an underestimate */
+	if (total_elems + total_elems / 4 > keylimit)
+		return NULL;
+
+	filter = MemoryContextAllocZero(CurrentMemoryContext, sizeof(fuse_filter));
+	filter->hdr.kind = FILTER_FUSE;
+	filter->hdr.seed = seed;
+	filter->context = CurrentMemoryContext;
+	filter->keylimit = keylimit;
+	filter->maxchunks = 16;
+	filter->chunks = palloc(filter->maxchunks * sizeof(uint64 *));
+
+	return (bloom_filter *) filter;
+}
+
+/*
+ * Buffer hash values of elements added to filter, until bloom_freeze().
+ * Once the memory budget is exhausted, the buffer is freed, and later
+ * elements are ignored, since bloom_freeze() will fail anyway.
+ */
+static void
+fuse_add_hashes(bloom_filter *filter, int nhashes, uint64 *hashes,
+				uint64 *ranges)
+{
+	fuse_filter *fuse = (fuse_filter *) filter;
+	int			i;
+
+	Assert(!fuse->frozen);
+
+	if (fuse->overflowed)
+		return;
+
+	if (fuse->nkeys + nhashes > fuse->keylimit)
+	{
+		fuse_free_chunks(fuse);
+		fuse->overflowed = true;
+		return;
+	}
+
+	for (i = 0; i < nhashes; i++)
+	{
+		if ((fuse->nkeys & (FUSE_CHUNK_KEYS - 1)) == 0)
+		{
+			if (fuse->nchunks == fuse->maxchunks)
+			{
+				fuse->maxchunks *= 2;
+				fuse->chunks = repalloc(fuse->chunks,
+										fuse->maxchunks * sizeof(uint64 *));
+			}
+			fuse->chunks[fuse->nchunks++] =
+				MemoryContextAlloc(fuse->context,
+								   FUSE_CHUNK_KEYS * sizeof(uint64));
+		}
+
+		FUSE_KEY(fuse, fuse->nkeys) = hashes[i];
+		fuse->nkeys++;
+	}
+}
+
+/*
+ * Test if filter definitely lacks elements with hash values hashes.
+ * Fingerprints for every element are prefetched before any are tested.
+ */
+static void
+fuse_lacks_hashes(bloom_filter *filter, int nhashes, uint64 *hashes,
+				  uint64 *ranges, bool *lacks)
+{
+	fuse_filter *fuse = (fuse_filter *) filter;
+	uint64		positions[FILTER_BATCH_SIZE][3];
+	uint64		fusehashes[FILTER_BATCH_SIZE];
+	int			i;
+
+	Assert(fuse->frozen && nhashes <= FILTER_BATCH_SIZE);
+
+	for (i = 0; i < nhashes; i++)
+	{
+		fuse_shard *shard = fuse_key_shard(fuse, hashes[i]);
+		int			j;
+
+		fusehashes[i] = fmix64(hashes[i] + shard->fuseseed);
+		fuse_positions(shard, fusehashes[i], positions[i]);
+		for (j = 0; j < 3; j++)
+		{
+			positions[i][j] += shard->offset;
+			filter_prefetch(&fuse->fingerprints[positions[i][j]], 0);
+		}
+	}
+
+	for (i = 0; i < nhashes; i++)
+		lacks[i] = (fuse_fingerprint(fusehashes[i]) ^
+					fuse->fingerprints[positions[i][0]] ^
+					fuse->fingerprints[positions[i][1]] ^
+					fuse->fingerprints[positions[i][2]]) != 0;
+}
+
+/*
+ * Build filter from its buffered keys, one shard at a time, so that it can
+ * be probed.  Keys are first partitioned by shard, in place.
+ *
+ * Returns false when more elements were added than fit in the memory budget,
+ * or, very rarely, when building some shard failed repeatedly.
+ */
+static bool
+fuse_freeze(bloom_filter *filter)
+{
+	fuse_filter *fuse = (fuse_filter *) filter;
+	int64	   *bounds;
+	int64		maxkeys = 0;
+	uint64		maxlength = 0;
+	int			blockbits = 1;
+	uint64		rngstate = UINT64CONST(0x726b2b9d438b9d4d) ^ fuse->hdr.seed;
+	fuse_work	work;
+	bool		built = true;
+	int			nfreed = 0;
+	int			s;
+
+	Assert(!fuse->frozen);
+
+	fuse->frozen = true;
+	if (fuse->overflowed)
+		return false;
+
+	fuse->nshards = (int) Max(1, (fuse->nkeys + FUSE_SHARD_KEYS - 1) /
+							  FUSE_SHARD_KEYS);
+	fuse->shards = MemoryContextAllocZero(fuse->context,
+										  fuse->nshards * sizeof(fuse_shard));
+	bounds = palloc((fuse->nshards + 1) * sizeof(int64));
+	fuse_partition(fuse, bounds);
+
+	/* Lay out each shard's part of the fingerprint array */
+	for (s = 0; s < fuse->nshards; s++)
+	{
+		fuse_shard *shard = &fuse->shards[s];
+		int64		nkeys = bounds[s + 1] - bounds[s];
+
+		fuse_geometry(shard, nkeys);
+		shard->offset = fuse->nfingerprints;
+		fuse->nfingerprints += shard->array_length;
+
+		maxkeys = Max(maxkeys, nkeys);
+		maxlength = Max(maxlength, shard->array_length);
+		while ((UINT64CONST(1) << blockbits) <
+			   shard->segment_count_length / shard->segment_length)
+			blockbits++;
+	}
+
+	fuse->fingerprints = MemoryContextAllocHuge(fuse->context,
+												fuse->nfingerprints);
+	memset(fuse->fingerprints, 0, fuse->nfingerprints);
+
+	/* Order has a sentinel entry, so that placement always stops */
+	work.order = MemoryContextAllocHuge(fuse->context,
+										(maxkeys + 1) * sizeof(uint64));
+	work.t2hash = MemoryContextAllocHuge(fuse->context,
+										 maxlength * sizeof(uint64));
+	work.alone = MemoryContextAllocHuge(fuse->context,
+										maxlength * sizeof(uint32));
+	work.t2count = MemoryContextAllocHuge(fuse->context, maxlength);
+	work.reverseh = MemoryContextAllocHuge(fuse->context, Max(maxkeys, 1));
+	work.startpos = MemoryContextAllocHuge(fuse->context,
+										   (UINT64CONST(1) << blockbits) *
+										   sizeof(uint64));
+
+	for (s = 0; s < fuse->nshards && built; s++)
+	{
+		built = fuse_build_shard(fuse, &fuse->shards[s], &work, bounds[s],
+								 bounds[s + 1] - bounds[s], &rngstate);
+
+		/* Free chunks holding only keys of shards that have been built */
+		for (; nfreed < (bounds[s + 1] >> FUSE_CHUNK_BITS); nfreed++)
+		{
+			pfree(fuse->chunks[nfreed]);
+			fuse->chunks[nfreed] = NULL;
+		}
+	}
+
+	pfree(work.order);
+	pfree(work.t2hash);
+	pfree(work.alone);
+	pfree(work.t2count);
+	pfree(work.reverseh);
+	pfree(work.startpos);
+	pfree(bounds);
+	fuse_free_chunks(fuse);
+
+	return built;
+}
+
+/*
+ * Summarize filter in *stats.  A filter knows exactly how many distinct
+ * elements it has.  Its false positive rate follows from the width of its
+ * fingerprints, and it has no bits set to speak of.
+ */
+static void
+fuse_stats(bloom_filter *filter, bloom_filter_stats *stats)
+{
+	fuse_filter *fuse = (fuse_filter *) filter;
+
+	Assert(fuse->frozen);
+
+	stats->bits = fuse->nfingerprints * FUSE_FINGERPRINT_BITS;
+	stats->fingerprint_bits = FUSE_FINGERPRINT_BITS;
+	stats->elements = fuse->nelems;
+	stats->false_positive_rate = ldexp(1.0, -FUSE_FINGERPRINT_BITS);
+	stats->hash_funcs = 3;
+}
+
+static void
+fuse_free(bloom_filter *filter)
+{
+	fuse_filter *fuse = (fuse_filter *) filter;
+
+	fuse_free_chunks(fuse);
+	if (fuse->chunks)
+		pfree(fuse->chunks);
+	if (fuse->shards)
+		pfree(fuse->shards);
+	if (fuse->fingerprints)
+		pfree(fuse->fingerprints);
+	pfree(fuse);
+}
+
+/*
+ * Bytes of memory needed to build a filter with nkeys keys
+ */
+static Size
+fuse_build_size(int64 nkeys)
+{
+	return nkeys * FUSE_KEY_BYTES +
+		Min(nkeys, FUSE_SHARD_KEYS) * FUSE_WORK_BYTES +
+		FUSE_CHUNK_KEYS * sizeof(uint64);
+}
+
+/*
+ * Free buffered keys that haven't been freed already, but not the array of
+ * chunk pointers
+ */
+static void
+fuse_free_chunks(fuse_filter *filter)
+{
+	int			i;
+
+	for (i = 0; i < filter->nchunks; i++)
+	{
+		if (filter->chunks[i])
+			pfree(filter->chunks[i]);
+	}
+	filter->nchunks = 0;
+}
+
+/*
+ * Partition buffered keys by shard, in place, so that shard s's keys are
+ * those from bounds[s] up to bounds[s + 1].  Each key that's out of place is
+ * swapped into the next free place in its own shard's partition, until a key
+ * that belongs in the current place turns up.
+ */
+static void
+fuse_partition(fuse_filter *filter, int64 *bounds)
+{
+	int64	   *next;
+	int64		i;
+	int			s;
+
+	memset(bounds, 0, (filter->nshards + 1) * sizeof(int64));
+	if (filter->nshards == 1)
+	{
+		bounds[1] = filter->nkeys;
+		return;
+	}
+
+	for (i = 0; i < filter->nkeys; i++)
+		bounds[fuse_key_shard(filter, FUSE_KEY(filter, i)) -
+			   filter->shards + 1]++;
+	for (s = 0; s < filter->nshards; s++)
+		bounds[s + 1] += bounds[s];
+
+	next = palloc(filter->nshards * sizeof(int64));
+	memcpy(next, bounds, filter->nshards * sizeof(int64));
+
+	for (s = 0; s < filter->nshards; s++)
+	{
+		while (next[s] < bounds[s + 1])
+		{
+			uint64		key = FUSE_KEY(filter, next[s]);
+			int			t;
+
+			while ((t = fuse_key_shard(filter, key) - filter->shards) != s)
+			{
+				uint64		displaced = FUSE_KEY(filter, next[t]);
+
+				FUSE_KEY(filter, next[t]) = key;
+				next[t]++;
+				key = displaced;
+			}
+
+			FUSE_KEY(filter, next[s]) = key;
+			next[s]++;
+		}
+	}
+
+	pfree(next);
+}
+
+/*
+ * Build shard from the nkeys buffered keys starting at key first.
+ *
+ * Each key is mapped to 3 positions in the shard's fingerprints, which are
+ * then assigned so that the 3 fingerprints XOR together to the key's own
+ * fingerprint.  Assignment works by repeatedly "peeling" a key that is the
+ * only one left mapped to some position, which can then be assigned last.
+ * When peeling gets stuck before every key has been peeled, construction is
+ * retried with a new seed.  Positions are confined to 3 consecutive segments
+ * of the array, which makes peeling almost certain to succeed with an array
+ * only 12.5% larger than the number of keys.  This closely follows the
+ * reference implementation that accompanies the paper.
+ */
+static bool
+fuse_build_shard(fuse_filter *filter, fuse_shard *shard, fuse_work *work,
+				 int64 first, uint64 nkeys, uint64 *rngstate)
+{
+	uint64		capacity = shard->array_length;
+	uint64	   *order = work->order;
+	uint64	   *t2hash = work->t2hash;
+	uint32	   *alone = work->alone;
+	uint8	   *t2count = work->t2count;
+	uint8	   *reverseh = work->reverseh;
+	uint64	   *startpos = work->startpos;
+	uint8	   *fingerprints = filter->fingerprints + shard->offset;
+	uint64		stacksize = 0;
+	int			blockbits = 1;
+	int			attempt;
+	bool		built = false;
+
+	while ((UINT64CONST(1) << blockbits) <
+		   shard->segment_count_length / shard->segment_length)
+		blockbits++;
+
+	for (attempt = 0; attempt < FUSE_MAX_ATTEMPTS; attempt++)
+	{
+		uint64		nblocks = UINT64CONST(1) << blockbits;
+		uint64		duplicates = 0;
+		uint64		qsize = 0;
+		bool		error = false;
+		uint64		i;
+
+		/*
+		 * Duplicate keys are usually dropped as they're counted below, but
+		 * not always.  Remove them all up front before trying again, by
+		 * sorting a copy of the keys in order.
+		 */
+		if (attempt == 1)
+		{
+			uint64		ndistinct = 0;
+
+			for (i = 0; i < nkeys; i++)
+				order[i] = FUSE_KEY(filter, first + i);
+			qsort(order, nkeys, sizeof(uint64), fuse_key_cmp);
+			for (i = 0; i < nkeys; i++)
+			{
+				if (i > 0 && order[i] == order[i - 1])
+					continue;
+				FUSE_KEY(filter, first + ndistinct) = order[i];
+				ndistinct++;
+			}
+			nkeys = ndistinct;
+		}
+
+		/* Next seed from splitmix64 generator */
+		*rngstate += UINT64CONST(0x9E3779B97F4A7C15);
+		shard->fuseseed = fmix64(*rngstate);
+
+		memset(order, 0, nkeys * sizeof(uint64));
+		order[nkeys] = 1;
+		memset(t2hash, 0, capacity * sizeof(uint64));
+		memset(t2count, 0, capacity);
+
+		/*
+		 * Roughly sort hashes by their first position, so that adding them
+		 * below works through the arrays sequentially
+		 */
+		for (i = 0; i < nblocks; i++)
+			startpos[i] = (i * nkeys) >> blockbits;
+		for (i = 0; i < nkeys; i++)
+		{
+			uint64		hash = fmix64(FUSE_KEY(filter, first + i) +
+									  shard->fuseseed);
+			uint64		block = hash >> (64 - blockbits);
+
+			while (order[startpos[block]] != 0)
+				block = (block + 1) & (nblocks - 1);
+			order[startpos[block]] = hash;
+			startpos[block]++;
+		}
+
+		/*
+		 * Count keys mapped to each position, remembering which of the 3
+		 * positions it was for each key in the low 2 bits of the count, and
+		 * XOR of the hashes of keys mapped there.  Duplicate keys are dropped.
+		 */
+		for (i = 0; i < nkeys; i++)
+		{
+			uint64		hash = order[i];
+			uint64		h[3];
+
+			fuse_positions(shard, hash, h);
+			t2count[h[0]] += 4;
+			t2hash[h[0]] ^= hash;
+			t2count[h[1]] += 4;
+			t2count[h[1]] ^= 1;
+			t2hash[h[1]] ^= hash;
+			t2count[h[2]] += 4;
+			t2count[h[2]] ^= 2;
+			t2hash[h[2]] ^= hash;
+
+			if ((t2hash[h[0]] & t2hash[h[1]] & t2hash[h[2]]) == 0 &&
+				((t2hash[h[0]] == 0 && t2count[h[0]] == 8) ||
+				 (t2hash[h[1]] == 0 && t2count[h[1]] == 8) ||
+				 (t2hash[h[2]] == 0 && t2count[h[2]] == 8)))
+			{
+				duplicates++;
+				t2count[h[0]] -= 4;
+				t2hash[h[0]] ^= hash;
+				t2count[h[1]] -= 4;
+				t2count[h[1]] ^= 1;
+				t2hash[h[1]] ^= hash;
+				t2count[h[2]] -= 4;
+				t2count[h[2]] ^= 2;
+				t2hash[h[2]] ^= hash;
+			}
+
+			/* Counts can overflow, which calls for another attempt */
+			if (t2count[h[0]] < 4 || t2count[h[1]] < 4 || t2count[h[2]] < 4)
+				error = true;
+		}
+		if (error)
+			continue;
+
+		/* Peel keys that are alone at some position, until none are left */
+		for (i = 0; i < capacity; i++)
+		{
+			alone[qsize] = (uint32) i;
+			if ((t2count[i] >> 2) == 1)
+				qsize++;
+		}
+
+		stacksize = 0;
+		while (qsize > 0)
+		{
+			uint32		index = alone[--qsize];
+
+			if ((t2count[index] >> 2) == 1)
+			{
+				uint64		hash = t2hash[index];
+				int			found = t2count[index] & 3;
+				uint64		h[5];
+				int			j;
+
+				reverseh[stacksize] = found;
+				order[stacksize] = hash;
+				stacksize++;
+
+				/* Remove key from its other 2 positions */
+				fuse_positions(shard, hash, h);
+				h[3] = h[0];
+				h[4] = h[1];
+				for (j = 1; j <= 2; j++)
+				{
+					uint64		other = h[found + j];
+
+					alone[qsize] = (uint32) other;
+					if ((t2count[other] >> 2) == 2)
+						qsize++;
+					t2count[other] -= 4;
+					t2count[other] ^= (found + j) % 3;
+					t2hash[other] ^= hash;
+				}
+			}
+		}
+
+		if (stacksize + duplicates == nkeys)
+		{
+			built = true;
+			break;
+		}
+	}
+
+	if (!built)
+		return false;
+
+	/* Assign fingerprints in the reverse of the order keys were peeled */
+	for (; stacksize > 0; stacksize--)
+	{
+		uint64		hash = order[stacksize - 1];
+		int			found = reverseh[stacksize - 1];
+		uint64		h[5];
+
+		fuse_positions(shard, hash, h);
+		h[3] = h[0];
+		h[4] = h[1];
+		fingerprints[h[found]] = fuse_fingerprint(hash) ^
+			fingerprints[h[found + 1]] ^
+			fingerprints[h[found + 2]];
+		filter->nelems++;
+	}
+
+	return true;
+}
+
+/*
+ * qsort() comparator for keys
+ */
+static int
+fuse_key_cmp(const void *a, const void *b)
+{
+	uint64		ka = *(const uint64 *) a;
+	uint64		kb = *(const uint64 *) b;
+
+	if (ka < kb)
+		return -1;
+	if (ka > kb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Determine shard's segment length and array size for nkeys keys
+ */
+static void
+fuse_geometry(fuse_shard *shard, int64 nkeys)
+{
+	uint64		segment_length;
+	uint64		capacity = 0;
+	uint64		segment_count;
+
+	if (nkeys == 0)
+		segment_length = 4;
+	else
+		segment_length = UINT64CONST(1) <<
+			(int) floor(log((double) nkeys) / log(3.33) + 2.25);
+	segment_length = Min(segment_length, FUSE_MAX_SEGMENT);
+
+	/* Smaller sets need proportionately more space to peel reliably */
+	if (nkeys > 1)
+		capacity = (uint64) rint(nkeys *
+								 Max(1.125, 0.875 + 0.25 * log(1000000.0) /
+									 log((double) nkeys)));
+
+	/* Keys' first positions are spread across all but the last 2 segments */
+	segment_count = (capacity + segment_length - 1) / segment_length;
+	segment_count = segment_count <= 2 ? 1 : segment_count - 2;
+
+	shard->segment_length = segment_length;
+	shard->segment_count_length = segment_count * segment_length;
+	shard->array_length = (segment_count + 2) * segment_length;
+}
+
+/*
+ * Shard that a key with hash value hash belongs to
+ */
+static inline fuse_shard *
+fuse_key_shard(fuse_filter *filter, uint64 hash)
+{
+	return &filter->shards[mulhi64(hash, filter->nshards)];
+}
+
+/*
+ * Determine the 3 positions in shard's fingerprints that hash maps to.  These
+ * are in consecutive segments.
+ */
+static inline void
+fuse_positions(fuse_shard *shard, uint64 hash, uint64 *positions)
+{
+	uint64		mask = shard->segment_length - 1;
+	uint64		h0 = mulhi64(hash, shard->segment_count_length);
+
+	positions[0] = h0;
+	positions[1] = (h0 + shard->segment_length) ^ ((hash >> 18) & mask);
+	positions[2] = (h0 + 2 * shard->segment_length) ^ (hash & mask);
+}
+
+/*
+ * Fingerprint that filter stores for hash
+ */
+static inline uint8
+fuse_fingerprint(uint64 hash)
+{
+	return (uint8) (hash ^ (hash >> 32));
+}
+
+/*
+ * High 64 bits of 128-bit product, which maps a hash value onto [0, b)
+ */
+static inline uint64
+mulhi64(uint64 a, uint64 b)
+{
+#ifdef __SIZEOF_INT128__
+	return (uint64) (((unsigned __int128) a * b) >> 64);
+#else
+	uint64		alo = a & 0xFFFFFFFF,
+				ahi = a >> 32;
+	uint64		blo = b & 0xFFFFFFFF,
+				bhi = b >> 32;
+	uint64		mid1 = ahi * blo + ((alo * blo) >> 32);
+	uint64		mid2 = alo * bhi + (mid1 & 0xFFFFFFFF);
+
+	return ahi * bhi + (mid1 >> 32) + (mid2 >> 32);
+#endif
+}
@@ -27,6 +27,8 @@ RESET ROLE;
 -- above explicit permission has to be granted for that.
 GRANT EXECUTE ON FUNCTION bt_index_check(regclass, boolean) TO bttest_role;
 GRANT EXECUTE ON FUNCTION bt_index_parent_check(regclass, boolean) TO bttest_role;
+GRANT EXECUTE ON FUNCTION bt_index_check(regclass, boolean, boolean) TO bttest_role;
+GRANT EXECUTE ON FUNCTION bt_index_parent_check(regclass, boolean, boolean) TO bttest_role;
 SET ROLE bttest_role;
 SELECT bt_index_check('bttest_a_idx');
 SELECT bt_index_parent_check('bttest_a_idx');
@@ -45,6 +47,67 @@ SELECT bt_index_check('bttest_a_idx');
 -- more expansive tests
 SELECT bt_index_check('bttest_a_idx', true);
 SELECT bt_index_parent_check('bttest_b_idx', true);
+-- exact heapallindexed verification, using sort and merge
+SELECT bt_index_check('bttest_a_idx', true, true);
+SELECT bt_index_parent_check('bttest_b_idx', true, true);
+
+-- heapallindexed verification split into fingerprint and probe steps
+SELECT bt_index_fingerprint_probe('bttest_a_idx', bt_index_fingerprint('bttest_a_idx'));
+-- fingerprint of a different index is rejected (error)
+\set VERBOSITY terse
+SELECT bt_index_fingerprint_probe('bttest_b_idx', bt_index_fingerprint('bttest_a_idx'));
+SELECT bt_index_fingerprint_probe('bttest_a_idx', '\x00');
+\set VERBOSITY default
+
+-- heapallindexed verification, returning filter statistics; a static
+-- filter reports no bits set
+SELECT heap_tuples, passes, bits_set IS NULL AS static_ok,
+    estimated_index_tuples BETWEEN 95000 AND 105000 AS estimate_ok,
+    false_positive_rate < 0.02 AS rate_ok
+FROM bt_index_check_stats('bttest_a_idx');
+SELECT heap_tuples, passes, false_positive_rate < 0.02 AS rate_ok
+FROM bt_index_check_stats('bttest_b_idx', true);
+
+-- heapallindexed verification in more than one pass, when
+-- maintenance_work_mem is too small for one Bloom filter
+CREATE TABLE bttest_multi(id int4);
+ALTER TABLE bttest_multi SET (autovacuum_enabled = false);
+INSERT INTO bttest_multi SELECT * FROM generate_series(1, 600000);
+CREATE INDEX bttest_multi_idx ON bttest_multi USING btree (id);
+SET maintenance_work_mem = '1MB';
+SELECT bt_index_check('bttest_multi_idx', true);
+SELECT bt_index_parent_check('bttest_multi_idx', true);
+SELECT heap_tuples = (SELECT count(*) FROM bttest_multi) AS heap_tuples_ok,
+    passes, bits_set < bitset_bits AS bits_ok
+FROM bt_index_check_stats('bttest_multi_idx');
+RESET maintenance_work_mem;
+
+-- verification in block number order, rather than by walking each level
+SELECT direct_blocks FROM bt_index_physical_check('bttest_a_idx');
+SELECT direct_blocks FROM bt_index_physical_check('bttest_b_idx');
+-- reading blocks that aren't in shared_buffers directly from segment files;
+-- every block but the meta page is read once, one way or the other
+SELECT direct_blocks + buffered_blocks =
+    pg_relation_size('bttest_b_idx') / current_setting('block_size')::int - 1
+    AS all_read
+FROM bt_index_physical_check('bttest_b_idx', true);
+-- a freshly built index was written without going through shared_buffers,
+-- so its blocks are read directly
+CREATE TABLE bttest_direct(id int4);
+ALTER TABLE bttest_direct SET (autovacuum_enabled = false);
+INSERT INTO bttest_direct SELECT * FROM generate_series(1, 1000);
+CREATE INDEX bttest_direct_idx ON bttest_direct USING btree (id);
+DO $$
+DECLARE
+    direct bigint;
+BEGIN
+    SELECT direct_blocks INTO direct
+    FROM bt_index_physical_check('bttest_direct_idx', true);
+    IF direct = 0 THEN
+        RAISE EXCEPTION 'no blocks of bttest_direct_idx were read directly';
+    END IF;
+END;
+$$;
 
 BEGIN;
 SELECT bt_index_check('bttest_a_idx');
@@ -65,6 +128,7 @@ VACUUM delete_test_table;
 DELETE FROM delete_test_table WHERE a > 10;
 VACUUM delete_test_table;
 SELECT bt_index_parent_check('delete_test_table_pkey', true);
+SELECT direct_blocks FROM bt_index_physical_check('delete_test_table_pkey');
 
 --
 -- BUG #15597: must not assume consistent input toasting state when forming
@@ -80,10 +144,13 @@ ALTER TABLE toast_bug ALTER COLUMN buggy SET STORAGE extended;
 INSERT INTO toast_bug SELECT repeat('a', 2200);
 -- Should not get false positive report of corruption:
 SELECT bt_index_check('toasty', true);
+SELECT bt_index_check('toasty', true, true);
 
 -- cleanup
 DROP TABLE bttest_a;
 DROP TABLE bttest_b;
+DROP TABLE bttest_multi;
+DROP TABLE bttest_direct;
 DROP TABLE delete_test_table;
 DROP TABLE toast_bug;
 DROP OWNED BY bttest_role; -- permissions
@@ -25,17 +25,29 @@
  */
 #include "postgres.h"
 
+#include "access/hash.h"
 #include "access/htup_details.h"
 #include "access/nbtree.h"
 #include "access/transam.h"
+#include "access/xlog.h"
 #include "bloomfilter.h"
 #include "catalog/index.h"
 #include "catalog/pg_am.h"
 #include "commands/tablecmds.h"
+#include "common/relpath.h"
+#include "funcapi.h"
 #include "miscadmin.h"
+#if PG_VERSION_NUM < 140000
+#include "storage/buf_internals.h"
+#endif
+#include "storage/bufmgr.h"
+#include "storage/checksum.h"
+#include "storage/fd.h"
 #include "storage/lmgr.h"
+#include "utils/hsearch.h"
 #include "utils/memutils.h"
 #include "utils/snapmgr.h"
+#include "utils/tuplesort.h"
 
 
 PG_MODULE_MAGIC;
@@ -46,6 +58,224 @@ PG_MODULE_MAGIC;
  */
 #define InvalidBtreeLevel	((uint32) InvalidBlockNumber)
 
+/*
+ * Number of normalized heap tuples that heapallindexed verification buffers
+ * before probing the Bloom filter for all of them at once
+ */
+#define BT_PROBE_BATCH_SIZE	64
+
+/*
+ * Estimated Bloom filter false positive rate above which heapallindexed
+ * verification warns that it was not thorough.  The filter is normally sized
+ * for a rate of between 1% and 2%.
+ */
+#define BT_MAX_FALSE_POSITIVE_RATE	0.05
+
+/*
+ * Number of leaf pages sampled to estimate the number of tuples that
+ * heapallindexed verification fingerprints
+ */
+#define BT_LEAF_SAMPLE_SIZE	32
+
+/*
+ * Number of pages that verification can hold at once without falling back on
+ * palloc().  There is seldom more than a target page, its right sibling, and
+ * a child page.
+ */
+#define BT_PAGE_POOL_SIZE	8
+
+/*
+ * Fraction of maintenance_work_mem, as a divisor, left to the downlink bounds
+ * lists, prefetch lists and page cache of structure verification when
+ * heapallindexed verification needs the rest.  They get all of it otherwise.
+ */
+#define BT_STRUCTURE_MEM_DIVISOR	4
+
+/*
+ * Number of blocks read at once by physical-order verification when it reads
+ * the index directly from its segment files
+ */
+#define BT_DIRECT_READ_BLOCKS	32
+
+/*
+ * Per-block state kept by physical-order verification, in one uint16 per
+ * block.  The low bits hold the page's level, as found on the page once it
+ * has been read, or as implied by a downlink to it before then.
+ */
+#define BT_BLOCK_READ			0x8000	/* live page was read */
+#define BT_BLOCK_UNUSED			0x4000	/* deleted or new page was read */
+#define BT_BLOCK_DOWNLINK		0x2000	/* downlink to page was found */
+#define BT_BLOCK_NODOWNLINK_OK	0x1000	/* page need not have a downlink */
+#define BT_BLOCK_LEVEL_MASK		0x0FFF
+
+/*
+ * Exported heapallindexed fingerprint header.  Serialized Bloom filter
+ * follows immediately.
+ *
+ * The fingerprint identifies the index by relfilenode, which changes with
+ * each REINDEX, as well as by system identifier.  WAL position at the time of
+ * fingerprinting guards against probing a cluster restored to a point before
+ * the fingerprint was taken.
+ */
+#define BT_FINGERPRINT_MAGIC	0x42544650	/* "BTFP" */
+
+typedef struct BtreeFingerprint
+{
+	uint32		magic;
+	Oid			relfilenode;
+	uint64		sysidentifier;
+	XLogRecPtr	lsn;
+	TransactionId xmincutoff;
+	uint32		padding;
+} BtreeFingerprint;
+
+/*
+ * Statistics about heapallindexed verification's filters, returned by
+ * bt_index_check_stats().  Filter statistics are summed across passes, except
+ * for the false positive rate, which is the highest of any pass.  Bits set
+ * aren't meaningful for a static filter, whose fingerprint width is reported
+ * instead.
+ *
+ * Physical-order verification instead returns the number of blocks that its
+ * scan read directly from segment files, and through shared_buffers.
+ */
+typedef struct BtreeCheckStats
+{
+	/* Heap tuples probed */
+	int64		heaptuples;
+	/* Passes over leaf level and heap, one per partition */
+	int			passes;
+	bloom_filter_stats filter;
+	/* Physical-order verification only */
+	int64		directblocks;
+	int64		bufferedblocks;
+} BtreeCheckStats;
+
+/*
+ * Pages held by verification.  Each slot is either a pinned buffer, whose
+ * page is checked in place, a copy of a page in the slot's BLCKSZ-aligned
+ * space, or a page in the internal page cache.  Slots are reused from page to
+ * page, rather than each page being palloc()'d and freed along with the
+ * per-page memory context.
+ */
+typedef struct BtreePagePool
+{
+	/* Space for copies of pages, BLCKSZ bytes per slot */
+	char	   *space;
+	char	   *unaligned;
+	/* Page held by each slot */
+	Page		pages[BT_PAGE_POOL_SIZE];
+	/* Pinned buffer for slots checked in place, or InvalidBuffer */
+	Buffer		buffers[BT_PAGE_POOL_SIZE];
+	/* Bitmask of slots in use */
+	uint32		inuse;
+} BtreePagePool;
+
+/*
+ * Copy of an internal page, cached by block number
+ */
+typedef struct BtreeCachedPage
+{
+	BlockNumber block;
+	Page		page;
+} BtreeCachedPage;
+
+/*
+ * Window of blocks read directly from one of the index's segment files,
+ * bypassing shared_buffers.  resident marks blocks in window that were found
+ * in shared_buffers before the window was read, which must be read through
+ * the buffer manager instead.
+ */
+typedef struct BtreeDirectRead
+{
+	/* Open segment file, and its segment number and path */
+	int			fd;
+	BlockNumber segno;
+	char	   *path;
+	/* Number of blocks in index */
+	BlockNumber nblocks;
+	/* First block in window, and number of blocks read into window */
+	BlockNumber start;
+	int			nread;
+	char	   *window;
+	char	   *unaligned;
+	bool		resident[BT_DIRECT_READ_BLOCKS];
+	/* Blocks returned from window */
+	BlockNumber direct;
+} BtreeDirectRead;
+
+/*
+ * Sibling links that physical-order verification has yet to match, keyed by
+ * the higher of the two block numbers in each pair of siblings.  Links are
+ * recorded when the lower block is read, and matched once the block that
+ * they point to is read.
+ *
+ * leftblock is the block's left sibling, whose right link points to block,
+ * and leftlast is a copy of left sibling's last item.  rightblock and
+ * rightfirst are the same for block's right sibling, whose left link points
+ * to block.  Items are NULL when there is none to compare.
+ */
+typedef struct BtreeSiblingLinks
+{
+	BlockNumber block;
+	BlockNumber leftblock;
+	IndexTuple	leftlast;
+	BlockNumber rightblock;
+	IndexTuple	rightfirst;
+} BtreeSiblingLinks;
+
+/*
+ * Key space bounds that a downlink places on its child page.  Every item on
+ * the child must be between the two keys.
+ */
+typedef struct BtreeDownlinkBounds
+{
+	BlockNumber childblock;
+	/* Parent page, and its LSN, for reporting violations */
+	BlockNumber parentblock;
+	XLogRecPtr	parentlsn;
+	/* Downlink's own key, or NULL for negative infinity downlink */
+	IndexTuple	lowkey;
+	/* Next downlink's key, or parent's high key, or NULL when neither */
+	IndexTuple	highkey;
+} BtreeDownlinkBounds;
+
+/*
+ * Bounds of the downlinks on one level, in the order the level walk finds
+ * them, which is also the order the level below is walked in.  Each child is
+ * checked against its bounds when it's reached by the walk of the level
+ * below, rather than being read out of order as soon as its downlink is seen.
+ */
+typedef struct BtreeBoundsList
+{
+	MemoryContext context;
+	BtreeDownlinkBounds *bounds;
+	int			nbounds;
+	int			maxbounds;
+	/* First bounds not yet matched by walk of level below */
+	int			next;
+	/* Memory used, and whether state's structuremem ran out */
+	Size		used;
+	bool		full;
+} BtreeBoundsList;
+
+/*
+ * Blocks that the downlinks on one level point to, in the order the level
+ * walk finds them.  The walk of the level below prefetches blocks from here
+ * ahead of reading them.
+ */
+typedef struct BtreeLevelBlocks
+{
+	BlockNumber *blocks;
+	int			nblocks;
+	int			maxblocks;
+	/* Blocks reached by walk of level below, and blocks prefetched */
+	int			walked;
+	int			prefetched;
+	/* Did list stop growing? */
+	bool		full;
+} BtreeLevelBlocks;
+
 /*
  * State associated with verifying a B-Tree index
  *
@@ -70,10 +300,33 @@ typedef struct BtreeCheckState
 	bool		readonly;
 	/* Also verifying heap has no unindexed tuples? */
 	bool		heapallindexed;
+	/* Sort and merge tuples in heapallindexed case, rather than using Bloom? */
+	bool		exact;
+	/* Reading index in block number order, rather than walking levels? */
+	bool		physical;
+	/* Reading blocks directly from segment files, rather than buffers? */
+	bool		directio;
+	/*
+	 * Shares of maintenance_work_mem:  kilobytes for heapallindexed
+	 * verification's Bloom filter or sorts, and bytes for the lists and caches
+	 * of structure verification, which are charged to structureused
+	 */
+	int			heapallindexedmem;
+	Size		structuremem;
 	/* Per-page context */
 	MemoryContext targetcontext;
 	/* Buffer access strategy */
 	BufferAccessStrategy checkstrategy;
+	/* Pages currently held, and space for copies of them */
+	BtreePagePool pool;
+	/*
+	 * Copies of internal pages, kept for the duration of verification in
+	 * readonly case, up to pagecachemax pages
+	 */
+	HTAB	   *pagecache;
+	MemoryContext pagecachecontext;
+	long		pagecachemax;
+	int64		pagecachehits;
 
 	/*
 	 * Mutable state, for verification of particular page:
@@ -92,12 +345,81 @@ typedef struct BtreeCheckState
 
 	/* Bloom filter fingerprints B-Tree index */
 	bloom_filter *filter;
-	/* Bloom filter fingerprints downlink blocks within tree */
-	bloom_filter *downlinkfilter;
+	/* Seed for Bloom filter, which is created on reaching leaf level */
+	uint64		seed;
+	/* Leaf pages counted from downlinks on level 1 */
+	int64		leafpages;
+	/* Systematic sample of leaf pages, taking every leafstride-th downlink */
+	BlockNumber leafsample[BT_LEAF_SAMPLE_SIZE];
+	int			nleafsample;
+	int64		leafstride;
+	/* Estimated number of tuples that Bloom filter fingerprints */
+	int64		leaftuples;
+	/* Number of hash partitions, each fingerprinted by its own pass */
+	int			npartitions;
+	/* Is filter a static filter, which must be frozen before probes? */
+	bool		staticfilter;
+	/* Are filters ranged by the heap block that each tuple points to? */
+	bool		ranged;
+	/* Hash partition of tuples that current pass fingerprints and probes */
+	int			partition;
+	/* Heap tuples with an xmin that precedes this must be fingerprinted */
+	TransactionId xmincutoff;
+	/* Bloom filter imported from an earlier bt_index_fingerprint() call? */
+	bool		imported;
+	/* Context for batch of heap tuples awaiting Bloom filter probe */
+	MemoryContext probecontext;
+	/* Batch of normalized heap tuples awaiting Bloom filter probe */
+	IndexTuple	probebatch[BT_PROBE_BATCH_SIZE];
+	int			nprobebatch;
+	/* Heap block of last Bloom filter segment prefetch, and of next one */
+	uint64		lastprefetch;
+	uint64		nextprefetch;
+	/* Sort of normalized index tuples, in exact case */
+	Tuplesortstate *indexsort;
+	/* Sort of normalized heap tuples, in exact case */
+	Tuplesortstate *heapsort;
+	/*
+	 * Downlink bounds for pages on level being walked, recorded while walking
+	 * level above, and bounds for level below, recorded by current walk.
+	 * Only used in readonly case.
+	 */
+	BtreeBoundsList levelbounds;
+	BtreeBoundsList childbounds;
+	/* Memory of structuremem in use */
+	Size		structureused;
+	/* Downlink blocks for level being walked, and for level below */
+	BtreeLevelBlocks levelblocks;
+	BtreeLevelBlocks childblocks;
+	/* Size of index in blocks, as of start of level walk */
+	BlockNumber levelindexblocks;
+	/*
+	 * Copy of target's right sibling page, made while checking target, which
+	 * the level walk reuses when the right sibling becomes the next target.
+	 * Allocated outside targetcontext, so that it survives the reset.
+	 */
+	Page		rightpage;
+	BlockNumber rightblock;
+	/* Bitmap of blocks with downlinks within tree, and its size in blocks */
+	uint8	   *downlinkbitmap;
+	BlockNumber downlinkblocks;
+	/* Number of distinct blocks in downlinkbitmap */
+	int64		downlinks;
+	/*
+	 * Physical-order verification's state for each block, and sibling links
+	 * from blocks read so far that are yet to be matched
+	 */
+	uint16	   *blockstates;
+	HTAB	   *links;
+	MemoryContext linkscontext;
+	/* Direct reads of physical-order verification, when directio is set */
+	BtreeDirectRead directread;
 	/* Right half of incomplete split marker */
 	bool		rightsplit;
-	/* Debug counter */
+	/* Debug counter, for the current pass */
 	int64		heaptuplespresent;
+	/* Statistics for caller, or NULL */
+	BtreeCheckStats *stats;
 } BtreeCheckState;
 
 /*
@@ -117,22 +439,80 @@ typedef struct BtreeLevel
 
 PG_FUNCTION_INFO_V1(bt_index_check_next);
 PG_FUNCTION_INFO_V1(bt_index_parent_check_next);
+PG_FUNCTION_INFO_V1(bt_index_fingerprint_next);
+PG_FUNCTION_INFO_V1(bt_index_fingerprint_probe_next);
+PG_FUNCTION_INFO_V1(bt_index_check_stats_next);
+PG_FUNCTION_INFO_V1(bt_index_physical_check_next);
 
 static void bt_index_check_internal(Oid indrelid, bool parentcheck,
-						bool heapallindexed);
+						bool physical, bool directio,
+						bool heapallindexed, bool exact,
+						bytea *fingerprint, bytea **exported,
+						BtreeCheckStats *stats);
 static inline void btree_index_checkable(Relation rel);
 static void bt_check_every_level(Relation rel, Relation heaprel,
-					 bool readonly, bool heapallindexed);
+					 bool readonly, bool heapallindexed, bool exact,
+					 bytea **exported, BtreeCheckStats *stats);
+static void bt_probe_fingerprint(Relation rel, Relation heaprel,
+					 bytea *fingerprint);
+static void bt_check_physical(Relation rel, Relation heaprel, bool directio,
+				  BtreeCheckStats *stats);
+static void bt_physical_page_links(BtreeCheckState *state, uint32 level,
+					   BlockNumber nblocks, int64 *leftmost, int64 *rightmost);
+static void bt_physical_downlinks(BtreeCheckState *state, BlockNumber nblocks);
+static OffsetNumber bt_physical_edge_offset(BtreeCheckState *state,
+						bool first);
 static BtreeLevel bt_check_level_from_leftmost(BtreeCheckState *state,
 							 BtreeLevel level);
 static void bt_target_page_check(BtreeCheckState *state);
+static void bt_leaf_sample(BtreeCheckState *state);
+static void bt_leaf_filter_create(BtreeCheckState *state,
+					  BlockNumber leftmostleaf, bool exported);
+static bloom_filter *bt_leaf_filter_next(BtreeCheckState *state,
+					uint64 seed);
+static void bt_leaf_filter_check_ranges(BtreeCheckState *state,
+							BlockNumber leftmostleaf);
 static ScanKey bt_right_page_check_scankey(BtreeCheckState *state);
-static void bt_downlink_check(BtreeCheckState *state, BlockNumber childblock,
-				  ScanKey targetkey);
+static void bt_downlink_record(BtreeCheckState *state, OffsetNumber offset);
+static void bt_downlink_check(BtreeCheckState *state,
+				  BtreeDownlinkBounds *bounds);
+static void bt_child_bounds_check(BtreeCheckState *state,
+					  BtreeDownlinkBounds *bounds, Page child);
+static void bt_bounds_next_level(BtreeCheckState *state);
+static void bt_bounds_finish_level(BtreeCheckState *state);
+static void bt_prefetch_record(BtreeCheckState *state, BlockNumber childblock);
+static void bt_prefetch_next_level(BtreeCheckState *state);
+static void bt_prefetch_level(BtreeCheckState *state, BlockNumber current);
+static int	bt_blocknumber_cmp(const void *a, const void *b);
 static void bt_downlink_missing_check(BtreeCheckState *state);
+static void bt_downlink_missing_descend(BtreeCheckState *state);
+static void bt_fingerprint_tuples(BtreeCheckState *state,
+					  IndexTuple *tuples, int ntuples);
+static void bt_fingerprint_leaf_level(BtreeCheckState *state,
+						  BlockNumber leftmost);
+static BlockNumber bt_leaf_level_recheck(BtreeCheckState *state,
+					  BlockNumber previous);
+static inline bool bt_tuple_in_partition(BtreeCheckState *state,
+					  IndexTuple norm);
+static bytea *bt_fingerprint_export(BtreeCheckState *state);
+static bloom_filter *bt_fingerprint_import(BtreeCheckState *state,
+					  bytea *fingerprint);
+static XLogRecPtr bt_current_lsn(void);
+static void bt_check_heap_present(BtreeCheckState *state);
 static void bt_tuple_present_callback(Relation index, HeapTuple htup,
 						  Datum *values, bool *isnull,
 						  bool tupleIsAlive, void *checkstate);
+static void bt_tuple_present_flush(BtreeCheckState *state);
+static void bt_tuple_present_merge(BtreeCheckState *state);
+static void bt_tuple_missing(BtreeCheckState *state, IndexTuple norm);
+static Tuplesortstate *bt_tuplesort_begin(BtreeCheckState *state,
+				   int workMem);
+static void bt_tuplesort_put(BtreeCheckState *state, Tuplesortstate *sort,
+				 IndexTuple itup);
+static IndexTuple bt_tuplesort_next(Tuplesortstate *sort, IndexTuple prev,
+				  bool *should_free);
+static int bt_tuple_compare(BtreeCheckState *state, ScanKey skey,
+				 IndexTuple a, IndexTuple b);
 static IndexTuple bt_normalize_tuple(BtreeCheckState *state,
 						   IndexTuple itup);
 static inline bool offset_is_negative_infinity(BTPageOpaque opaque,
@@ -147,10 +527,28 @@ static inline bool invariant_leq_nontarget_offset(BtreeCheckState *state,
 							   Page other,
 							   ScanKey key,
 							   OffsetNumber upperbound);
+static inline bool invariant_geq_nontarget_offset(BtreeCheckState *state,
+							   Page other,
+							   ScanKey key,
+							   OffsetNumber lowerbound);
 static Page palloc_btree_page(BtreeCheckState *state, BlockNumber blocknum);
+static void bt_page_pool_init(BtreeCheckState *state);
+static Page bt_page_pool_get(BtreeCheckState *state, Buffer buffer);
+static Page bt_page_pool_cached(BtreeCheckState *state, Page cached);
+static int	bt_page_pool_slot(BtreeCheckState *state, Page page);
+static void bt_release_page(BtreeCheckState *state, Page page);
+static Page bt_direct_read(BtreeCheckState *state, BlockNumber blocknum);
+static void bt_direct_read_window(BtreeCheckState *state,
+					  BlockNumber blocknum);
+static bool bt_direct_page_verified(Page page, BlockNumber blocknum);
+static bool bt_block_resident(BtreeCheckState *state, BlockNumber blocknum);
+static void bt_page_cache_create(BtreeCheckState *state);
+static void bt_page_cache_add(BtreeCheckState *state, BlockNumber blocknum,
+				  Page page);
+static void bt_page_pool_reset(BtreeCheckState *state);
 
 /*
- * bt_index_check(index regclass, heapallindexed boolean)
+ * bt_index_check(index regclass, heapallindexed boolean, exact boolean)
  *
  * Note that the symbol name is appended with "_next", to avoid symbol clashes
  * with contrib/amcheck.
@@ -159,24 +557,29 @@ static Page palloc_btree_page(BtreeCheckState *state, BlockNumber blocknum);
  *
  * Acquires AccessShareLock on heap & index relations.  Does not consider
  * invariants that exist between parent/child pages.  Optionally verifies
- * that heap does not contain any unindexed or incorrectly indexed tuples.
+ * that heap does not contain any unindexed or incorrectly indexed tuples,
+ * either approximately or exactly.
  */
 Datum
 bt_index_check_next(PG_FUNCTION_ARGS)
 {
 	Oid			indrelid = PG_GETARG_OID(0);
 	bool		heapallindexed = false;
+	bool		exact = false;
 
-	if (PG_NARGS() == 2)
+	if (PG_NARGS() >= 2)
 		heapallindexed = PG_GETARG_BOOL(1);
+	if (PG_NARGS() == 3)
+		exact = PG_GETARG_BOOL(2);
 
-	bt_index_check_internal(indrelid, false, heapallindexed);
+	bt_index_check_internal(indrelid, false, false, false, heapallindexed, exact,
+							NULL, NULL, NULL);
 
 	PG_RETURN_VOID();
 }
 
 /*
- * bt_index_parent_check(index regclass, heapallindexed boolean)
+ * bt_index_parent_check(index regclass, heapallindexed boolean, exact boolean)
  *
  * Note that the symbol name is appended with "_next", to avoid symbol clashes
  * with contrib/amcheck.
@@ -185,27 +588,183 @@ bt_index_check_next(PG_FUNCTION_ARGS)
  *
  * Acquires ShareLock on heap & index relations.  Verifies that downlinks in
  * parent pages are valid lower bounds on child pages.  Optionally verifies
- * that heap does not contain any unindexed or incorrectly indexed tuples.
+ * that heap does not contain any unindexed or incorrectly indexed tuples,
+ * either approximately or exactly.
  */
 Datum
 bt_index_parent_check_next(PG_FUNCTION_ARGS)
 {
 	Oid			indrelid = PG_GETARG_OID(0);
 	bool		heapallindexed = false;
+	bool		exact = false;
 
-	if (PG_NARGS() == 2)
+	if (PG_NARGS() >= 2)
 		heapallindexed = PG_GETARG_BOOL(1);
+	if (PG_NARGS() == 3)
+		exact = PG_GETARG_BOOL(2);
+
+	bt_index_check_internal(indrelid, true, false, false, heapallindexed, exact,
+							NULL, NULL, NULL);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * bt_index_fingerprint(index regclass)
+ *
+ * Note that the symbol name is appended with "_next", to avoid symbol clashes
+ * with contrib/amcheck.
+ *
+ * Verify integrity of B-Tree index, and export the Bloom filter that
+ * heapallindexed verification builds, rather than going on to scan the heap.
+ * Fingerprint can later be passed to bt_index_fingerprint_probe(), possibly
+ * on a physical replica.
+ *
+ * Acquires AccessShareLock on heap & index relations.
+ */
+Datum
+bt_index_fingerprint_next(PG_FUNCTION_ARGS)
+{
+	Oid			indrelid = PG_GETARG_OID(0);
+	bytea	   *exported = NULL;
+
+	bt_index_check_internal(indrelid, false, false, false, true, false, NULL,
+							&exported, NULL);
+
+	PG_RETURN_BYTEA_P(exported);
+}
+
+/*
+ * bt_index_fingerprint_probe(index regclass, fingerprint bytea)
+ *
+ * Note that the symbol name is appended with "_next", to avoid symbol clashes
+ * with contrib/amcheck.
+ *
+ * Verify that heap does not contain any unindexed or incorrectly indexed
+ * tuples, using fingerprint from an earlier bt_index_fingerprint() call in
+ * place of a walk of the index.  Only heap tuples whose inserting transaction
+ * had finished before the fingerprint was taken are considered.
+ *
+ * Acquires AccessShareLock on heap & index relations.
+ */
+Datum
+bt_index_fingerprint_probe_next(PG_FUNCTION_ARGS)
+{
+	Oid			indrelid = PG_GETARG_OID(0);
+	bytea	   *fingerprint = PG_GETARG_BYTEA_PP(1);
 
-	bt_index_check_internal(indrelid, true, heapallindexed);
+	bt_index_check_internal(indrelid, false, false, false, true, false,
+							fingerprint, NULL, NULL);
 
 	PG_RETURN_VOID();
 }
 
 /*
- * Helper for bt_index_[parent_]check, coordinating the bulk of the work.
+ * bt_index_check_stats(index regclass, parentcheck boolean)
+ *
+ * Note that the symbol name is appended with "_next", to avoid symbol clashes
+ * with contrib/amcheck.
+ *
+ * Verify integrity of B-Tree index, just like bt_index_check() or
+ * bt_index_parent_check() with heapallindexed verification, and return
+ * statistics about the filters used.  The estimated false positive rate
+ * is the probability that any one missing index tuple went undetected, which
+ * rises when maintenance_work_mem is too small for the index.
+ *
+ * Acquires ShareLock on heap & index relations when parentcheck is true, and
+ * AccessShareLock otherwise.
+ */
+Datum
+bt_index_check_stats_next(PG_FUNCTION_ARGS)
+{
+	Oid			indrelid = PG_GETARG_OID(0);
+	bool		parentcheck = PG_GETARG_BOOL(1);
+	BtreeCheckStats stats;
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	memset(&stats, 0, sizeof(BtreeCheckStats));
+	bt_index_check_internal(indrelid, parentcheck, false, false, true, false,
+							NULL, NULL, &stats);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(stats.heaptuples);
+	values[1] = Int32GetDatum(stats.passes);
+	values[2] = Int64GetDatum((int64) stats.filter.bits);
+	values[3] = Int64GetDatum((int64) stats.filter.bits_set);
+	/* Static filters have no bits set to speak of */
+	nulls[3] = (stats.filter.fingerprint_bits > 0);
+	values[4] = Int64GetDatum((int64) (stats.filter.elements + 0.5));
+	values[5] = Float8GetDatum(stats.filter.false_positive_rate);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values,
+													  nulls)));
+}
+
+/*
+ * bt_index_physical_check(index regclass, directio boolean)
+ *
+ * Note that the symbol name is appended with "_next", to avoid symbol clashes
+ * with contrib/amcheck.
+ *
+ * Verify integrity of B-Tree index, reading it sequentially, in block number
+ * order, rather than following links between pages.  Sibling links, page
+ * levels and downlink levels are cross-checked in memory.  Optionally reads
+ * blocks that aren't in shared_buffers directly from the index's segment
+ * files, so that verification doesn't evict them from either cache.  Returns
+ * the number of blocks read directly, and through shared_buffers.
+ *
+ * Acquires ShareLock on heap & index relations.
+ */
+Datum
+bt_index_physical_check_next(PG_FUNCTION_ARGS)
+{
+	Oid			indrelid = PG_GETARG_OID(0);
+	bool		directio = PG_GETARG_BOOL(1);
+	BtreeCheckStats stats;
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	memset(&stats, 0, sizeof(BtreeCheckStats));
+	bt_index_check_internal(indrelid, true, true, directio, false, false,
+							NULL, NULL, &stats);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(stats.directblocks);
+	values[1] = Int64GetDatum(stats.bufferedblocks);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values,
+													  nulls)));
+}
+
+/*
+ * Helper for bt_index_[parent_]check and bt_index_fingerprint[_probe],
+ * coordinating the bulk of the work.
+ *
+ * When physical is passed, the index is read in block number order rather
+ * than walked level by level, directly from its segment files when directio
+ * is also passed.  When fingerprint is passed, it is probed in
+ * place of walking the index.
+ * When exported is passed, it is set to the fingerprint of the index, and the
+ * heap is not scanned.  When stats is passed, it is filled in with statistics
+ * about heapallindexed verification's Bloom filters, or about the blocks read
+ * by physical-order verification.
  */
 static void
-bt_index_check_internal(Oid indrelid, bool parentcheck, bool heapallindexed)
+bt_index_check_internal(Oid indrelid, bool parentcheck, bool physical,
+						bool directio, bool heapallindexed, bool exact,
+						bytea *fingerprint, bytea **exported,
+						BtreeCheckStats *stats)
 {
 	Oid			heapid;
 	Relation	indrel;
@@ -260,7 +819,13 @@ bt_index_check_internal(Oid indrelid, bool parentcheck, bool heapallindexed)
 	btree_index_checkable(indrel);
 
 	/* Check index, possibly against table it is an index on */
-	bt_check_every_level(indrel, heaprel, parentcheck, heapallindexed);
+	if (fingerprint)
+		bt_probe_fingerprint(indrel, heaprel, fingerprint);
+	else if (physical)
+		bt_check_physical(indrel, heaprel, directio, stats);
+	else
+		bt_check_every_level(indrel, heaprel, parentcheck, heapallindexed,
+							 exact, exported, stats);
 
 	/*
 	 * Release locks early. That's ok here because nothing in the called
@@ -328,16 +893,26 @@ btree_index_checkable(Relation rel)
  * per-page, and requires an exclusive buffer lock, which wouldn't cause us
  * trouble.  _bt_delitems_vacuum() may only delete leaf items, and so the extra
  * parent/child check cannot be affected.)
+ *
+ * When exported is passed, heapallindexed verification stops short of
+ * scanning the heap, and sets it to a fingerprint of the index instead.
+ *
+ * When exact is passed, heapallindexed verification sorts normalized index
+ * tuples and heap tuples, and merge joins them, instead of using a Bloom
+ * filter.  This detects every missing or malformed tuple, at the cost of
+ * sorting both relations.
  */
 static void
 bt_check_every_level(Relation rel, Relation heaprel, bool readonly,
-					 bool heapallindexed)
+					 bool heapallindexed, bool exact, bytea **exported,
+					 BtreeCheckStats *stats)
 {
 	BtreeCheckState *state;
 	Page		metapage;
 	BTMetaPageData *metad;
 	uint32		previouslevel;
 	BtreeLevel	current;
+	BlockNumber leftmostleaf = P_NONE;
 
 	/*
 	 * RecentGlobalXmin assertion matches index_getnext_tid().  See note on
@@ -356,19 +931,43 @@ bt_check_every_level(Relation rel, Relation heaprel, bool readonly,
 	state->heaprel = heaprel;
 	state->readonly = readonly;
 	state->heapallindexed = heapallindexed;
+	state->exact = heapallindexed && exact;
+	state->stats = stats;
+	bt_page_pool_init(state);
+
+	state->structuremem = maintenance_work_mem * 1024L;
 
 	if (state->heapallindexed)
 	{
-		int64		total_elems;
 		uint64		seed;
 
-		/* Size Bloom filter based on estimated number of tuples in index */
-		total_elems = (int64) state->rel->rd_rel->reltuples;
+		/*
+		 * heapallindexed verification gets most of maintenance_work_mem,
+		 * since a Bloom filter that doesn't fit takes extra passes over the
+		 * heap.  Structure verification only falls back on reading some
+		 * pages out of order, or more than once.
+		 */
+		state->structuremem /= BT_STRUCTURE_MEM_DIVISOR;
+		state->heapallindexedmem = maintenance_work_mem -
+			maintenance_work_mem / BT_STRUCTURE_MEM_DIVISOR;
+
 		/* Random seed relies on backend srandom() call to avoid repetition */
 		seed = random();
-		/* Create Bloom filter to fingerprint index */
-		state->filter = bloom_create(total_elems, maintenance_work_mem, seed);
-		state->heaptuplespresent = 0;
+
+		/*
+		 * Bloom filter to fingerprint index is only created once the walk
+		 * reaches the leaf level, where it can be sized using level 1's
+		 * downlinks.  In the exact case, create sort to collect index tuples
+		 * now.  heapallindexed verification's memory is split evenly between
+		 * the index sort and the later heap sort.
+		 */
+		state->npartitions = 1;
+		state->seed = seed;
+		state->leafstride = 1;
+		if (state->exact)
+			state->indexsort = bt_tuplesort_begin(state,
+												  state->heapallindexedmem / 2);
+		state->xmincutoff = TransactionXmin;
 
 		if (!state->readonly)
 		{
@@ -391,8 +990,6 @@ bt_check_every_level(Relation rel, Relation heaprel, bool readonly,
 		}
 		else
 		{
-			int64	total_pages;
-
 			/*
 			 * Extra readonly downlink check.
 			 *
@@ -402,9 +999,14 @@ bt_check_every_level(Relation rel, Relation heaprel, bool readonly,
 			 * downlink one level up.  We must be tolerant of interrupted page
 			 * splits and page deletions, though.  This is taken care of in
 			 * bt_downlink_missing_check().
+			 *
+			 * Block numbers are dense, and the index can't grow while we hold
+			 * our lock, so an exact bitmap of blocks takes far less memory
+			 * than a Bloom filter would, and has no false positives.
 			 */
-			total_pages = (int64) state->rel->rd_rel->relpages;
-			state->downlinkfilter = bloom_create(total_pages, work_mem, seed);
+			state->downlinkblocks = RelationGetNumberOfBlocks(state->rel);
+			state->downlinkbitmap =
+				palloc0(state->downlinkblocks / BITS_PER_BYTE + 1);
 		}
 	}
 
@@ -420,6 +1022,50 @@ bt_check_every_level(Relation rel, Relation heaprel, bool readonly,
 #endif
 	state->checkstrategy = GetAccessStrategy(BAS_BULKREAD);
 
+	/* Create contexts for downlink bounds of two levels at a time */
+	if (state->readonly)
+	{
+		state->levelbounds.context =
+			AllocSetContextCreate(CurrentMemoryContext,
+								  "amcheck downlink bounds context",
+#if PG_VERSION_NUM >= 110000
+								  ALLOCSET_DEFAULT_SIZES);
+#else
+								  ALLOCSET_DEFAULT_MINSIZE,
+								  ALLOCSET_DEFAULT_INITSIZE,
+								  ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+		state->childbounds.context =
+			AllocSetContextCreate(CurrentMemoryContext,
+								  "amcheck downlink bounds context",
+#if PG_VERSION_NUM >= 110000
+								  ALLOCSET_DEFAULT_SIZES);
+#else
+								  ALLOCSET_DEFAULT_MINSIZE,
+								  ALLOCSET_DEFAULT_INITSIZE,
+								  ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+	}
+
+	/*
+	 * Create cache of internal pages, which are read more than once by the
+	 * downlink checks.  Cached pages could go stale in !readonly case.
+	 */
+	if (state->readonly)
+		bt_page_cache_create(state);
+
+	/* Create context for batches of heap tuples to probe */
+	if (state->heapallindexed)
+		state->probecontext = AllocSetContextCreate(CurrentMemoryContext,
+													"amcheck probe context",
+#if PG_VERSION_NUM >= 110000
+													ALLOCSET_DEFAULT_SIZES);
+#else
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+
 	/* Get true root block from meta-page */
 	metapage = palloc_btree_page(state, BTREE_METAPAGE);
 	metad = BTPageGetMeta(metapage);
@@ -458,6 +1104,17 @@ bt_check_every_level(Relation rel, Relation heaprel, bool readonly,
 		 */
 		state->rightsplit = false;
 
+		/*
+		 * Remember where leaf level begins, for later passes, and create
+		 * Bloom filter now that leaf level's size is known
+		 */
+		if (current.level == 0)
+		{
+			leftmostleaf = current.leftmost;
+			if (state->heapallindexed && !state->exact)
+				bt_leaf_filter_create(state, leftmostleaf, exported != NULL);
+		}
+
 		/*
 		 * Verify this level, and get left most page for next level down, if
 		 * not at leaf level
@@ -473,123 +1130,950 @@ bt_check_every_level(Relation rel, Relation heaprel, bool readonly,
 		previouslevel = current.level;
 	}
 
+	/* Totally empty index never reaches leaf level */
+	if (state->heapallindexed && !state->exact && !state->filter)
+		bt_leaf_filter_create(state, P_NONE, exported != NULL);
+
 	/*
 	 * * Check whether heap contains unindexed/malformed tuples *
 	 */
 	if (state->heapallindexed)
 	{
-		IndexInfo  *indexinfo = BuildIndexInfo(state->rel);
-
 		/* Report on extra downlink checks performed in readonly case */
 		if (state->readonly)
 		{
 			ereport(DEBUG1,
-					(errmsg_internal("finished verifying presence of downlink blocks within index \"%s\" with bitset %.2f%% set",
+					(errmsg_internal("finished verifying presence of " INT64_FORMAT " downlink blocks within index \"%s\" of %u blocks",
+									 state->downlinks,
 									 RelationGetRelationName(rel),
-									 100.0 * bloom_prop_bits_set(state->downlinkfilter))));
-			bloom_free(state->downlinkfilter);
+									 state->downlinkblocks)));
+			pfree(state->downlinkbitmap);
 		}
 
-		/*
-		 * Scan will behave as the first scan of a CREATE INDEX CONCURRENTLY
-		 * behaves in !readonly case.
-		 *
-		 * It's okay that we don't actually use the same lock strength for the
-		 * heap relation as any other ii_Concurrent caller would in !readonly
-		 * case.  We have no reason to care about a concurrent VACUUM
-		 * operation, since there isn't going to be a second scan of the heap
-		 * that needs to be sure that there was no concurrent recycling of
-		 * TIDs.
-		 */
-		indexinfo->ii_Concurrent = !state->readonly;
+		if (!state->exact)
+			bt_leaf_filter_check_ranges(state, leftmostleaf);
 
-		/*
-		 * Don't wait for uncommitted tuple xact commit/abort when index is a
-		 * unique index on a catalog (or an index used by an exclusion
-		 * constraint).  This could otherwise happen in the readonly case.
-		 */
-		indexinfo->ii_Unique = false;
-		indexinfo->ii_ExclusionOps = NULL;
-		indexinfo->ii_ExclusionProcs = NULL;
-		indexinfo->ii_ExclusionStrats = NULL;
+		if (exported)
+			*exported = bt_fingerprint_export(state);
+		else
+		{
+			/*
+			 * Build static filter from the tuples it buffered.  This only
+			 * fails when there were far more tuples than estimated, in which
+			 * case fingerprint the leaf level again with a Bloom filter.
+			 * The static filter's sample of heap blocks is gone by now, so
+			 * the Bloom filter isn't ranged.
+			 */
+			if (state->staticfilter && !bloom_freeze(state->filter))
+			{
+				elog(DEBUG1, "static filter for index \"%s\" exceeded maintenance_work_mem, falling back to Bloom filter",
+					 RelationGetRelationName(rel));
+				bloom_free(state->filter);
+				state->staticfilter = false;
+				state->filter = bt_leaf_filter_next(state, state->seed);
+				bt_fingerprint_leaf_level(state, leftmostleaf);
+			}
+
+			/*
+			 * Index walk fingerprinted the first partition.  Fingerprint each
+			 * later partition with another pass over the leaf level.
+			 */
+			for (;;)
+			{
+				bt_check_heap_present(state);
+				if (++state->partition >= state->npartitions)
+					break;
+
+				bloom_free(state->filter);
+				state->filter = bt_leaf_filter_next(state, random());
+				bt_fingerprint_leaf_level(state, leftmostleaf);
+				bt_leaf_filter_check_ranges(state, leftmostleaf);
+			}
+		}
+
+		if (!state->exact)
+			bloom_free(state->filter);
+		else
+			tuplesort_end(state->indexsort);
+		MemoryContextDelete(state->probecontext);
+	}
+
+	/* Be tidy: */
+	if (state->rightpage)
+		bt_release_page(state, state->rightpage);
+	state->rightpage = NULL;
+	bt_page_pool_reset(state);
+	pfree(state->pool.unaligned);
+	if (state->pagecache)
+	{
+		elog(DEBUG1, "internal page cache for index \"%s\" served " INT64_FORMAT " reads from %ld cached pages",
+			 RelationGetRelationName(rel), state->pagecachehits,
+			 hash_get_num_entries(state->pagecache));
+		hash_destroy(state->pagecache);
+		MemoryContextDelete(state->pagecachecontext);
+	}
+	MemoryContextDelete(state->targetcontext);
+}
 
-		elog(DEBUG1, "verifying that tuples from index \"%s\" are present in \"%s\"",
-			 RelationGetRelationName(state->rel),
-			 RelationGetRelationName(state->heaprel));
+/*
+ * Check whether heap contains unindexed/malformed tuples, by probing
+ * state's Bloom filter for each heap tuple that must have an index tuple.
+ */
+static void
+bt_check_heap_present(BtreeCheckState *state)
+{
+	IndexInfo  *indexinfo = BuildIndexInfo(state->rel);
+	bloom_filter_stats fstats;
+	double		fprate;
+
+	/*
+	 * Scan will behave as the first scan of a CREATE INDEX CONCURRENTLY
+	 * behaves in !readonly case.
+	 *
+	 * It's okay that we don't actually use the same lock strength for the
+	 * heap relation as any other ii_Concurrent caller would in !readonly
+	 * case.  We have no reason to care about a concurrent VACUUM
+	 * operation, since there isn't going to be a second scan of the heap
+	 * that needs to be sure that there was no concurrent recycling of
+	 * TIDs.
+	 */
+	indexinfo->ii_Concurrent = !state->readonly;
 
-		IndexBuildHeapScan(state->heaprel, state->rel, indexinfo, true,
+	/*
+	 * Don't wait for uncommitted tuple xact commit/abort when index is a
+	 * unique index on a catalog (or an index used by an exclusion
+	 * constraint).  This could otherwise happen in the readonly case.
+	 */
+	indexinfo->ii_Unique = false;
+	indexinfo->ii_ExclusionOps = NULL;
+	indexinfo->ii_ExclusionProcs = NULL;
+	indexinfo->ii_ExclusionStrats = NULL;
+
+	elog(DEBUG1, "verifying that tuples from index \"%s\" are present in \"%s\"",
+		 RelationGetRelationName(state->rel),
+		 RelationGetRelationName(state->heaprel));
+
+	/* Count only this pass's tuples, which caller's statistics accumulate */
+	state->heaptuplespresent = 0;
+	if (state->exact)
+		state->heapsort = bt_tuplesort_begin(state,
+											 state->heapallindexedmem / 2);
+	state->lastprefetch = 0;
+	state->nextprefetch = 0;
+
+	IndexBuildHeapScan(state->heaprel, state->rel, indexinfo, true,
 #if PG_VERSION_NUM >= 110000
-						   bt_tuple_present_callback, (void *) state, NULL);
+					   bt_tuple_present_callback, (void *) state, NULL);
 #else
-						   bt_tuple_present_callback, (void *) state);
+					   bt_tuple_present_callback, (void *) state);
 #endif
 
+	if (state->exact)
+	{
+		bt_tuple_present_merge(state);
+		tuplesort_end(state->heapsort);
+
+		ereport(DEBUG1,
+				(errmsg_internal("finished verifying presence of " INT64_FORMAT " tuples from table \"%s\" by merging sorted tuples",
+								 state->heaptuplespresent, RelationGetRelationName(state->heaprel))));
+		return;
+	}
+
+	/* Probe for any heap tuples from final, partial batch */
+	bt_tuple_present_flush(state);
+
+	bloom_stats(state->filter, &fstats);
+	fprate = fstats.false_positive_rate;
+	if (fstats.fingerprint_bits > 0)
+		ereport(DEBUG1,
+				(errmsg_internal("finished verifying presence of " INT64_FORMAT " tuples from table \"%s\" with %d-bit fingerprints and false positive rate %.4f%%",
+								 state->heaptuplespresent, RelationGetRelationName(state->heaprel),
+								 fstats.fingerprint_bits, 100.0 * fprate)));
+	else
 		ereport(DEBUG1,
-				(errmsg_internal("finished verifying presence of " INT64_FORMAT " tuples from table \"%s\" with bitset %.2f%% set",
-								 state->heaptuplespresent, RelationGetRelationName(heaprel),
-								 100.0 * bloom_prop_bits_set(state->filter))));
+				(errmsg_internal("finished verifying presence of " INT64_FORMAT " tuples from table \"%s\" with bitset %.2f%% set and estimated false positive rate %.4f%%",
+								 state->heaptuplespresent, RelationGetRelationName(state->heaprel),
+								 100.0 * fstats.bits_set / fstats.bits,
+								 100.0 * fprate)));
 
-		bloom_free(state->filter);
+	if (state->stats)
+	{
+		state->stats->heaptuples += state->heaptuplespresent;
+		state->stats->passes++;
+		state->stats->filter.bits += fstats.bits;
+		state->stats->filter.bits_set += fstats.bits_set;
+		state->stats->filter.fingerprint_bits =
+			Max(state->stats->filter.fingerprint_bits, fstats.fingerprint_bits);
+		state->stats->filter.elements += fstats.elements;
+		state->stats->filter.false_positive_rate =
+			Max(state->stats->filter.false_positive_rate, fprate);
 	}
 
-	/* Be tidy: */
-	MemoryContextDelete(state->targetcontext);
+	/*
+	 * The filter only stops growing when it runs out of memory.  Let the user
+	 * know when that made verification much less thorough than usual.
+	 */
+	if (fprate > BT_MAX_FALSE_POSITIVE_RATE)
+		ereport(WARNING,
+				(errmsg("verification that tuples from index \"%s\" are present in \"%s\" had an estimated false positive rate of %.2f%%",
+						RelationGetRelationName(state->rel),
+						RelationGetRelationName(state->heaprel),
+						100.0 * fprate),
+				 errdetail("Each missing index tuple had a %.2f%% chance of going undetected.",
+						   100.0 * fprate),
+				 errhint("Increase maintenance_work_mem.")));
 }
 
 /*
- * Given a left-most block at some level, move right, verifying each page
- * individually (with more verification across pages for "readonly"
- * callers).  Caller should pass the true root page as the leftmost initially,
- * working their way down by passing what is returned for the last call here
- * until level 0 (leaf page level) was reached.
- *
- * Returns state for next call, if any.  This includes left-most block number
- * one level lower that should be passed on next level/call, which is set to
- * P_NONE on last call here (when leaf level is verified).  Level numbers
- * follow the nbtree convention: higher levels have higher numbers, because new
- * levels are added only due to a root page split.  Note that prior to the
- * first root page split, the root is also a leaf page, so there is always a
- * level 0 (leaf level), and it's always the last level processed.
+ * Probe heap using fingerprint exported by an earlier bt_index_fingerprint()
+ * call for the same index.
  *
- * Note on memory management:  State's per-page context is reset here, between
- * each call to bt_target_page_check().
+ * This is equivalent to the heap phase of a !readonly heapallindexed
+ * verification.  Caller must hold AccessShareLock on heap & index.
  */
-static BtreeLevel
-bt_check_level_from_leftmost(BtreeCheckState *state, BtreeLevel level)
+static void
+bt_probe_fingerprint(Relation rel, Relation heaprel, bytea *fingerprint)
 {
-	/* State to establish early, concerning entire level */
-	BTPageOpaque opaque;
-	MemoryContext oldcontext;
-	BtreeLevel	nextleveldown;
+	BtreeCheckState *state;
 
-	/* Variables for iterating across level using right links */
-	BlockNumber leftcurrent = P_NONE;
-	BlockNumber current = level.leftmost;
+	state = palloc0(sizeof(BtreeCheckState));
+	state->rel = rel;
+	state->heaprel = heaprel;
+	state->readonly = false;
+	state->heapallindexed = true;
+	state->filter = bt_fingerprint_import(state, fingerprint);
+	state->imported = true;
+	state->npartitions = 1;
+
+	/* Create context for batches of heap tuples to probe */
+	state->probecontext = AllocSetContextCreate(CurrentMemoryContext,
+												"amcheck probe context",
+#if PG_VERSION_NUM >= 110000
+												ALLOCSET_DEFAULT_SIZES);
+#else
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+#endif
 
-	/* Initialize return state */
-	nextleveldown.leftmost = InvalidBlockNumber;
-	nextleveldown.level = InvalidBtreeLevel;
-	nextleveldown.istruerootlevel = false;
+	bt_check_heap_present(state);
 
-	/* Use page-level context for duration of this call */
-	oldcontext = MemoryContextSwitchTo(state->targetcontext);
+	bloom_free(state->filter);
+	MemoryContextDelete(state->probecontext);
+}
+
+/*
+ * Verify B-Tree index by reading every block in block number order, rather
+ * than walking each level from its leftmost page through right links.  On an
+ * index with many page splits behind it, a level walk reads blocks in close
+ * to random order, whereas this reads the index sequentially.
+ *
+ * Each live page gets the same checks from palloc_btree_page() and
+ * bt_target_page_check() that a level walk performs, other than those that
+ * read another page.  Checks that span pages are performed in memory
+ * instead:  sibling links must agree, siblings must be on the same level, and
+ * the last item on each page must not exceed the first item on its right
+ * sibling.  Downlinks must point to live pages one level down.  Every level
+ * must have exactly one leftmost and one rightmost page, and every live leaf
+ * page must have a downlink, which together rule out circular link chains.
+ * Internal pages that lack a downlink are checked once the scan is done, by
+ * descending from them.  Downlink key bounds are not checked.
+ *
+ * Memory used is 2 bytes per block, plus one entry (and up to two index
+ * tuples) for each sibling link read that points ahead of the scan, and has
+ * yet to be matched.
+ *
+ * When directio is passed, blocks that aren't in shared_buffers are read
+ * straight from the index's segment files, in large reads that bypass the
+ * kernel's page cache where O_DIRECT is available.  See bt_direct_read().
+ * The number of blocks read each way is returned in *stats.
+ *
+ * Caller must hold ShareLock on heap & index, since there can be no
+ * concurrent page splits or page deletions.
+ */
+static void
+bt_check_physical(Relation rel, Relation heaprel, bool directio,
+				  BtreeCheckStats *stats)
+{
+	BtreeCheckState *state;
+	Page		metapage;
+	BTMetaPageData meta;
+	BTMetaPageData *metad = &meta;
+	BlockNumber nblocks;
+	BlockNumber blkno;
+	uint32		level;
+	int64	   *leftmost;
+	int64	   *rightmost;
+	int64		expected;
+	HASHCTL		hctl;
+	MemoryContext oldcontext;
+
+	/*
+	 * Initialize state for entire verification operation
+	 */
+	state = palloc0(sizeof(BtreeCheckState));
+	state->rel = rel;
+	state->heaprel = heaprel;
+	state->readonly = true;
+	state->physical = true;
+	bt_page_pool_init(state);
+
+	/* Create context for page */
+	state->targetcontext = AllocSetContextCreate(CurrentMemoryContext,
+												 "amcheck context",
+#if PG_VERSION_NUM >= 110000
+												 ALLOCSET_DEFAULT_SIZES);
+#else
+												 ALLOCSET_DEFAULT_MINSIZE,
+												 ALLOCSET_DEFAULT_INITSIZE,
+												 ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+	state->checkstrategy = GetAccessStrategy(BAS_BULKREAD);
+
+	/* Create map of sibling links yet to be matched, and its own context */
+	state->linkscontext = AllocSetContextCreate(CurrentMemoryContext,
+												"amcheck sibling links context",
+#if PG_VERSION_NUM >= 110000
+												ALLOCSET_DEFAULT_SIZES);
+#else
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+	memset(&hctl, 0, sizeof(hctl));
+	hctl.keysize = sizeof(BlockNumber);
+	hctl.entrysize = sizeof(BtreeSiblingLinks);
+	hctl.hash = tag_hash;
+	hctl.hcxt = state->linkscontext;
+	state->links = hash_create("amcheck sibling links", 1024, &hctl,
+							   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	/* Meta page is needed throughout, unlike any page held in pool */
+	metapage = palloc_btree_page(state, BTREE_METAPAGE);
+	memcpy(&meta, BTPageGetMeta(metapage), sizeof(BTMetaPageData));
+	bt_release_page(state, metapage);
+
+	if (metad->btm_level > BT_BLOCK_LEVEL_MASK)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("index \"%s\" has too many levels for physical-order verification",
+						RelationGetRelationName(rel)),
+				 errdetail_internal("Root level=%u.", metad->btm_level)));
+
+	leftmost = palloc0((metad->btm_level + 1) * sizeof(int64));
+	rightmost = palloc0((metad->btm_level + 1) * sizeof(int64));
+
+	/* Index can't grow while we hold our lock */
+	nblocks = RelationGetNumberOfBlocks(rel);
+
+	/* Temporary relations' blocks may only be in backend-local buffers */
+	if (directio && !RelationUsesLocalBuffers(rel))
+	{
+		BtreeDirectRead *direct = &state->directread;
+
+		state->directio = true;
+		direct->fd = -1;
+		direct->nblocks = nblocks;
+		direct->unaligned = palloc(BLCKSZ * (BT_DIRECT_READ_BLOCKS + 1));
+		direct->window = (char *) TYPEALIGN(BLCKSZ, direct->unaligned);
+	}
+	state->blockstates = MemoryContextAllocHuge(CurrentMemoryContext,
+												nblocks * sizeof(uint16));
+	memset(state->blockstates, 0, nblocks * sizeof(uint16));
+
+	if (metad->btm_root != P_NONE)
+	{
+		if (metad->btm_root >= nblocks)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("meta page root block %u is past end of index \"%s\"",
+							metad->btm_root, RelationGetRelationName(rel)),
+					 errdetail_internal("Number of blocks=%u.", nblocks)));
+
+		/* No next level up with downlinks from the true root */
+		state->blockstates[metad->btm_root] |= BT_BLOCK_NODOWNLINK_OK;
+	}
+
+	elog(DEBUG2, "verifying %u blocks in block number order", nblocks);
+
+	/* Use page-level context for duration of scan */
+	oldcontext = MemoryContextSwitchTo(state->targetcontext);
+
+	for (blkno = BTREE_METAPAGE + 1; blkno < nblocks; blkno++)
+	{
+		BTPageOpaque opaque;
+		uint16	   *blockstate = &state->blockstates[blkno];
+
+		CHECK_FOR_INTERRUPTS();
+
+		/*
+		 * Keep up to target_prefetch_pages blocks ahead of scan in flight,
+		 * unless bypassing shared_buffers
+		 */
+		if (target_prefetch_pages > 0 && !state->directio &&
+			blkno + target_prefetch_pages < nblocks)
+			PrefetchBuffer(rel, MAIN_FORKNUM, blkno + target_prefetch_pages);
+
+		state->targetblock = blkno;
+		state->target = palloc_btree_page(state, blkno);
+
+		/*
+		 * New and deleted pages have no links within other pages, and
+		 * deleted pages have no sane level field, so there is nothing more
+		 * to check.  See bt_child_bounds_check() for further details.
+		 */
+		if (state->target == NULL ||
+			P_ISDELETED((BTPageOpaque) PageGetSpecialPointer(state->target)))
+		{
+			if ((*blockstate & BT_BLOCK_DOWNLINK) ||
+				hash_search(state->links, &blkno, HASH_FIND, NULL))
+				ereport(ERROR,
+						(errcode(ERRCODE_INDEX_CORRUPTED),
+						 errmsg("downlink or sibling link points to deleted block in index \"%s\"",
+								RelationGetRelationName(rel)),
+						 errdetail_internal("Block=%u is %s.", blkno,
+											state->target ? "deleted" : "new")));
+
+			*blockstate |= BT_BLOCK_UNUSED;
+			bt_page_pool_reset(state);
+			MemoryContextReset(state->targetcontext);
+			continue;
+		}
+
+		state->targetlsn = PageGetLSN(state->target);
+		opaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
+		level = opaque->btpo.level;
+
+		if (level > metad->btm_level)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("block %u is above root level in index \"%s\"",
+							blkno, RelationGetRelationName(rel)),
+					 errdetail_internal("Block level=%u root level=%u.",
+										level, metad->btm_level)));
+
+		if (blkno == metad->btm_root &&
+			(!P_ISROOT(opaque) || level != metad->btm_level))
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("block %u is not true root in index \"%s\"",
+							blkno, RelationGetRelationName(rel))));
+
+		if (blkno != metad->btm_root && P_ISROOT(opaque))
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("block %u is marked root, but meta page root is block %u in index \"%s\"",
+							blkno, metad->btm_root,
+							RelationGetRelationName(rel))));
+
+		/* Check level against that implied by downlink read earlier, if any */
+		if ((*blockstate & BT_BLOCK_DOWNLINK) &&
+			(*blockstate & BT_BLOCK_LEVEL_MASK) != level)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("downlink points to block in index \"%s\" whose level is not one level down",
+							RelationGetRelationName(rel)),
+					 errdetail_internal("Block pointed to=%u expected level=%u level in pointed to block=%u.",
+										blkno,
+										*blockstate & BT_BLOCK_LEVEL_MASK,
+										level)));
+
+		*blockstate = (*blockstate & ~BT_BLOCK_LEVEL_MASK) | BT_BLOCK_READ |
+			level;
+
+		/* Half-dead leaf page's downlink was removed by first phase */
+		if (P_ISHALFDEAD(opaque))
+			*blockstate |= BT_BLOCK_NODOWNLINK_OK;
+
+		bt_physical_page_links(state, level, nblocks, leftmost, rightmost);
+
+		/* Verify invariants for page, and record levels of its children */
+		if (!P_IGNORE(opaque))
+		{
+			bt_target_page_check(state);
+			if (!P_ISLEAF(opaque))
+				bt_physical_downlinks(state, nblocks);
+		}
+
+		/* Free page and associated memory for this iteration */
+		bt_page_pool_reset(state);
+		MemoryContextReset(state->targetcontext);
+	}
+
+	/* Don't change context for caller */
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Scan read every block after the meta page once, one way or the other */
+	stats->directblocks = state->directio ? state->directread.direct : 0;
+	stats->bufferedblocks = (int64) nblocks - 1 - stats->directblocks;
+
+	/*
+	 * Every sibling link that was recorded points to a block that was since
+	 * read, which matched it
+	 */
+	Assert(hash_get_num_entries(state->links) == 0);
+
+	/* Every level of a tree has one leftmost and one rightmost page */
+	expected = metad->btm_root != P_NONE ? 1 : 0;
+	for (level = 0; level <= metad->btm_level; level++)
+	{
+		if (leftmost[level] != expected || rightmost[level] != expected)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("level %u of index \"%s\" does not have exactly one leftmost and one rightmost page",
+							level, RelationGetRelationName(rel)),
+					 errdetail_internal("Leftmost pages=" INT64_FORMAT " rightmost pages=" INT64_FORMAT ".",
+										leftmost[level], rightmost[level])));
+	}
+
+	/*
+	 * Check that every live page has a downlink, other than the true root,
+	 * half-dead leaf pages, and right halves of incomplete page splits.  An
+	 * internal page may also lack one following an interrupted multi-level
+	 * page deletion, which is told apart from corruption by descending from
+	 * the page to its leftmost leaf page, just as a level walk does.  See
+	 * bt_downlink_missing_check().
+	 */
+	for (blkno = BTREE_METAPAGE + 1; blkno < nblocks; blkno++)
+	{
+		uint16		blockstate = state->blockstates[blkno];
+
+		if ((blockstate & (BT_BLOCK_READ | BT_BLOCK_DOWNLINK |
+						   BT_BLOCK_NODOWNLINK_OK)) != BT_BLOCK_READ)
+			continue;
+
+		if ((blockstate & BT_BLOCK_LEVEL_MASK) == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("leaf index block lacks downlink in index \"%s\"",
+							RelationGetRelationName(rel)),
+					 errdetail_internal("Block=%u.", blkno)));
+
+		oldcontext = MemoryContextSwitchTo(state->targetcontext);
+		state->targetblock = blkno;
+		state->target = palloc_btree_page(state, blkno);
+		state->targetlsn = PageGetLSN(state->target);
+		bt_downlink_missing_descend(state);
+		bt_page_pool_reset(state);
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(state->targetcontext);
+	}
+
+	if (state->directio)
+	{
+		BtreeDirectRead *direct = &state->directread;
+
+		if (direct->fd >= 0)
+			CloseTransientFile(direct->fd);
+		if (direct->path)
+			pfree(direct->path);
+		pfree(direct->unaligned);
+	}
+
+	/* Be tidy: */
+	hash_destroy(state->links);
+	MemoryContextDelete(state->linkscontext);
+	pfree(state->blockstates);
+	pfree(state->pool.unaligned);
+	MemoryContextDelete(state->targetcontext);
+}
+
+/*
+ * Match target's sibling links against its siblings' links, for
+ * physical-order verification.
+ *
+ * Whichever of two siblings is read first records its link to the other,
+ * along with a copy of the item that the other sibling's items are to be
+ * compared against:  the last item of the left sibling, or the first data
+ * item of the right sibling.  When the other sibling is read, its own link
+ * must point back, it must be on the same level, and the items at the two
+ * pages' shared boundary must be in order.  As in a level walk, items on
+ * ignorable (half-dead) pages aren't compared.
+ *
+ * Also counts leftmost and rightmost pages on target's level.
+ */
+static void
+bt_physical_page_links(BtreeCheckState *state, uint32 level,
+					   BlockNumber nblocks, int64 *leftmost, int64 *rightmost)
+{
+	BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
+	BlockNumber current = state->targetblock;
+	BlockNumber prev = opaque->btpo_prev;
+	BlockNumber next = opaque->btpo_next;
+	BlockNumber leftblock = InvalidBlockNumber;
+	BlockNumber rightblock = InvalidBlockNumber;
+	BtreeSiblingLinks *links;
+	BtreeSiblingLinks *sibling;
+	OffsetNumber offset;
+	IndexTuple	itup;
+	MemoryContext oldcontext;
+	ScanKey		skey;
+	bool		found;
+
+	/* Try to detect circular links */
+	if (prev == current || next == current ||
+		(prev == next && prev != P_NONE))
+		ereport(ERROR,
+				(errcode(ERRCODE_INDEX_CORRUPTED),
+				 errmsg("circular link chain found in block %u of index \"%s\"",
+						current, RelationGetRelationName(state->rel))));
+
+	if (prev >= nblocks || next >= nblocks)
+		ereport(ERROR,
+				(errcode(ERRCODE_INDEX_CORRUPTED),
+				 errmsg("sibling link in block %u points past end of index \"%s\"",
+						current, RelationGetRelationName(state->rel)),
+				 errdetail_internal("Left link=%u right link=%u number of blocks=%u.",
+									prev, next, nblocks)));
+
+	/* Right half of incomplete split is yet to get a downlink */
+	if (P_INCOMPLETE_SPLIT(opaque) && next != P_NONE)
+		state->blockstates[next] |= BT_BLOCK_NODOWNLINK_OK;
+
+	links = hash_search(state->links, &current, HASH_FIND, NULL);
+	if (links)
+	{
+		leftblock = links->leftblock;
+		rightblock = links->rightblock;
+	}
+
+	/*
+	 * Sibling read earlier must have had a link to target, and target's link
+	 * must point back.  No other block read so far may link to target.  A
+	 * deleted sibling never records links, and so can't match.
+	 */
+	if (leftblock != (prev != P_NONE && prev < current ?
+					  prev : InvalidBlockNumber))
+		ereport(ERROR,
+				(errcode(ERRCODE_INDEX_CORRUPTED),
+				 errmsg("left link/right link pair in index \"%s\" not in agreement",
+						RelationGetRelationName(state->rel)),
+				 errdetail_internal("Block=%u left block=%u left link from block=%u.",
+									current, leftblock, prev)));
+	if (rightblock != (next != P_NONE && next < current ?
+					   next : InvalidBlockNumber))
+		ereport(ERROR,
+				(errcode(ERRCODE_INDEX_CORRUPTED),
+				 errmsg("left link/right link pair in index \"%s\" not in agreement",
+						RelationGetRelationName(state->rel)),
+				 errdetail_internal("Block=%u right block=%u right link from block=%u.",
+									current, rightblock, next)));
+
+	if (prev == P_NONE)
+		leftmost[level]++;
+	else if (prev < current)
+	{
+		if ((state->blockstates[prev] & BT_BLOCK_LEVEL_MASK) != level)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("left sibling of block %u in index \"%s\" is on a different level",
+							current, RelationGetRelationName(state->rel)),
+					 errdetail_internal("Block=%u level=%u left block=%u left block level=%u.",
+										current, level, prev,
+										state->blockstates[prev] &
+										BT_BLOCK_LEVEL_MASK)));
+
+		/* Left sibling's last item must not exceed target's first item */
+		offset = bt_physical_edge_offset(state, true);
+		if (links->leftlast && offset != InvalidOffsetNumber)
+		{
+			skey = _bt_mkscankey(state->rel, links->leftlast);
+			if (!invariant_leq_offset(state, skey, offset))
+				ereport(ERROR,
+						(errcode(ERRCODE_INDEX_CORRUPTED),
+						 errmsg("cross page item order invariant violated for index \"%s\"",
+								RelationGetRelationName(state->rel)),
+						 errdetail_internal("Last item on left block=%u first item on page tid=(%u,%u) page lsn=%X/%X.",
+											prev, current, offset,
+											(uint32) (state->targetlsn >> 32),
+											(uint32) state->targetlsn)));
+		}
+	}
+	else
+	{
+		/* Record left link, for left sibling to match once read */
+		sibling = hash_search(state->links, &prev, HASH_ENTER, &found);
+		if (!found)
+		{
+			sibling->leftblock = InvalidBlockNumber;
+			sibling->leftlast = NULL;
+		}
+		else if (sibling->rightblock != InvalidBlockNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("left link/right link pair in index \"%s\" not in agreement",
+							RelationGetRelationName(state->rel)),
+					 errdetail_internal("Blocks %u and %u both have left link to block %u.",
+										sibling->rightblock, current, prev)));
+		sibling->rightblock = current;
+		sibling->rightfirst = NULL;
+		offset = bt_physical_edge_offset(state, true);
+		if (offset != InvalidOffsetNumber)
+		{
+			itup = (IndexTuple) PageGetItem(state->target,
+											PageGetItemId(state->target,
+														  offset));
+			oldcontext = MemoryContextSwitchTo(state->linkscontext);
+			sibling->rightfirst = CopyIndexTuple(itup);
+			MemoryContextSwitchTo(oldcontext);
+		}
+	}
+
+	if (next == P_NONE)
+		rightmost[level]++;
+	else if (next < current)
+	{
+		if ((state->blockstates[next] & BT_BLOCK_LEVEL_MASK) != level)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("right sibling of block %u in index \"%s\" is on a different level",
+							current, RelationGetRelationName(state->rel)),
+					 errdetail_internal("Block=%u level=%u right block=%u right block level=%u.",
+										current, level, next,
+										state->blockstates[next] &
+										BT_BLOCK_LEVEL_MASK)));
+
+		/* Target's last item must not exceed right sibling's first item */
+		offset = bt_physical_edge_offset(state, false);
+		if (links->rightfirst && offset != InvalidOffsetNumber)
+		{
+			skey = _bt_mkscankey(state->rel, links->rightfirst);
+			if (!invariant_geq_offset(state, skey, offset))
+				ereport(ERROR,
+						(errcode(ERRCODE_INDEX_CORRUPTED),
+						 errmsg("cross page item order invariant violated for index \"%s\"",
+								RelationGetRelationName(state->rel)),
+						 errdetail_internal("Last item on page tid=(%u,%u) page lsn=%X/%X.",
+											current, offset,
+											(uint32) (state->targetlsn >> 32),
+											(uint32) state->targetlsn)));
+		}
+	}
+	else
+	{
+		/* Record right link, for right sibling to match once read */
+		sibling = hash_search(state->links, &next, HASH_ENTER, &found);
+		if (!found)
+		{
+			sibling->rightblock = InvalidBlockNumber;
+			sibling->rightfirst = NULL;
+		}
+		else if (sibling->leftblock != InvalidBlockNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("left link/right link pair in index \"%s\" not in agreement",
+							RelationGetRelationName(state->rel)),
+					 errdetail_internal("Blocks %u and %u both have right link to block %u.",
+										sibling->leftblock, current, next)));
+		sibling->leftblock = current;
+		sibling->leftlast = NULL;
+		offset = bt_physical_edge_offset(state, false);
+		if (offset != InvalidOffsetNumber)
+		{
+			itup = (IndexTuple) PageGetItem(state->target,
+											PageGetItemId(state->target,
+														  offset));
+			oldcontext = MemoryContextSwitchTo(state->linkscontext);
+			sibling->leftlast = CopyIndexTuple(itup);
+			MemoryContextSwitchTo(oldcontext);
+		}
+	}
+
+	/* Target's entry, if any, is now fully matched */
+	if (links)
+	{
+		if (links->leftlast)
+			pfree(links->leftlast);
+		if (links->rightfirst)
+			pfree(links->rightfirst);
+		hash_search(state->links, &current, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Check the level of each child page that target's downlinks point to, for
+ * physical-order verification.  Children read earlier must be live pages one
+ * level down.  Children yet to be read are expected to be one level down when
+ * they are.
+ */
+static void
+bt_physical_downlinks(BtreeCheckState *state, BlockNumber nblocks)
+{
+	BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
+	uint32		childlevel = opaque->btpo.level - 1;
+	OffsetNumber offset;
+	OffsetNumber max;
+
+	Assert(!P_ISLEAF(opaque));
+
+	max = PageGetMaxOffsetNumber(state->target);
+	for (offset = P_FIRSTDATAKEY(opaque);
+		 offset <= max;
+		 offset = OffsetNumberNext(offset))
+	{
+		ItemId		itemid = PageGetItemId(state->target, offset);
+		IndexTuple	itup = (IndexTuple) PageGetItem(state->target, itemid);
+		BlockNumber childblock = ItemPointerGetBlockNumber(&(itup->t_tid));
+		uint16	   *childstate;
+
+		if (childblock == BTREE_METAPAGE || childblock >= nblocks)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("downlink to block %u in index \"%s\" is out of range",
+							childblock, RelationGetRelationName(state->rel)),
+					 errdetail_internal("Index tid=(%u,%u) number of blocks=%u.",
+										state->targetblock, offset, nblocks)));
+
+		childstate = &state->blockstates[childblock];
+		if (*childstate & BT_BLOCK_UNUSED)
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("downlink or sibling link points to deleted block in index \"%s\"",
+							RelationGetRelationName(state->rel)),
+					 errdetail_internal("Block=%u downlink from block=%u.",
+										childblock, state->targetblock)));
+
+		if (*childstate & (BT_BLOCK_READ | BT_BLOCK_DOWNLINK))
+		{
+			if ((*childstate & BT_BLOCK_LEVEL_MASK) != childlevel)
+				ereport(ERROR,
+						(errcode(ERRCODE_INDEX_CORRUPTED),
+						 errmsg("downlink points to block in index \"%s\" whose level is not one level down",
+								RelationGetRelationName(state->rel)),
+						 errdetail_internal("Block pointed to=%u expected level=%u level in pointed to block=%u.",
+											childblock, childlevel,
+											*childstate & BT_BLOCK_LEVEL_MASK)));
+		}
+		else
+			*childstate |= childlevel;
+
+		*childstate |= BT_BLOCK_DOWNLINK;
+	}
+}
+
+/*
+ * Return offset of target's first data item (after any "negative infinity"
+ * item), or of its last item, for comparison against a sibling's items.
+ * Returns InvalidOffsetNumber if there is no such item, or if target is
+ * ignorable.
+ */
+static OffsetNumber
+bt_physical_edge_offset(BtreeCheckState *state, bool first)
+{
+	BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
+	OffsetNumber max = PageGetMaxOffsetNumber(state->target);
+	OffsetNumber offset;
+
+	if (P_IGNORE(opaque))
+		return InvalidOffsetNumber;
+
+	if (first)
+	{
+		offset = P_FIRSTDATAKEY(opaque);
+		if (!P_ISLEAF(opaque))
+			offset = OffsetNumberNext(offset);
+	}
+	else
+		offset = max;
+
+	if (offset > max || offset < P_FIRSTDATAKEY(opaque) ||
+		offset_is_negative_infinity(opaque, offset))
+		return InvalidOffsetNumber;
+
+	return offset;
+}
+
+/*
+ * Given a left-most block at some level, move right, verifying each page
+ * individually (with more verification across pages for "readonly"
+ * callers).  Caller should pass the true root page as the leftmost initially,
+ * working their way down by passing what is returned for the last call here
+ * until level 0 (leaf page level) was reached.
+ *
+ * Returns state for next call, if any.  This includes left-most block number
+ * one level lower that should be passed on next level/call, which is set to
+ * P_NONE on last call here (when leaf level is verified).  Level numbers
+ * follow the nbtree convention: higher levels have higher numbers, because new
+ * levels are added only due to a root page split.  Note that prior to the
+ * first root page split, the root is also a leaf page, so there is always a
+ * level 0 (leaf level), and it's always the last level processed.
+ *
+ * Note on memory management:  State's per-page context is reset here, between
+ * each call to bt_target_page_check().
+ */
+static BtreeLevel
+bt_check_level_from_leftmost(BtreeCheckState *state, BtreeLevel level)
+{
+	/* State to establish early, concerning entire level */
+	BTPageOpaque opaque;
+	MemoryContext oldcontext;
+	BtreeLevel	nextleveldown;
+	Page		carried;
+
+	/* Variables for iterating across level using right links */
+	BlockNumber leftcurrent = P_NONE;
+	BlockNumber current = level.leftmost;
+
+	/* Initialize return state */
+	nextleveldown.leftmost = InvalidBlockNumber;
+	nextleveldown.level = InvalidBtreeLevel;
+	nextleveldown.istruerootlevel = false;
+
+	/* Use page-level context for duration of this call */
+	oldcontext = MemoryContextSwitchTo(state->targetcontext);
 
 	elog(DEBUG2, "verifying level %u%s", level.level,
 		 level.istruerootlevel ?
 		 " (true root level)" : level.level == 0 ? " (leaf level)" : "");
 
+	/* Bounds and blocks recorded by walk of level above apply to this level */
+	if (state->readonly)
+		bt_bounds_next_level(state);
+	bt_prefetch_next_level(state);
+
 	do
 	{
 		/* Don't rely on CHECK_FOR_INTERRUPTS() calls at lower level */
 		CHECK_FOR_INTERRUPTS();
 
-		/* Initialize state for this iteration */
+		/*
+		 * Initialize state for this iteration.  Reuse copy of page made when
+		 * it was last target's right sibling, if any, rather than reading it
+		 * again.  It's no less current than any page copy made by the walk.
+		 */
 		state->targetblock = current;
-		state->target = palloc_btree_page(state, state->targetblock);
+		bt_prefetch_level(state, current);
+		carried = NULL;
+		if (state->rightpage)
+		{
+			if (state->rightblock == current)
+				carried = state->rightpage;
+			else
+				bt_release_page(state, state->rightpage);
+			state->rightpage = NULL;
+		}
+		if (carried)
+			state->target = carried;
+		else
+			state->target = palloc_btree_page(state, state->targetblock);
 		state->targetlsn = PageGetLSN(state->target);
 
 		opaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
 
+		/*
+		 * Check page against bounds from its downlink, if any, before
+		 * anything else, since a page with a downlink shouldn't be deleted
+		 */
+		if (state->readonly)
+		{
+			BtreeBoundsList *list = &state->levelbounds;
+
+			if (list->next < list->nbounds &&
+				list->bounds[list->next].childblock == current)
+				bt_child_bounds_check(state, &list->bounds[list->next++],
+									  state->target);
+		}
+
 		if (P_IGNORE(opaque))
 		{
 			/*
@@ -597,11 +2081,11 @@ bt_check_level_from_leftmost(BtreeCheckState *state, BtreeLevel level)
 			 * mode, and since a page has no links within other pages (siblings
 			 * and parent) once it is marked fully deleted, it should be
 			 * impossible to land on a fully deleted page in readonly mode.
-			 * See bt_downlink_check() for further details.
+			 * See bt_child_bounds_check() for further details.
 			 *
-			 * The bt_downlink_check() P_ISDELETED() check is repeated here so
-			 * that pages that are only reachable through sibling links get
-			 * checked.
+			 * The bt_child_bounds_check() P_ISDELETED() check is repeated
+			 * here so that pages that are only reachable through sibling
+			 * links get checked.
 			 */
 			if (state->readonly && P_ISDELETED(opaque))
 				ereport(ERROR,
@@ -707,6 +2191,10 @@ bt_check_level_from_leftmost(BtreeCheckState *state, BtreeLevel level)
 					 errdetail_internal("Block pointed to=%u expected level=%u level in pointed to block=%u.",
 										current, level.level, opaque->btpo.level)));
 
+		/* Sample downlinks to leaf level, for sizing Bloom filter */
+		if (level.level == 1 && state->heapallindexed && !state->exact)
+			bt_leaf_sample(state);
+
 		/* Verify invariants for page */
 		bt_target_page_check(state);
 
@@ -730,16 +2218,258 @@ nextpage:
 		current = opaque->btpo_next;
 
 		/* Free page and associated memory for this iteration */
+		if (carried)
+			bt_release_page(state, carried);
+		bt_page_pool_reset(state);
 		MemoryContextReset(state->targetcontext);
 	}
 	while (current != P_NONE);
 
+	if (state->readonly)
+		bt_bounds_finish_level(state);
+
 	/* Don't change context for caller */
 	MemoryContextSwitchTo(oldcontext);
 
 	return nextleveldown;
 }
 
+/*
+ * Count the downlinks on level 1 target page, each of which points to a leaf
+ * page, and add some of them to state's sample of leaf pages.
+ *
+ * The sample takes every leafstride-th leaf page in key space order.  When it
+ * fills up, every other sampled page is discarded, and the stride doubles, so
+ * that the sample is spread evenly across the whole leaf level no matter how
+ * many leaf pages there turn out to be.  Concurrent page splits can make the
+ * count a little stale in the !readonly case, but it's only an estimate.
+ */
+static void
+bt_leaf_sample(BtreeCheckState *state)
+{
+	BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
+	OffsetNumber offset;
+	OffsetNumber max = PageGetMaxOffsetNumber(state->target);
+
+	for (offset = P_FIRSTDATAKEY(opaque);
+		 offset <= max;
+		 offset = OffsetNumberNext(offset))
+	{
+		ItemId		itemid = PageGetItemId(state->target, offset);
+		IndexTuple	itup = (IndexTuple) PageGetItem(state->target, itemid);
+
+		if (state->leafpages++ % state->leafstride != 0)
+			continue;
+
+		if (state->nleafsample == BT_LEAF_SAMPLE_SIZE)
+		{
+			int			i;
+
+			for (i = 0; i < BT_LEAF_SAMPLE_SIZE / 2; i++)
+				state->leafsample[i] = state->leafsample[i * 2];
+			state->nleafsample = BT_LEAF_SAMPLE_SIZE / 2;
+			state->leafstride *= 2;
+
+			/* Page might not be at a multiple of the new stride */
+			if ((state->leafpages - 1) % state->leafstride != 0)
+				continue;
+		}
+
+		state->leafsample[state->nleafsample++] =
+			ItemPointerGetBlockNumber(&(itup->t_tid));
+	}
+}
+
+/*
+ * Create state's filter for fingerprinting leaf tuples, just before the walk
+ * reaches the leaf level, which begins at leftmostleaf.
+ *
+ * The filter is sized by multiplying the number of leaf pages counted on
+ * level 1 by the average number of tuples on a sample of those pages.  This
+ * is far more accurate than reltuples, and usually results in a much smaller
+ * filter for small indexes.  When the root is a leaf page there is no level
+ * 1, so the root is the only leaf page, and the whole sample.
+ *
+ * Also determines the number of partitions needed to fit the filter in
+ * heapallindexed verification's share of maintenance_work_mem.  Exported
+ * fingerprints are always a single partition.
+ */
+static void
+bt_leaf_filter_create(BtreeCheckState *state, BlockNumber leftmostleaf,
+					  bool exported)
+{
+	int64		sampletuples = 0;
+	int			nsampled = 0;
+	uint64	   *sampleblocks;
+	int			i;
+
+	if (state->leafpages == 0 && leftmostleaf != P_NONE)
+	{
+		state->leafpages = 1;
+		state->leafsample[state->nleafsample++] = leftmostleaf;
+	}
+
+	/* Heap blocks that sampled tuples point to */
+	sampleblocks = palloc(sizeof(uint64) * state->nleafsample *
+						  MaxIndexTuplesPerPage);
+
+	for (i = 0; i < state->nleafsample; i++)
+	{
+		Page		page;
+		BTPageOpaque opaque;
+		OffsetNumber offset;
+		OffsetNumber max;
+
+		CHECK_FOR_INTERRUPTS();
+
+		page = palloc_btree_page(state, state->leafsample[i]);
+		opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+
+		/* Pages can be deleted or split concurrently in !readonly case */
+		if (!P_IGNORE(opaque) && P_ISLEAF(opaque))
+		{
+			max = PageGetMaxOffsetNumber(page);
+			for (offset = P_FIRSTDATAKEY(opaque);
+				 offset <= max;
+				 offset = OffsetNumberNext(offset))
+			{
+				ItemId		itemid = PageGetItemId(page, offset);
+				IndexTuple	itup;
+
+				if (ItemIdIsDead(itemid))
+					continue;
+				itup = (IndexTuple) PageGetItem(page, itemid);
+				sampleblocks[sampletuples++] =
+					ItemPointerGetBlockNumber(&(itup->t_tid));
+			}
+			nsampled++;
+		}
+
+		bt_release_page(state, page);
+	}
+
+	if (nsampled > 0)
+		state->leaftuples = (sampletuples * state->leafpages + nsampled - 1) /
+			nsampled;
+	else if (state->leafpages > 0)
+		state->leaftuples = (int64) state->rel->rd_rel->reltuples;
+	else
+		state->leaftuples = 0;
+
+	elog(DEBUG1, "estimated " INT64_FORMAT " tuples on " INT64_FORMAT " leaf pages of index \"%s\" from sample of %d pages",
+		 state->leaftuples, state->leafpages,
+		 RelationGetRelationName(state->rel), nsampled);
+
+	/*
+	 * When heapallindexed verification's share of maintenance_work_mem is
+	 * too small for one Bloom filter to fingerprint the entire index at the
+	 * standard false positive rate, split tuples into hash partitions, and
+	 * verify one partition per pass
+	 */
+	if (!exported)
+		state->npartitions = bloom_partitions(state->leaftuples,
+											  state->heapallindexedmem);
+	if (state->npartitions > 1)
+		ereport(NOTICE,
+				(errmsg("verifying that tuples from index \"%s\" are present in \"%s\" using %d passes",
+						RelationGetRelationName(state->rel),
+						RelationGetRelationName(state->heaprel),
+						state->npartitions),
+				 errhint("Increasing maintenance_work_mem reduces the number of passes.")));
+
+	/*
+	 * A static filter has a lower false positive rate than a Bloom filter,
+	 * needs less than half the space, and makes each probe touch at most 3
+	 * cache lines.  But it's built only once every tuple has been
+	 * fingerprinted, and building it needs several times more memory than
+	 * the finished filter, so it's only used when that fits in
+	 * heapallindexed verification's memory.  Exported fingerprints must be
+	 * Bloom filters.
+	 */
+	if (!exported && state->npartitions == 1)
+		state->filter = bloom_create_static(state->leaftuples,
+											state->heapallindexedmem,
+											state->seed);
+	state->staticfilter = (state->filter != NULL);
+	if (state->staticfilter)
+	{
+		pfree(sampleblocks);
+		return;
+	}
+
+	/*
+	 * Estimate is still only an estimate, so use a scalable filter that grows
+	 * when it gets more tuples than expected, rather than one whose false
+	 * positive rate degrades
+	 */
+	state->filter = bloom_create_scalable(state->leaftuples /
+										  state->npartitions,
+										  state->heapallindexedmem,
+										  state->seed);
+
+	/*
+	 * Confine bits for tuples from each run of heap blocks to one segment of
+	 * a large bitset, so that the heap scan's probes stay cache resident.
+	 * That's only worth doing when tuples are spread across the heap, rather
+	 * than bunched up in a few heap blocks, as with a partial index, or an
+	 * index on a heap where only recently added rows are indexed.  The filter
+	 * decides based on the heap blocks of the sampled tuples.
+	 */
+	state->ranged = bloom_set_ranges(state->filter,
+									 RelationGetNumberOfBlocks(state->heaprel),
+									 sampleblocks, (int) sampletuples);
+	pfree(sampleblocks);
+}
+
+/*
+ * Create a Bloom filter for fingerprinting the leaf level again, once the
+ * walk of the index has created the first filter.  This is needed for each
+ * partition after the first, and in place of a first filter that couldn't be
+ * used.
+ *
+ * The new filter is ranged when the first filter was, unless that turned out
+ * to be a bad idea.
+ */
+static bloom_filter *
+bt_leaf_filter_next(BtreeCheckState *state, uint64 seed)
+{
+	bloom_filter *filter;
+
+	filter = bloom_create_scalable(state->leaftuples / state->npartitions,
+								   state->heapallindexedmem, seed);
+	if (state->ranged)
+		bloom_set_ranges(filter, RelationGetNumberOfBlocks(state->heaprel),
+						 NULL, 0);
+
+	return filter;
+}
+
+/*
+ * Replace state's ranged Bloom filter with an unranged one, when too many of
+ * the tuples that it fingerprinted turned out to point to heap blocks covered
+ * by a few of its segments.  Those segments would have a far higher false
+ * positive rate than the filter as a whole.  The leaf sample can't rule that
+ * out, so this is checked after fingerprinting each partition.
+ *
+ * The current partition is fingerprinted again, and filters for any later
+ * partitions are unranged too.
+ */
+static void
+bt_leaf_filter_check_ranges(BtreeCheckState *state, BlockNumber leftmostleaf)
+{
+	if (!state->ranged || !bloom_ranges_overflowed(state->filter))
+		return;
+
+	elog(DEBUG1, "tuples from index \"%s\" are unevenly spread across heap blocks of \"%s\", fingerprinting again without heap block ranges",
+		 RelationGetRelationName(state->rel),
+		 RelationGetRelationName(state->heaprel));
+
+	state->ranged = false;
+	bloom_free(state->filter);
+	state->filter = bt_leaf_filter_next(state, random());
+	bt_fingerprint_leaf_level(state, leftmostleaf);
+}
+
 /*
  * Function performs the following checks on target page, or pages ancillary to
  * target page:
@@ -767,7 +2497,8 @@ nextpage:
  *   (Limited to heapallindexed readonly callers.)
  *
  * This is also where heapallindexed callers use their Bloom filter to
- * fingerprint IndexTuples for later IndexBuildHeapScan() verification.
+ * fingerprint IndexTuples for later IndexBuildHeapScan() verification.  Leaf
+ * page tuples are fingerprinted together, in one batch per page.
  *
  * Note:  Memory allocated in this routine is expected to be released by caller
  * resetting state->targetcontext.
@@ -778,6 +2509,8 @@ bt_target_page_check(BtreeCheckState *state)
 	OffsetNumber offset;
 	OffsetNumber max;
 	BTPageOpaque topaque;
+	IndexTuple	fingerprints[MaxIndexTuplesPerPage];
+	int			nfingerprints = 0;
 
 	topaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
 	max = PageGetMaxOffsetNumber(state->target);
@@ -823,16 +2556,40 @@ bt_target_page_check(BtreeCheckState *state)
 										(uint32) state->targetlsn),
 					 errhint("This could be a torn page problem.")));
 
-		/* Fingerprint downlink blocks in heapallindexed + readonly case */
+		/*
+		 * Record downlink blocks in heapallindexed + readonly case.  Blocks
+		 * past the end of the index are reported when the child is visited.
+		 */
 		if (state->heapallindexed && state->readonly && !P_ISLEAF(topaque))
 		{
 			BlockNumber childblock = ItemPointerGetBlockNumber(&itup->t_tid);
 
-			bloom_add_element(state->downlinkfilter,
-							  (unsigned char *) &childblock,
-							  sizeof(BlockNumber));
+			if (childblock < state->downlinkblocks &&
+				!(state->downlinkbitmap[childblock / BITS_PER_BYTE] &
+				  (1 << (childblock % BITS_PER_BYTE))))
+			{
+				state->downlinkbitmap[childblock / BITS_PER_BYTE] |=
+					1 << (childblock % BITS_PER_BYTE);
+				state->downlinks++;
+			}
 		}
 
+		/*
+		 * * Downlink check *
+		 *
+		 * Additional check of child items iff this is an internal page and
+		 * caller holds a ShareLock.  The downlink's bounds are recorded, and
+		 * checked when the walk reaches the child.  This happens for every
+		 * downlink, including the negative-infinity downlink, which still has
+		 * an upper bound.
+		 */
+		if (!P_ISLEAF(topaque) && state->readonly && !state->physical)
+			bt_downlink_record(state, offset);
+
+		/* Remember child block, so that walk of level below can prefetch it */
+		if (!P_ISLEAF(topaque) && !state->physical)
+			bt_prefetch_record(state, ItemPointerGetBlockNumber(&(itup->t_tid)));
+
 		/*
 		 * Don't try to generate scankey using "negative infinity" item on
 		 * internal pages. They are always truncated to zero attributes.
@@ -843,18 +2600,9 @@ bt_target_page_check(BtreeCheckState *state)
 		/* Build insertion scankey for current page offset */
 		skey = _bt_mkscankey(state->rel, itup);
 
-		/* Fingerprint leaf page tuples (those that point to the heap) */
+		/* Buffer leaf page tuples (those that point to the heap) */
 		if (state->heapallindexed && P_ISLEAF(topaque) && !ItemIdIsDead(itemid))
-		{
-			IndexTuple		norm;
-
-			norm = bt_normalize_tuple(state, itup);
-			bloom_add_element(state->filter, (unsigned char *) norm,
-							  IndexTupleSize(norm));
-			/* Be tidy */
-			if (norm != itup)
-				pfree(norm);
-		}
+			fingerprints[nfingerprints++] = bt_normalize_tuple(state, itup);
 
 		/*
 		 * * High key check *
@@ -961,8 +2709,11 @@ bt_target_page_check(BtreeCheckState *state)
 		 * from the next/sibling page.  There may not be such an item
 		 * available from sibling for various reasons, though (e.g., target is
 		 * the rightmost page on level).
+		 *
+		 * Physical-order verification performs this check once both pages
+		 * have been read instead.  See bt_physical_page_links().
 		 */
-		else if (offset == max)
+		else if (offset == max && !state->physical)
 		{
 			ScanKey		rightkey;
 
@@ -987,10 +2738,16 @@ bt_target_page_check(BtreeCheckState *state)
 					topaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
 
 					/*
-					 * All !readonly checks now performed; just return
+					 * All !readonly checks now performed; just fingerprint
+					 * and return
 					 */
 					if (P_IGNORE(topaque))
+					{
+						if (nfingerprints > 0)
+							bt_fingerprint_tuples(state, fingerprints,
+												  nfingerprints);
 						return;
+					}
 				}
 
 				ereport(ERROR,
@@ -1003,23 +2760,12 @@ bt_target_page_check(BtreeCheckState *state)
 											(uint32) state->targetlsn)));
 			}
 		}
-
-		/*
-		 * * Downlink check *
-		 *
-		 * Additional check of child items iff this is an internal page and
-		 * caller holds a ShareLock.  This happens for every downlink (item)
-		 * in target excluding the negative-infinity downlink (again, this is
-		 * because it has no useful value to compare).
-		 */
-		if (!P_ISLEAF(topaque) && state->readonly)
-		{
-			BlockNumber childblock = ItemPointerGetBlockNumber(&(itup->t_tid));
-
-			bt_downlink_check(state, childblock, skey);
-		}
 	}
 
+	/* Fingerprint leaf page tuples */
+	if (nfingerprints > 0)
+		bt_fingerprint_tuples(state, fingerprints, nfingerprints);
+
 	/*
 	 * * Check if page has a downlink in parent *
 	 *
@@ -1053,6 +2799,7 @@ bt_right_page_check_scankey(BtreeCheckState *state)
 	BlockNumber targetnext;
 	Page		rightpage;
 	OffsetNumber nline;
+	MemoryContext oldcontext;
 
 	/* Determine target's next block number */
 	opaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
@@ -1090,7 +2837,11 @@ bt_right_page_check_scankey(BtreeCheckState *state)
 	{
 		CHECK_FOR_INTERRUPTS();
 
+		/* Allocate where level walk can reuse page as next target */
+		oldcontext =
+			MemoryContextSwitchTo(MemoryContextGetParent(state->targetcontext));
 		rightpage = palloc_btree_page(state, targetnext);
+		MemoryContextSwitchTo(oldcontext);
 		opaque = (BTPageOpaque) PageGetSpecialPointer(rightpage);
 
 		if (!P_IGNORE(opaque) || P_RIGHTMOST(opaque))
@@ -1105,9 +2856,15 @@ bt_right_page_check_scankey(BtreeCheckState *state)
 				 errdetail_internal("Deleted page found when building scankey from right sibling.")));
 
 		/* Be slightly more pro-active in freeing this memory, just in case */
-		pfree(rightpage);
+		bt_release_page(state, rightpage);
 	}
 
+	/* Hand over page to level walk, which frees it */
+	if (state->rightpage)
+		bt_release_page(state, state->rightpage);
+	state->rightpage = rightpage;
+	state->rightblock = targetnext;
+
 	/*
 	 * No ShareLock held case -- why it's safe to proceed.
 	 *
@@ -1169,7 +2926,7 @@ bt_right_page_check_scankey(BtreeCheckState *state)
 	 * Top level tree walk caller moves on to next page (makes it the new
 	 * target) following recovery from this race.  (cf.  The rationale for
 	 * child/downlink verification needing a ShareLock within
-	 * bt_downlink_check(), where page deletion is also the main source of
+	 * bt_child_bounds_check(), where page deletion is also the main source of
 	 * trouble.)
 	 *
 	 * Note that it doesn't matter if right sibling page here is actually a
@@ -1242,22 +2999,131 @@ bt_right_page_check_scankey(BtreeCheckState *state)
 }
 
 /*
- * Checks one of target's downlink against its child page.
+ * Record bounds of target's downlink at offset, so that they can be checked
+ * against the child page once the walk of the level below reaches it.
+ *
+ * Bounds are checked against the child page straight away instead, reading
+ * it out of order, once structure verification's memory has been used up.
+ */
+static void
+bt_downlink_record(BtreeCheckState *state, OffsetNumber offset)
+{
+	BTPageOpaque topaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
+	OffsetNumber max = PageGetMaxOffsetNumber(state->target);
+	BtreeBoundsList *list = &state->childbounds;
+	BtreeDownlinkBounds bounds;
+	BtreeDownlinkBounds *prev;
+	IndexTuple	itup;
+	MemoryContext oldcontext;
+
+	itup = (IndexTuple) PageGetItem(state->target,
+									PageGetItemId(state->target, offset));
+	bounds.childblock = ItemPointerGetBlockNumber(&(itup->t_tid));
+	bounds.parentblock = state->targetblock;
+	bounds.parentlsn = state->targetlsn;
+
+	/* Negative infinity item has no useful value to compare */
+	if (offset_is_negative_infinity(topaque, offset))
+		bounds.lowkey = NULL;
+	else
+		bounds.lowkey = itup;
+
+	if (offset < max)
+		bounds.highkey = (IndexTuple)
+			PageGetItem(state->target,
+						PageGetItemId(state->target, OffsetNumberNext(offset)));
+	else if (!P_RIGHTMOST(topaque))
+		bounds.highkey = (IndexTuple)
+			PageGetItem(state->target, PageGetItemId(state->target, P_HIKEY));
+	else
+		bounds.highkey = NULL;
+
+	if (list->full)
+	{
+		bt_downlink_check(state, &bounds);
+		return;
+	}
+
+	oldcontext = MemoryContextSwitchTo(list->context);
+
+	if (list->nbounds == list->maxbounds)
+	{
+		int			oldmax = list->maxbounds;
+
+		list->maxbounds = Max(1024, oldmax * 2);
+		if (list->bounds)
+			list->bounds = repalloc(list->bounds, list->maxbounds *
+									sizeof(BtreeDownlinkBounds));
+		else
+			list->bounds = palloc(list->maxbounds *
+								  sizeof(BtreeDownlinkBounds));
+		list->used += (list->maxbounds - oldmax) * sizeof(BtreeDownlinkBounds);
+		state->structureused += (list->maxbounds - oldmax) *
+			sizeof(BtreeDownlinkBounds);
+	}
+
+	/* Previous downlink's upper bound is usually this downlink's key */
+	prev = list->nbounds > 0 ? &list->bounds[list->nbounds - 1] : NULL;
+	if (bounds.lowkey && prev && prev->parentblock == bounds.parentblock &&
+		prev->highkey)
+		bounds.lowkey = prev->highkey;
+	else if (bounds.lowkey)
+	{
+		bounds.lowkey = CopyIndexTuple(bounds.lowkey);
+		list->used += IndexTupleSize(bounds.lowkey);
+		state->structureused += IndexTupleSize(bounds.lowkey);
+	}
+	if (bounds.highkey)
+	{
+		bounds.highkey = CopyIndexTuple(bounds.highkey);
+		list->used += IndexTupleSize(bounds.highkey);
+		state->structureused += IndexTupleSize(bounds.highkey);
+	}
+	list->bounds[list->nbounds++] = bounds;
+
+	if (state->structureused >= state->structuremem)
+		list->full = true;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Checks one of target's downlinks against its child page, reading the child
+ * page out of order.
+ *
+ * This is only needed for downlinks whose bounds couldn't be recorded, and
+ * for downlinks whose children weren't reached by the walk in the expected
+ * order, which suggests corruption.
+ */
+static void
+bt_downlink_check(BtreeCheckState *state, BtreeDownlinkBounds *bounds)
+{
+	Page		child;
+
+	child = palloc_btree_page(state, bounds->childblock);
+	bt_child_bounds_check(state, bounds, child);
+	bt_release_page(state, child);
+}
+
+/*
+ * Checks child page against the bounds of its downlink.
  *
- * Conceptually, the target page continues to be what is checked here.  The
- * target block is still blamed in the event of finding an invariant violation.
- * The downlink insertion into the target is probably where any problem raised
- * here arises, and there is no such thing as a parent link, so doing the
- * verification this way around is much more practical.
+ * Conceptually, the parent page is what is checked here, even though it's no
+ * longer the target.  The parent block is still blamed in the event of
+ * finding an invariant violation.  The downlink insertion into the parent is
+ * probably where any problem raised here arises, and there is no such thing
+ * as a parent link, so doing the verification this way around is much more
+ * practical.
  */
 static void
-bt_downlink_check(BtreeCheckState *state, BlockNumber childblock,
-				  ScanKey targetkey)
+bt_child_bounds_check(BtreeCheckState *state, BtreeDownlinkBounds *bounds,
+					  Page child)
 {
 	OffsetNumber offset;
 	OffsetNumber maxoffset;
-	Page		child;
 	BTPageOpaque copaque;
+	ScanKey		lowkey = NULL;
+	ScanKey		highkey = NULL;
 
 	/*
 	 * Caller must have ShareLock on target relation, because of
@@ -1300,13 +3166,12 @@ bt_downlink_check(BtreeCheckState *state, BlockNumber childblock,
 	Assert(state->readonly);
 
 	/*
-	 * Verify child page has the downlink key from target page (its parent) as
-	 * a lower bound.
+	 * Verify child page has the downlink key from parent page as a lower
+	 * bound, and the next downlink's key as an upper bound.
 	 *
-	 * Check all items, rather than checking just the first and trusting that
-	 * the operator class obeys the transitive law.
+	 * Check all items, rather than checking just the first and last and
+	 * trusting that the operator class obeys the transitive law.
 	 */
-	child = palloc_btree_page(state, childblock);
 	copaque = (BTPageOpaque) PageGetSpecialPointer(child);
 	maxoffset = PageGetMaxOffsetNumber(child);
 
@@ -1340,16 +3205,26 @@ bt_downlink_check(BtreeCheckState *state, BlockNumber childblock,
 				 errmsg("downlink to deleted page found in index \"%s\"",
 						RelationGetRelationName(state->rel)),
 				 errdetail_internal("Parent block=%u child block=%u parent page lsn=%X/%X.",
-									state->targetblock, childblock,
-									(uint32) (state->targetlsn >> 32),
-									(uint32) state->targetlsn)));
+									bounds->parentblock, bounds->childblock,
+									(uint32) (bounds->parentlsn >> 32),
+									(uint32) bounds->parentlsn)));
+
+	if (bounds->lowkey)
+		lowkey = _bt_mkscankey(state->rel, bounds->lowkey);
+
+	/*
+	 * Half-dead page's key space may already have been merged into its
+	 * right sibling's, so only its lower bound is certain to hold
+	 */
+	if (bounds->highkey && !P_IGNORE(copaque))
+		highkey = _bt_mkscankey(state->rel, bounds->highkey);
 
 	for (offset = P_FIRSTDATAKEY(copaque);
 		 offset <= maxoffset;
 		 offset = OffsetNumberNext(offset))
 	{
 		/*
-		 * Skip comparison of target page key against "negative infinity"
+		 * Skip comparison of parent page key against "negative infinity"
 		 * item, if any.  Checking it would indicate that it's not an upper
 		 * bound, but that's only because of the hard-coding within
 		 * _bt_compare().
@@ -1357,19 +3232,200 @@ bt_downlink_check(BtreeCheckState *state, BlockNumber childblock,
 		if (offset_is_negative_infinity(copaque, offset))
 			continue;
 
-		if (!invariant_leq_nontarget_offset(state, child,
-											targetkey, offset))
+		if (lowkey &&
+			!invariant_leq_nontarget_offset(state, child, lowkey, offset))
 			ereport(ERROR,
 					(errcode(ERRCODE_INDEX_CORRUPTED),
 					 errmsg("down-link lower bound invariant violated for index \"%s\"",
 							RelationGetRelationName(state->rel)),
 					 errdetail_internal("Parent block=%u child index tid=(%u,%u) parent page lsn=%X/%X.",
-										state->targetblock, childblock, offset,
-										(uint32) (state->targetlsn >> 32),
-										(uint32) state->targetlsn)));
+										bounds->parentblock,
+										bounds->childblock, offset,
+										(uint32) (bounds->parentlsn >> 32),
+										(uint32) bounds->parentlsn)));
+
+		if (highkey &&
+			!invariant_geq_nontarget_offset(state, child, highkey, offset))
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("down-link upper bound invariant violated for index \"%s\"",
+							RelationGetRelationName(state->rel)),
+					 errdetail_internal("Parent block=%u child index tid=(%u,%u) parent page lsn=%X/%X.",
+										bounds->parentblock,
+										bounds->childblock, offset,
+										(uint32) (bounds->parentlsn >> 32),
+										(uint32) bounds->parentlsn)));
+	}
+}
+
+/*
+ * Make bounds recorded while walking the level above apply to the level
+ * about to be walked, and start recording bounds for the level below
+ */
+static void
+bt_bounds_next_level(BtreeCheckState *state)
+{
+	BtreeBoundsList consumed = state->levelbounds;
+
+	MemoryContextReset(consumed.context);
+	state->structureused -= consumed.used;
+	state->levelbounds = state->childbounds;
+	memset(&state->childbounds, 0, sizeof(BtreeBoundsList));
+	state->childbounds.context = consumed.context;
+}
+
+/*
+ * Record block that one of target's downlinks points to, for prefetching by
+ * walk of level below.  Blocks past what fits in structure verification's
+ * memory aren't recorded, and so aren't prefetched.
+ *
+ * The list is complete before the walk of the level below starts, so it
+ * can't be limited to a window of target_prefetch_pages blocks.  It can't
+ * need more entries than the index had blocks when the walk of target's level
+ * started, though.  Blocks added by concurrent page splits since then just
+ * aren't prefetched.
+ */
+static void
+bt_prefetch_record(BtreeCheckState *state, BlockNumber childblock)
+{
+	BtreeLevelBlocks *list = &state->childblocks;
+
+	if (target_prefetch_pages <= 0 || list->full)
+		return;
+
+	if (list->nblocks == list->maxblocks)
+	{
+		MemoryContext levelcontext;
+		int			oldmax = list->maxblocks;
+
+		list->maxblocks = Min(Max(1024, oldmax * 2),
+							  state->levelindexblocks);
+		if (list->maxblocks <= oldmax ||
+			state->structureused + (list->maxblocks - oldmax) *
+			sizeof(BlockNumber) > state->structuremem)
+		{
+			list->maxblocks = oldmax;
+			list->full = true;
+			return;
+		}
+		state->structureused += (list->maxblocks - oldmax) *
+			sizeof(BlockNumber);
+
+		/* List must outlive target page */
+		levelcontext = MemoryContextGetParent(state->targetcontext);
+		if (list->blocks)
+			list->blocks = repalloc(list->blocks,
+									list->maxblocks * sizeof(BlockNumber));
+		else
+			list->blocks = MemoryContextAlloc(levelcontext,
+											  list->maxblocks *
+											  sizeof(BlockNumber));
+	}
+
+	list->blocks[list->nblocks++] = childblock;
+}
+
+/*
+ * Make downlink blocks recorded while walking the level above available for
+ * prefetching during walk of the level about to be walked
+ */
+static void
+bt_prefetch_next_level(BtreeCheckState *state)
+{
+	if (state->levelblocks.blocks)
+	{
+		pfree(state->levelblocks.blocks);
+		state->structureused -= state->levelblocks.maxblocks *
+			sizeof(BlockNumber);
+	}
+	state->levelblocks = state->childblocks;
+	memset(&state->childblocks, 0, sizeof(BtreeLevelBlocks));
+
+	/* Bounds growth of list of blocks for level below */
+	if (target_prefetch_pages > 0)
+		state->levelindexblocks = RelationGetNumberOfBlocks(state->rel);
+}
+
+/*
+ * Prefetch blocks ahead of level walk, which is about to read current.
+ *
+ * Blocks are prefetched in the order that the level above's downlinks were
+ * found, which is the order the walk follows sibling links in, so long as
+ * the index isn't corrupt.  Up to target_prefetch_pages blocks (as set by
+ * effective_io_concurrency) are kept in flight.  Once half of those have
+ * been read, the next half are prefetched together, in block number order.
+ */
+static void
+bt_prefetch_level(BtreeCheckState *state, BlockNumber current)
+{
+	BtreeLevelBlocks *list = &state->levelblocks;
+	BlockNumber *batch;
+	int			distance = target_prefetch_pages;
+	int			nbatch;
+	int			i;
+
+	/* Pages without downlinks, such as right halves of splits, aren't listed */
+	if (list->walked < list->nblocks && list->blocks[list->walked] == current)
+		list->walked++;
+
+	if (distance <= 0 || list->prefetched >= list->nblocks ||
+		list->prefetched - list->walked > distance / 2)
+		return;
+
+	/* Current block is about to be read anyway */
+	list->prefetched = Max(list->prefetched, list->walked);
+	nbatch = Min(list->nblocks, list->walked + distance) - list->prefetched;
+	if (nbatch <= 0)
+		return;
+
+	batch = palloc(nbatch * sizeof(BlockNumber));
+	memcpy(batch, list->blocks + list->prefetched,
+		   nbatch * sizeof(BlockNumber));
+	qsort(batch, nbatch, sizeof(BlockNumber), bt_blocknumber_cmp);
+	for (i = 0; i < nbatch; i++)
+		PrefetchBuffer(state->rel, MAIN_FORKNUM, batch[i]);
+	pfree(batch);
+
+	list->prefetched += nbatch;
+}
+
+/*
+ * qsort() comparator for block numbers
+ */
+static int
+bt_blocknumber_cmp(const void *a, const void *b)
+{
+	BlockNumber ba = *(const BlockNumber *) a;
+	BlockNumber bb = *(const BlockNumber *) b;
+
+	if (ba < bb)
+		return -1;
+	if (ba > bb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Check bounds that weren't matched by the level walk, reading their child
+ * pages out of order.  Downlinks are always in the same order as the level's
+ * sibling links in an index that isn't corrupt, so there shouldn't be any.
+ */
+static void
+bt_bounds_finish_level(BtreeCheckState *state)
+{
+	BtreeBoundsList *list = &state->levelbounds;
+
+	if (list->next < list->nbounds)
+		elog(DEBUG1, "checking %d downlinks of index \"%s\" not found in sibling order",
+			 list->nbounds - list->next, RelationGetRelationName(state->rel));
+
+	for (; list->next < list->nbounds; list->next++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		bt_downlink_check(state, &list->bounds[list->next]);
+		bt_page_pool_reset(state);
+		MemoryContextReset(state->targetcontext);
 	}
-
-	pfree(child);
 }
 
 /*
@@ -1389,12 +3445,6 @@ static void
 bt_downlink_missing_check(BtreeCheckState *state)
 {
 	BTPageOpaque	topaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
-	ItemId			itemid;
-	IndexTuple		itup;
-	Page			child;
-	BTPageOpaque	copaque;
-	uint32			level;
-	BlockNumber		childblk;
 
 	Assert(state->heapallindexed && state->readonly);
 	Assert(!P_IGNORE(topaque));
@@ -1437,10 +3487,10 @@ bt_downlink_missing_check(BtreeCheckState *state)
 		return;
 	}
 
-	/* Target's downlink is typically present in parent/fingerprinted */
-	if (!bloom_lacks_element(state->downlinkfilter,
-							 (unsigned char *) &state->targetblock,
-							 sizeof(BlockNumber)))
+	/* Target's downlink is typically present in parent */
+	Assert(state->targetblock < state->downlinkblocks);
+	if (state->downlinkbitmap[state->targetblock / BITS_PER_BYTE] &
+		(1 << (state->targetblock % BITS_PER_BYTE)))
 		return;
 
 	/*
@@ -1463,6 +3513,31 @@ bt_downlink_missing_check(BtreeCheckState *state)
 									(uint32) (state->targetlsn >> 32),
 									(uint32) state->targetlsn)));
 
+	bt_downlink_missing_descend(state);
+}
+
+/*
+ * Descend from internal target page that lacks a downlink, and check that
+ * this is due to an interrupted multi-level page deletion, whose half-dead
+ * leaf page links back to target as its top parent.  Raises an error
+ * otherwise.
+ *
+ * Shared by level walks and physical-order verification, both of which must
+ * hold ShareLock.
+ */
+static void
+bt_downlink_missing_descend(BtreeCheckState *state)
+{
+	BTPageOpaque	topaque = (BTPageOpaque) PageGetSpecialPointer(state->target);
+	ItemId			itemid;
+	IndexTuple		itup;
+	Page			child;
+	BTPageOpaque	copaque;
+	uint32			level;
+	BlockNumber		childblk;
+
+	Assert(state->readonly && !P_ISLEAF(topaque));
+
 	/* Descend from the target page, which is an internal page */
 	elog(DEBUG1, "checking for interrupted multi-level deletion due to missing downlink in index \"%s\"",
 		 RelationGetRelationName(state->rel));
@@ -1496,22 +3571,21 @@ bt_downlink_missing_check(BtreeCheckState *state)
 		itup = (IndexTuple) PageGetItem(child, itemid);
 		childblk = ItemPointerGetBlockNumber(&itup->t_tid);
 		/* Be slightly more pro-active in freeing this memory, just in case */
-		pfree(child);
+		bt_release_page(state, child);
 	}
 
 	/*
 	 * Since there cannot be a concurrent VACUUM operation in readonly mode,
 	 * and since a page has no links within other pages (siblings and parent)
 	 * once it is marked fully deleted, it should be impossible to land on a
-	 * fully deleted page.  See bt_downlink_check() for further details.
+	 * fully deleted page.  See bt_child_bounds_check() for further details.
 	 *
-	 * The bt_downlink_check() P_ISDELETED() check is repeated here because
-	 * bt_downlink_check() does not visit pages reachable through negative
-	 * infinity items.  Besides, bt_downlink_check() is unwilling to descend
-	 * multiple levels.  (The similar bt_downlink_check() P_ISDELETED() check
-	 * within bt_check_level_from_leftmost() won't reach the page either, since
-	 * the leaf's live siblings should have their sibling links updated to
-	 * bypass the deletion target page when it is marked fully dead.)
+	 * The bt_child_bounds_check() P_ISDELETED() check is repeated here
+	 * because bt_child_bounds_check() is unwilling to descend multiple
+	 * levels.  (The similar P_ISDELETED() check within
+	 * bt_check_level_from_leftmost() won't reach the page either, since the
+	 * leaf's live siblings should have their sibling links updated to bypass
+	 * the deletion target page when it is marked fully dead.)
 	 *
 	 * If this error is raised, it might be due to a previous multi-level page
 	 * deletion that failed to realize that it wasn't yet safe to mark the leaf
@@ -1557,11 +3631,335 @@ bt_downlink_missing_check(BtreeCheckState *state)
 								(uint32) state->targetlsn)));
 }
 
+/*
+ * Fingerprint a batch of normalized leaf page tuples, which is typically all
+ * of the tuples from one leaf page.  In the exact case, tuples are added to
+ * the index sort instead.
+ */
+static void
+bt_fingerprint_tuples(BtreeCheckState *state, IndexTuple *tuples, int ntuples)
+{
+	unsigned char *elems[MaxIndexTuplesPerPage];
+	size_t		lens[MaxIndexTuplesPerPage];
+	uint64		ranges[MaxIndexTuplesPerPage];
+	int			nelems = 0;
+	int			i;
+
+	Assert(ntuples <= MaxIndexTuplesPerPage);
+
+	if (state->exact)
+	{
+		for (i = 0; i < ntuples; i++)
+			bt_tuplesort_put(state, state->indexsort, tuples[i]);
+		return;
+	}
+
+	for (i = 0; i < ntuples; i++)
+	{
+		if (!bt_tuple_in_partition(state, tuples[i]))
+			continue;
+		elems[nelems] = (unsigned char *) tuples[i];
+		lens[nelems] = IndexTupleSize(tuples[i]);
+		ranges[nelems] = ItemPointerGetBlockNumber(&tuples[i]->t_tid);
+		nelems++;
+	}
+
+	bloom_add_elements_batch(state->filter, nelems, elems, lens, ranges);
+}
+
+/*
+ * Fingerprint current partition's tuples from every leaf page, for passes
+ * after the first.
+ *
+ * The first pass already verified the structure of the leaf level, so this
+ * only follows right links, exactly as the first pass did.  Any tuples that
+ * concurrent page splits move right are still found.
+ *
+ * In the !readonly case, a page can be deleted and recycled by a concurrent
+ * VACUUM after the right link to it was read, so a right link that leads to
+ * an internal page isn't necessarily corruption.  The left page is read again
+ * before concluding that it is, much as nbtree rechecks its position after
+ * stepping onto a page that was deleted.  Tuples that are fingerprinted more
+ * than once as a result are harmless.
+ */
+static void
+bt_fingerprint_leaf_level(BtreeCheckState *state, BlockNumber leftmost)
+{
+	MemoryContext oldcontext;
+	BlockNumber previous = P_NONE;
+	BlockNumber current = leftmost;
+
+	elog(DEBUG1, "fingerprinting partition %d of %d from index \"%s\"",
+		 state->partition + 1, state->npartitions,
+		 RelationGetRelationName(state->rel));
+
+	/* Use page-level context for duration of this call */
+	oldcontext = MemoryContextSwitchTo(state->targetcontext);
+
+	while (current != P_NONE)
+	{
+		IndexTuple	fingerprints[MaxIndexTuplesPerPage];
+		int			nfingerprints = 0;
+		Page		page;
+		BTPageOpaque opaque;
+		OffsetNumber offset;
+		OffsetNumber max;
+
+		CHECK_FOR_INTERRUPTS();
+
+		page = palloc_btree_page(state, current);
+		opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+
+		if (!P_IGNORE(opaque) && !P_ISLEAF(opaque))
+		{
+			BlockNumber next = current;
+
+			if (!state->readonly)
+				next = bt_leaf_level_recheck(state, previous);
+
+			if (next == current)
+				ereport(ERROR,
+						(errcode(ERRCODE_INDEX_CORRUPTED),
+						 errmsg("right link from leaf page points to non-leaf block %u in index \"%s\"",
+								current, RelationGetRelationName(state->rel))));
+
+			elog(DEBUG1, "block %u of index \"%s\" was recycled concurrently, continuing from block %u",
+				 current, RelationGetRelationName(state->rel), next);
+			current = next;
+			bt_page_pool_reset(state);
+			MemoryContextReset(state->targetcontext);
+			continue;
+		}
+
+		if (!P_IGNORE(opaque))
+		{
+			max = PageGetMaxOffsetNumber(page);
+			for (offset = P_FIRSTDATAKEY(opaque);
+				 offset <= max;
+				 offset = OffsetNumberNext(offset))
+			{
+				ItemId		itemid = PageGetItemId(page, offset);
+
+				if (!ItemIdIsDead(itemid))
+					fingerprints[nfingerprints++] =
+						bt_normalize_tuple(state,
+										   (IndexTuple) PageGetItem(page, itemid));
+			}
+
+			if (nfingerprints > 0)
+				bt_fingerprint_tuples(state, fingerprints, nfingerprints);
+			previous = current;
+		}
+
+		current = opaque->btpo_next;
+		bt_page_pool_reset(state);
+		MemoryContextReset(state->targetcontext);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Find where bt_fingerprint_leaf_level() should continue from, after a right
+ * link from previous led it to an internal page in the !readonly case.
+ *
+ * When previous is still a live leaf page, its current right link is
+ * returned.  That's the same block as before when the index really is
+ * corrupt.  When previous is P_NONE, or has been deleted itself, the walk
+ * starts over from the leftmost leaf page, found by descending from the root.
+ */
+static BlockNumber
+bt_leaf_level_recheck(BtreeCheckState *state, BlockNumber previous)
+{
+	Buffer		buffer;
+	BlockNumber next;
+
+	if (previous != P_NONE)
+	{
+		Page		page = palloc_btree_page(state, previous);
+		BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+
+		bool		live = !P_IGNORE(opaque) && P_ISLEAF(opaque);
+
+		next = opaque->btpo_next;
+		bt_release_page(state, page);
+
+		if (live)
+			return next;
+	}
+
+	buffer = _bt_get_endpoint(state->rel, 0, false);
+	if (!BufferIsValid(buffer))
+		return P_NONE;
+	next = BufferGetBlockNumber(buffer);
+	_bt_relbuf(state->rel, buffer);
+
+	return next;
+}
+
+/*
+ * Does normalized tuple belong to the hash partition that current
+ * heapallindexed pass fingerprints and probes?
+ */
+static inline bool
+bt_tuple_in_partition(BtreeCheckState *state, IndexTuple norm)
+{
+	uint32		hash;
+
+	if (state->npartitions <= 1)
+		return true;
+
+	hash = DatumGetUInt32(hash_any((unsigned char *) norm,
+								   IndexTupleSize(norm)));
+
+	return hash % state->npartitions == state->partition;
+}
+
+/*
+ * Export state's Bloom filter as a fingerprint of the index, to be probed by a
+ * later bt_index_fingerprint_probe() call.
+ *
+ * The bitsets of a Bloom filter sized by bloom_create_scalable() tend to be
+ * about half set, so there is no point in compressing them.
+ */
+static bytea *
+bt_fingerprint_export(BtreeCheckState *state)
+{
+	BtreeFingerprint hdr;
+	Size		filtersize;
+	Size		len;
+	bytea	   *result;
+
+	filtersize = bloom_serialized_size(state->filter);
+	len = VARHDRSZ + sizeof(BtreeFingerprint) + filtersize;
+	if (len > MaxAllocSize)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("fingerprint of index \"%s\" is too large to export",
+						RelationGetRelationName(state->rel)),
+				 errdetail("Fingerprint would be " UINT64_FORMAT " bytes.",
+						   (uint64) len),
+				 errhint("Reduce maintenance_work_mem.")));
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BT_FINGERPRINT_MAGIC;
+	hdr.relfilenode = state->rel->rd_node.relNode;
+	hdr.sysidentifier = GetSystemIdentifier();
+	hdr.lsn = bt_current_lsn();
+	hdr.xmincutoff = state->xmincutoff;
+
+	result = palloc(len);
+	SET_VARSIZE(result, len);
+	memcpy(VARDATA(result), &hdr, sizeof(hdr));
+	bloom_serialize(state->filter, VARDATA(result) + sizeof(hdr));
+
+	return result;
+}
+
+/*
+ * Import Bloom filter from fingerprint exported by bt_fingerprint_export(),
+ * establishing state's xmin cut-off.
+ *
+ * Raises an error when the fingerprint was not taken from state's index, or
+ * is otherwise unusable.
+ */
+static bloom_filter *
+bt_fingerprint_import(BtreeCheckState *state, bytea *fingerprint)
+{
+	BtreeFingerprint hdr;
+	char	   *data = VARDATA_ANY(fingerprint);
+	Size		len = VARSIZE_ANY_EXHDR(fingerprint);
+	TransactionId relfrozenxid = state->heaprel->rd_rel->relfrozenxid;
+	XLogRecPtr	currentlsn;
+	bloom_filter *filter;
+
+	if (len < sizeof(hdr))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid fingerprint for index \"%s\"",
+						RelationGetRelationName(state->rel))));
+	memcpy(&hdr, data, sizeof(hdr));
+
+	if (hdr.magic != BT_FINGERPRINT_MAGIC)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid fingerprint for index \"%s\"",
+						RelationGetRelationName(state->rel))));
+
+	if (hdr.sysidentifier != GetSystemIdentifier())
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("fingerprint does not match index \"%s\"",
+						RelationGetRelationName(state->rel)),
+				 errdetail("Fingerprint was taken on a different database system.")));
+
+	if (hdr.relfilenode != state->rel->rd_node.relNode)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("fingerprint does not match index \"%s\"",
+						RelationGetRelationName(state->rel)),
+				 errdetail("Fingerprint is for relfilenode %u, but index has relfilenode %u.",
+						   hdr.relfilenode, state->rel->rd_node.relNode)));
+
+	currentlsn = bt_current_lsn();
+	if (currentlsn < hdr.lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("fingerprint of index \"%s\" was taken at a later WAL position",
+						RelationGetRelationName(state->rel)),
+				 errdetail("Fingerprint WAL position is %X/%X, but current WAL position is %X/%X.",
+						   (uint32) (hdr.lsn >> 32), (uint32) hdr.lsn,
+						   (uint32) (currentlsn >> 32), (uint32) currentlsn),
+				 errhint("Retry once the server has replayed WAL up to the fingerprint's position.")));
+
+	/*
+	 * Xmin comparisons against the cut-off are only meaningful while the
+	 * cut-off is no older than the heap's relfrozenxid
+	 */
+	if (!TransactionIdIsNormal(hdr.xmincutoff) ||
+		(TransactionIdIsNormal(relfrozenxid) &&
+		 TransactionIdPrecedes(hdr.xmincutoff, relfrozenxid)))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("fingerprint of index \"%s\" is too old",
+						RelationGetRelationName(state->rel)),
+				 errdetail("Fingerprint transaction cut-off %u precedes relfrozenxid %u of table \"%s\".",
+						   hdr.xmincutoff, relfrozenxid,
+						   RelationGetRelationName(state->heaprel))));
+
+	filter = bloom_deserialize(data + sizeof(hdr), len - sizeof(hdr));
+	if (!filter)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid fingerprint for index \"%s\"",
+						RelationGetRelationName(state->rel)),
+				 errdetail("Fingerprint's Bloom filter is malformed, or was created on an incompatible platform.")));
+
+	state->xmincutoff = hdr.xmincutoff;
+
+	return filter;
+}
+
+/*
+ * Current WAL position, for the purposes of fingerprint export and import.
+ * On a standby, that's the replay position.
+ */
+static XLogRecPtr
+bt_current_lsn(void)
+{
+	if (RecoveryInProgress())
+		return GetXLogReplayRecPtr(NULL);
+
+	return GetXLogInsertRecPtr();
+}
+
 /*
  * Per-tuple callback from IndexBuildHeapScan, used to determine if index has
  * all the entries that definitely should have been observed in leaf pages of
  * the target index (that is, all IndexTuples that were fingerprinted by our
- * Bloom filter).  All heapallindexed checks occur here.
+ * Bloom filter).  All heapallindexed checks occur here, though the Bloom
+ * filter probes themselves are deferred until a full batch of normalized
+ * tuples has been buffered.  See bt_tuple_present_flush().
  *
  * The redundancy between an index and the table it indexes provides a good
  * opportunity to detect corruption, especially corruption within the table.
@@ -1617,7 +4015,9 @@ bt_tuple_present_callback(Relation index, HeapTuple htup, Datum *values,
 						  bool *isnull, bool tupleIsAlive, void *checkstate)
 {
 	BtreeCheckState *state = (BtreeCheckState *) checkstate;
-	IndexTuple	itup, norm;
+	MemoryContext oldcontext;
+	IndexTuple	itup;
+	IndexTuple	norm;
 
 	Assert(state->heapallindexed);
 
@@ -1645,34 +4045,298 @@ bt_tuple_present_callback(Relation index, HeapTuple htup, Datum *values,
 		 */
 		Assert(tupleIsAlive);
 		xmin = HeapTupleHeaderGetXmin(htup->t_data);
-		if (!TransactionIdPrecedes(xmin, TransactionXmin))
+
+		/*
+		 * An imported fingerprint's cut-off may predate a VACUUM that froze
+		 * tuples inserted after fingerprinting, so the original xmin is used
+		 * instead.  Tuples frozen by a release before 9.4 have no original
+		 * xmin, so those are not considered.
+		 */
+		if (state->imported)
+		{
+			xmin = HeapTupleHeaderGetRawXmin(htup->t_data);
+			if (!TransactionIdIsNormal(xmin))
+				return;
+		}
+
+		if (!TransactionIdPrecedes(xmin, state->xmincutoff))
 			return;
 	}
 
-	/* Generate a normalized index tuple for fingerprinting */
-	itup = index_form_tuple(RelationGetDescr(index), values, isnull);
-	itup->t_tid = htup->t_self;
-	norm = bt_normalize_tuple(state, itup);
+	/*
+	 * Generate a normalized index tuple for fingerprinting.  It must outlive
+	 * this call, so it's allocated in the probe context, which is reset once
+	 * the batch has been probed.
+	 */
+	oldcontext = MemoryContextSwitchTo(state->probecontext);
+	itup = index_form_tuple(RelationGetDescr(index), values, isnull);
+	itup->t_tid = htup->t_self;
+	if (state->exact)
+	{
+		bt_tuplesort_put(state, state->heapsort,
+						 bt_normalize_tuple(state, itup));
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(state->probecontext);
+		state->heaptuplespresent++;
+		return;
+	}
+	norm = bt_normalize_tuple(state, itup);
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Tuples outside of current pass's partition must not be buffered */
+	if (!bt_tuple_in_partition(state, norm))
+	{
+		if (norm != itup)
+			pfree(norm);
+		pfree(itup);
+		return;
+	}
+
+	state->probebatch[state->nprobebatch++] = norm;
+
+	if (state->nprobebatch == BT_PROBE_BATCH_SIZE)
+		bt_tuple_present_flush(state);
+}
+
+/*
+ * Probe Bloom filter for each buffered heap tuple -- tuples should be present.
+ *
+ * Probing a batch of tuples at once allows the Bloom filter to overlap the
+ * cache misses for many probes.  Caller must call here one last time once the
+ * heap scan is over, to probe for any tuples from a final, partial batch.
+ */
+static void
+bt_tuple_present_flush(BtreeCheckState *state)
+{
+	unsigned char *elems[BT_PROBE_BATCH_SIZE];
+	size_t		lens[BT_PROBE_BATCH_SIZE];
+	uint64		ranges[BT_PROBE_BATCH_SIZE];
+	bool		lacks[BT_PROBE_BATCH_SIZE];
+	int			i;
+
+	if (state->nprobebatch == 0)
+		return;
+
+	for (i = 0; i < state->nprobebatch; i++)
+	{
+		elems[i] = (unsigned char *) state->probebatch[i];
+		lens[i] = IndexTupleSize(state->probebatch[i]);
+		ranges[i] = ItemPointerGetBlockNumber(&state->probebatch[i]->t_tid);
+	}
+
+	/*
+	 * Heap scan visits blocks in order, so start prefetching the next segment
+	 * of a ranged Bloom filter once scan reaches the current one.  A
+	 * synchronized scan wraps around to block 0 part way through.
+	 */
+	if (ranges[0] >= state->nextprefetch || ranges[0] < state->lastprefetch)
+	{
+		state->lastprefetch = ranges[0];
+		state->nextprefetch = bloom_prefetch_range(state->filter, ranges[0]);
+	}
+
+	bloom_lacks_elements_batch(state->filter, state->nprobebatch, elems, lens,
+							   ranges, lacks);
+
+	for (i = 0; i < state->nprobebatch; i++)
+	{
+		if (lacks[i])
+			bt_tuple_missing(state, state->probebatch[i]);
+	}
+
+	state->heaptuplespresent += state->nprobebatch;
+	state->nprobebatch = 0;
+	/* Cannot leak memory here */
+	MemoryContextReset(state->probecontext);
+}
+
+/*
+ * Merge join sorted heap tuples against sorted index tuples, in exact case --
+ * every heap tuple should have a bitwise identical index tuple.
+ *
+ * Both sorts return tuples in index order, with ties broken by heap TID.  The
+ * heap side cannot have duplicates, so each index tuple is needed by at most
+ * one heap tuple.  Both sorts are read once, sequentially.
+ */
+static void
+bt_tuple_present_merge(BtreeCheckState *state)
+{
+	ScanKey		skey;
+	IndexTuple	htup = NULL;
+	IndexTuple	itup = NULL;
+	bool		hshould_free = false;
+	bool		ishould_free = false;
+
+	skey = _bt_mkscankey_nodata(state->rel);
+
+	tuplesort_performsort(state->indexsort);
+	tuplesort_performsort(state->heapsort);
+
+	itup = bt_tuplesort_next(state->indexsort, itup, &ishould_free);
+	while ((htup = bt_tuplesort_next(state->heapsort, htup,
+									 &hshould_free)) != NULL)
+	{
+		bool		found = false;
+		int			cmp = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Skip index tuples that sort before heap tuple */
+		while (itup && (cmp = bt_tuple_compare(state, skey, itup, htup)) < 0)
+			itup = bt_tuplesort_next(state->indexsort, itup, &ishould_free);
+
+		/*
+		 * Index tuples that are equal according to the opclass and point to
+		 * the same heap TID may still differ bitwise (e.g. numeric display
+		 * scale), so look at all of them
+		 */
+		while (itup && cmp == 0)
+		{
+			if (IndexTupleSize(itup) == IndexTupleSize(htup) &&
+				memcmp(itup, htup, IndexTupleSize(htup)) == 0)
+			{
+				found = true;
+				break;
+			}
+			itup = bt_tuplesort_next(state->indexsort, itup, &ishould_free);
+			if (itup)
+				cmp = bt_tuple_compare(state, skey, itup, htup);
+		}
+
+		if (!found)
+			bt_tuple_missing(state, htup);
+	}
+
+	_bt_freeskey(skey);
+}
+
+/*
+ * Report heap tuple that lacks matching index tuple
+ */
+static void
+bt_tuple_missing(BtreeCheckState *state, IndexTuple norm)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("heap tuple (%u,%u) from table \"%s\" lacks matching index tuple within index \"%s\"",
+					ItemPointerGetBlockNumber(&(norm->t_tid)),
+					ItemPointerGetOffsetNumber(&(norm->t_tid)),
+					RelationGetRelationName(state->heaprel),
+					RelationGetRelationName(state->rel)),
+			 !state->readonly
+			 ? errhint("Retrying verification using the function bt_index_parent_check() might provide a more specific error.")
+			 : 0));
+}
+
+/*
+ * Begin sort of normalized tuples for exact heapallindexed verification.
+ * Sort spills to temp files once workMem (in kilobytes) is exceeded.
+ */
+static Tuplesortstate *
+bt_tuplesort_begin(BtreeCheckState *state, int workMem)
+{
+#if PG_VERSION_NUM >= 110000
+	return tuplesort_begin_index_btree(state->heaprel, state->rel, false,
+									   workMem, NULL, false);
+#else
+	return tuplesort_begin_index_btree(state->heaprel, state->rel, false,
+									   workMem, false);
+#endif
+}
+
+/*
+ * Add normalized tuple to sort.  Sort makes its own copy.
+ */
+static void
+bt_tuplesort_put(BtreeCheckState *state, Tuplesortstate *sort,
+				 IndexTuple itup)
+{
+#if PG_VERSION_NUM >= 90500
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+
+	/* Deterministic, since itup was formed by index_form_tuple() */
+	index_deform_tuple(itup, RelationGetDescr(state->rel), values, isnull);
+	tuplesort_putindextuplevalues(sort, state->rel, &itup->t_tid, values,
+								  isnull);
+#else
+	tuplesort_putindextuple(sort, itup);
+#endif
+}
+
+/*
+ * Get next tuple from performed sort, or NULL once sort is exhausted.
+ *
+ * prev is the last tuple returned for the same sort, which is no longer valid
+ * once we return.
+ */
+static IndexTuple
+bt_tuplesort_next(Tuplesortstate *sort, IndexTuple prev, bool *should_free)
+{
+#if PG_VERSION_NUM >= 100000
+	return tuplesort_getindextuple(sort, true);
+#else
+	if (prev && *should_free)
+		pfree(prev);
+	return tuplesort_getindextuple(sort, true, should_free);
+#endif
+}
+
+/*
+ * Compare normalized tuples a and b in the order that a sort returns them in:
+ * index order, with ties broken by heap TID.  skey must come from
+ * _bt_mkscankey_nodata().
+ */
+static int
+bt_tuple_compare(BtreeCheckState *state, ScanKey skey, IndexTuple a,
+				 IndexTuple b)
+{
+	TupleDesc	itupdesc = RelationGetDescr(state->rel);
+	int			natts = RelationGetNumberOfAttributes(state->rel);
+	int			i;
 
-	/* Probe Bloom filter -- tuple should be present */
-	if (bloom_lacks_element(state->filter, (unsigned char *) norm,
-							IndexTupleSize(norm)))
-		ereport(ERROR,
-				(errcode(ERRCODE_DATA_CORRUPTED),
-				 errmsg("heap tuple (%u,%u) from table \"%s\" lacks matching index tuple within index \"%s\"",
-						ItemPointerGetBlockNumber(&(itup->t_tid)),
-						ItemPointerGetOffsetNumber(&(itup->t_tid)),
-						RelationGetRelationName(state->heaprel),
-						RelationGetRelationName(state->rel)),
-				 !state->readonly
-				 ? errhint("Retrying verification using the function bt_index_parent_check() might provide a more specific error.")
-				 : 0));
+	for (i = 1; i <= natts; i++)
+	{
+		ScanKey		entry = &skey[i - 1];
+		Datum		datum1,
+					datum2;
+		bool		isnull1,
+					isnull2;
+		int32		result;
 
-	state->heaptuplespresent++;
-	pfree(itup);
-	/* Cannot leak memory here */
-	if (norm != itup)
-		pfree(norm);
+		datum1 = index_getattr(a, i, itupdesc, &isnull1);
+		datum2 = index_getattr(b, i, itupdesc, &isnull2);
+
+		if (isnull1)
+		{
+			if (isnull2)
+				result = 0;
+			else if (entry->sk_flags & SK_BT_NULLS_FIRST)
+				result = -1;
+			else
+				result = 1;
+		}
+		else if (isnull2)
+		{
+			if (entry->sk_flags & SK_BT_NULLS_FIRST)
+				result = 1;
+			else
+				result = -1;
+		}
+		else
+		{
+			result = DatumGetInt32(FunctionCall2Coll(&entry->sk_func,
+													 entry->sk_collation,
+													 datum1, datum2));
+			if (entry->sk_flags & SK_BT_DESC)
+				result = (result < 0) ? 1 : ((result > 0) ? -1 : 0);
+		}
+
+		if (result != 0)
+			return result;
+	}
+
+	return ItemPointerCompare(&a->t_tid, &b->t_tid);
 }
 
 /*
@@ -1865,16 +4529,44 @@ invariant_leq_nontarget_offset(BtreeCheckState *state,
 }
 
 /*
- * Given a block number of a B-Tree page, return page in palloc()'d memory.
+ * Does the invariant hold that the key is greater than or equal to a given
+ * lower bound offset item, with the offset relating to a caller-supplied page
+ * that is not the current target page?
+ *
+ * If this function returns false, convention is that caller throws error due
+ * to corruption.
+ */
+static inline bool
+invariant_geq_nontarget_offset(BtreeCheckState *state,
+							   Page nontarget, ScanKey key,
+							   OffsetNumber lowerbound)
+{
+	int16		natts = state->rel->rd_rel->relnatts;
+	int32		cmp;
+
+	cmp = _bt_compare(state->rel, natts, key, nontarget, lowerbound);
+
+	return cmp >= 0;
+}
+
+/*
+ * Given a block number of a B-Tree page, return page for caller to check.
  * While at it, perform some basic checks of the page.
  *
  * There is never an attempt to get a consistent view of multiple pages using
  * multiple concurrent buffer locks; in general, we only acquire a single pin
  * and buffer lock at a time, which is often all that the nbtree code requires.
  *
- * Operating on a copy of the page is useful because it prevents control
- * getting stuck in an uninterruptible state when an underlying operator class
- * misbehaves.
+ * The buffer lock is always released before returning, which is useful
+ * because it prevents control getting stuck in an uninterruptible state when
+ * an underlying operator class misbehaves.  In the readonly case, the page is
+ * checked in place, with just a pin held.  Otherwise, a copy of the page is
+ * returned.  See bt_page_pool_get().
+ *
+ * Page is released by bt_release_page(), or by bt_page_pool_reset() along
+ * with per-page memory.  Internal pages are served from state's page cache,
+ * when there is one, once they have been read.  Returns NULL for a new
+ * (all-zeroes) page in the physical case only.
  */
 static Page
 palloc_btree_page(BtreeCheckState *state, BlockNumber blocknum)
@@ -1884,26 +4576,63 @@ palloc_btree_page(BtreeCheckState *state, BlockNumber blocknum)
 	BTPageOpaque opaque;
 	OffsetNumber maxoffset;
 
-	page = palloc(BLCKSZ);
+	/* Internal page that was already read and checked may be cached */
+	if (state->pagecache)
+	{
+		BtreeCachedPage *cached;
+
+		cached = hash_search(state->pagecache, &blocknum, HASH_FIND, NULL);
+		if (cached)
+		{
+			state->pagecachehits++;
+			return bt_page_pool_cached(state, cached->page);
+		}
+	}
+
+	/* Page read from segment file is checked in place, much like a buffer */
+	if (state->directio && blocknum != BTREE_METAPAGE &&
+		(page = bt_direct_read(state, blocknum)) != NULL)
+	{
+		if (PageIsNew(page))
+			return NULL;
+
+		/* Same as _bt_checkpage() */
+		if (PageGetSpecialSize(page) != MAXALIGN(sizeof(BTPageOpaqueData)))
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("index \"%s\" contains corrupted page at block %u",
+							RelationGetRelationName(state->rel), blocknum),
+					 errhint("Please REINDEX it.")));
+
+		goto checkpage;
+	}
 
-	/*
-	 * We copy the page into local storage to avoid holding pin on the buffer
-	 * longer than we must.
-	 */
 	buffer = ReadBufferExtended(state->rel, MAIN_FORKNUM, blocknum, RBM_NORMAL,
 								state->checkstrategy);
 	LockBuffer(buffer, BT_READ);
 
+	/*
+	 * Physical-order verification reads every block, including new pages
+	 * left behind when relation extension was interrupted.  Those are never
+	 * reachable through links, so a level walk can treat them as corrupt.
+	 */
+	if (state->physical && blocknum != BTREE_METAPAGE &&
+		PageIsNew(BufferGetPage(buffer)))
+	{
+		UnlockReleaseBuffer(buffer);
+		return NULL;
+	}
+
 	/*
 	 * Perform the same basic sanity checking that nbtree itself performs for
 	 * every page:
 	 */
 	_bt_checkpage(state->rel, buffer);
 
-	/* Only use copy of page in palloc()'d memory */
-	memcpy(page, BufferGetPage(buffer), BLCKSZ);
-	UnlockReleaseBuffer(buffer);
+	/* Releases buffer lock */
+	page = bt_page_pool_get(state, buffer);
 
+checkpage:
 	opaque = (BTPageOpaque) PageGetSpecialPointer(page);
 
 	if (opaque->btpo_flags & BTP_META && blocknum != BTREE_METAPAGE)
@@ -2012,5 +4741,460 @@ palloc_btree_page(BtreeCheckState *state, BlockNumber blocknum)
 				 errmsg("internal page block %u in index \"%s\" has garbage items",
 						blocknum, RelationGetRelationName(state->rel))));
 
+	if (state->pagecache && !P_ISLEAF(opaque))
+		bt_page_cache_add(state, blocknum, page);
+
+	return page;
+}
+
+/*
+ * Allocate space for state's pool of pages
+ */
+static void
+bt_page_pool_init(BtreeCheckState *state)
+{
+	BtreePagePool *pool = &state->pool;
+	int			slot;
+
+	pool->unaligned = palloc(BLCKSZ * (BT_PAGE_POOL_SIZE + 1));
+	pool->space = (char *) TYPEALIGN(BLCKSZ, pool->unaligned);
+	for (slot = 0; slot < BT_PAGE_POOL_SIZE; slot++)
+	{
+		pool->pages[slot] = NULL;
+		pool->buffers[slot] = InvalidBuffer;
+	}
+	pool->inuse = 0;
+}
+
+/*
+ * Return page from caller's share-locked buffer, releasing the buffer lock.
+ *
+ * In the readonly case, the page is returned in place, keeping the pin.
+ * Heavyweight locking prevents any concurrent change to the page that
+ * matters, even without a buffer lock:  only hint bits, such as LP_DEAD, can
+ * be set concurrently.  (A tuple that is concurrently marked LP_DEAD may or
+ * may not be fingerprinted, but it can only point to a heap tuple that is
+ * dead to everyone, which need not have an index tuple.)  Otherwise, pages
+ * can be concurrently split or deleted, so a copy of the page is returned,
+ * and the buffer is released.
+ *
+ * Once every slot is in use, a copy of the page is returned in palloc()'d
+ * memory instead.
+ */
+static Page
+bt_page_pool_get(BtreeCheckState *state, Buffer buffer)
+{
+	BtreePagePool *pool = &state->pool;
+	Page		page;
+	int			slot;
+
+	for (slot = 0; slot < BT_PAGE_POOL_SIZE; slot++)
+	{
+		if (!(pool->inuse & (1 << slot)))
+			break;
+	}
+
+	if (slot < BT_PAGE_POOL_SIZE && state->readonly)
+	{
+		LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
+		pool->inuse |= 1 << slot;
+		pool->buffers[slot] = buffer;
+		pool->pages[slot] = BufferGetPage(buffer);
+		return pool->pages[slot];
+	}
+
+	if (slot < BT_PAGE_POOL_SIZE)
+	{
+		pool->inuse |= 1 << slot;
+		pool->buffers[slot] = InvalidBuffer;
+		pool->pages[slot] = pool->space + slot * BLCKSZ;
+		page = pool->pages[slot];
+	}
+	else
+		page = palloc(BLCKSZ);
+
+	memcpy(page, BufferGetPage(buffer), BLCKSZ);
+	UnlockReleaseBuffer(buffer);
+
+	return page;
+}
+
+/*
+ * Return page from internal page cache, which is held in place much like a
+ * buffer, or copied into palloc()'d memory once every slot is in use
+ */
+static Page
+bt_page_pool_cached(BtreeCheckState *state, Page cached)
+{
+	BtreePagePool *pool = &state->pool;
+	Page		page;
+	int			slot;
+
+	for (slot = 0; slot < BT_PAGE_POOL_SIZE; slot++)
+	{
+		if (!(pool->inuse & (1 << slot)))
+		{
+			pool->inuse |= 1 << slot;
+			pool->buffers[slot] = InvalidBuffer;
+			pool->pages[slot] = cached;
+			return cached;
+		}
+	}
+
+	page = palloc(BLCKSZ);
+	memcpy(page, cached, BLCKSZ);
+
+	return page;
+}
+
+/*
+ * Return slot in state's pool that holds page, or -1 if page was palloc()'d
+ */
+static int
+bt_page_pool_slot(BtreeCheckState *state, Page page)
+{
+	BtreePagePool *pool = &state->pool;
+	int			slot;
+
+	for (slot = 0; slot < BT_PAGE_POOL_SIZE; slot++)
+	{
+		if ((pool->inuse & (1 << slot)) && pool->pages[slot] == page)
+			return slot;
+	}
+
+	return -1;
+}
+
+/*
+ * Release page returned by palloc_btree_page()
+ */
+static void
+bt_release_page(BtreeCheckState *state, Page page)
+{
+	BtreePagePool *pool = &state->pool;
+	int			slot = bt_page_pool_slot(state, page);
+
+	/* Page in direct read window is only overwritten by next window read */
+	if (state->directio && (char *) page >= state->directread.window &&
+		(char *) page < state->directread.window +
+		BT_DIRECT_READ_BLOCKS * BLCKSZ)
+		return;
+
+	if (slot < 0)
+	{
+		pfree(page);
+		return;
+	}
+
+	if (BufferIsValid(pool->buffers[slot]))
+		ReleaseBuffer(pool->buffers[slot]);
+	pool->buffers[slot] = InvalidBuffer;
+	pool->pages[slot] = NULL;
+	pool->inuse &= ~(1 << slot);
+}
+
+/*
+ * Release every page held in state's pool, other than the target's right
+ * sibling, which the level walk reuses as its next target.  Caller resets
+ * state's per-page context, which frees any palloc()'d pages.
+ */
+static void
+bt_page_pool_reset(BtreeCheckState *state)
+{
+	BtreePagePool *pool = &state->pool;
+	int			keep = -1;
+	int			slot;
+
+	if (state->rightpage)
+		keep = bt_page_pool_slot(state, state->rightpage);
+
+	for (slot = 0; slot < BT_PAGE_POOL_SIZE; slot++)
+	{
+		if (slot == keep || !(pool->inuse & (1 << slot)))
+			continue;
+
+		if (BufferIsValid(pool->buffers[slot]))
+			ReleaseBuffer(pool->buffers[slot]);
+		pool->buffers[slot] = InvalidBuffer;
+		pool->pages[slot] = NULL;
+		pool->inuse &= ~(1 << slot);
+	}
+}
+
+/*
+ * Return block from index's segment files, bypassing shared_buffers, for
+ * physical-order verification.  Blocks are read a window at a time, so
+ * sequential calls here mostly return pages that were already read.
+ *
+ * Returns NULL when block must be read through the buffer manager instead:
+ * when it was in shared_buffers before being read, since the buffer could be
+ * newer than the block on disk, and when it fails the checks that the buffer
+ * manager performs on every block that it reads.  A block that is loaded into
+ * shared_buffers and written out again while it's being read here can appear
+ * torn, but only its hint bits can differ.  Checks are performed silently, so
+ * that a torn block isn't reported as a checksum failure, and the buffer
+ * manager reads it again.
+ *
+ * Caller must hold ShareLock, so no block can be changed on disk, other than
+ * to set hint bits, and returned page is only valid until the next call here.
+ */
+static Page
+bt_direct_read(BtreeCheckState *state, BlockNumber blocknum)
+{
+	BtreeDirectRead *direct = &state->directread;
+	Page		page;
+
+	if (blocknum < direct->start || blocknum >= direct->start + direct->nread)
+		bt_direct_read_window(state, blocknum);
+
+	if (blocknum >= direct->start + direct->nread ||
+		direct->resident[blocknum - direct->start])
+		return NULL;
+
+	page = (Page) (direct->window + (blocknum - direct->start) * BLCKSZ);
+	if (!bt_direct_page_verified(page, blocknum))
+		return NULL;
+
+	direct->direct++;
 	return page;
 }
+
+/*
+ * Read window of blocks starting at blocknum, up to the end of its segment
+ * file.  Blocks are looked up in shared_buffers before anything is read, so
+ * that any block that isn't found was already written out as of the read.
+ */
+static void
+bt_direct_read_window(BtreeCheckState *state, BlockNumber blocknum)
+{
+	BtreeDirectRead *direct = &state->directread;
+	BlockNumber segno = blocknum / ((BlockNumber) RELSEG_SIZE);
+	BlockNumber segblock = blocknum % ((BlockNumber) RELSEG_SIZE);
+	int			nblocks;
+	int			i;
+	ssize_t		nbytes;
+
+	nblocks = Min(BT_DIRECT_READ_BLOCKS, direct->nblocks - blocknum);
+	nblocks = Min(nblocks, RELSEG_SIZE - segblock);
+
+	for (i = 0; i < nblocks; i++)
+		direct->resident[i] = bt_block_resident(state, blocknum + i);
+
+	/* Open segment file, if not already open */
+	if (direct->fd < 0 || direct->segno != segno)
+	{
+		char	   *basepath;
+
+		if (direct->fd >= 0)
+			CloseTransientFile(direct->fd);
+		if (direct->path)
+			pfree(direct->path);
+
+		RelationOpenSmgr(state->rel);
+		basepath = relpath(state->rel->rd_smgr->smgr_rnode, MAIN_FORKNUM);
+		if (segno > 0)
+		{
+			direct->path = psprintf("%s.%u", basepath, segno);
+			pfree(basepath);
+		}
+		else
+			direct->path = basepath;
+
+#if PG_VERSION_NUM >= 110000
+		direct->fd = OpenTransientFile(direct->path,
+									   O_RDONLY | PG_BINARY | PG_O_DIRECT);
+#else
+		direct->fd = OpenTransientFile(direct->path,
+									   O_RDONLY | PG_BINARY | PG_O_DIRECT, 0);
+#endif
+
+		/* Some filesystems don't support O_DIRECT, so do without it */
+		if (direct->fd < 0 && errno == EINVAL && PG_O_DIRECT != 0)
+		{
+			elog(DEBUG2, "could not open file \"%s\" with O_DIRECT, reading it through kernel page cache",
+				 direct->path);
+#if PG_VERSION_NUM >= 110000
+			direct->fd = OpenTransientFile(direct->path, O_RDONLY | PG_BINARY);
+#else
+			direct->fd = OpenTransientFile(direct->path, O_RDONLY | PG_BINARY,
+										   0);
+#endif
+		}
+
+		if (direct->fd < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", direct->path)));
+		direct->segno = segno;
+	}
+
+	if (lseek(direct->fd, (off_t) segblock * BLCKSZ, SEEK_SET) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek to block %u in file \"%s\": %m",
+						segblock, direct->path)));
+
+	nbytes = read(direct->fd, direct->window, nblocks * BLCKSZ);
+	if (nbytes < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read block %u in file \"%s\": %m",
+						segblock, direct->path)));
+
+	/* Blocks past a short read are left to the buffer manager */
+	direct->start = blocknum;
+	direct->nread = nbytes / BLCKSZ;
+}
+
+/*
+ * Does page read from segment file pass the checks that PageIsVerified()
+ * performs on every block the buffer manager reads?
+ *
+ * Unlike PageIsVerified(), this never reports a checksum failure, or counts
+ * one in the statistics collector.  Caller reads any page that fails through
+ * the buffer manager instead, which reports the failure if the block on disk
+ * is really corrupt.
+ */
+static bool
+bt_direct_page_verified(Page page, BlockNumber blocknum)
+{
+	PageHeader	phdr = (PageHeader) page;
+	char	   *bytes = (char *) page;
+	int			i;
+
+	if (!PageIsNew(page))
+	{
+		if (DataChecksumsEnabled() &&
+			pg_checksum_page(bytes, blocknum) != phdr->pd_checksum)
+			return false;
+
+		return (phdr->pd_flags & ~PD_VALID_FLAG_BITS) == 0 &&
+			phdr->pd_lower <= phdr->pd_upper &&
+			phdr->pd_upper <= phdr->pd_special &&
+			phdr->pd_special <= BLCKSZ &&
+			phdr->pd_special == MAXALIGN(phdr->pd_special);
+	}
+
+	/* New page must be all zeroes */
+	for (i = 0; i < BLCKSZ; i++)
+	{
+		if (bytes[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Is index block in shared_buffers?
+ *
+ * Answer can go stale as soon as it's returned, which caller must allow for.
+ *
+ * PostgreSQL 14 and later answer this through PrefetchBuffer()'s result,
+ * though only where prefetching is supported.  Otherwise every block is
+ * treated as resident, so that it's read through the buffer manager.
+ * PrefetchBuffer() also asks the kernel to read ahead any block that isn't
+ * resident, which costs an extra read when the segment file is opened with
+ * O_DIRECT.
+ *
+ * Earlier versions have no public interface for this, so the lookup that the
+ * buffer manager performs before reading a block is repeated here, using
+ * buf_internals.h.  The buffer mapping table, its partition locks and
+ * INIT_BUFFERTAG() are unchanged from 9.4 through 13.
+ */
+static bool
+bt_block_resident(BtreeCheckState *state, BlockNumber blocknum)
+{
+#if PG_VERSION_NUM >= 140000
+#ifdef USE_PREFETCH
+	PrefetchBufferResult result;
+
+	result = PrefetchBuffer(state->rel, MAIN_FORKNUM, blocknum);
+
+	return BufferIsValid(result.recent_buffer);
+#else
+	return true;
+#endif
+#else
+	BufferTag	tag;
+	uint32		hashcode;
+	LWLock	   *partitionLock;
+	int			buf_id;
+
+	RelationOpenSmgr(state->rel);
+	INIT_BUFFERTAG(tag, state->rel->rd_smgr->smgr_rnode.node, MAIN_FORKNUM,
+				   blocknum);
+	hashcode = BufTableHashCode(&tag);
+	partitionLock = BufMappingPartitionLock(hashcode);
+
+	LWLockAcquire(partitionLock, LW_SHARED);
+	buf_id = BufTableLookup(&tag, hashcode);
+	LWLockRelease(partitionLock);
+
+	return buf_id >= 0;
+#endif
+}
+
+/*
+ * Create cache of copies of internal pages, for readonly verification.
+ *
+ * Internal pages are a small fraction of any index, but the downlink checks
+ * read them out of order, sometimes more than once:  children whose bounds
+ * weren't matched by the level walk, and descents that check for an
+ * interrupted multi-level page deletion.  Cached pages are charged to
+ * structure verification's memory, and are limited to half of it, leaving
+ * the rest to the downlink bounds and prefetch lists.  Pages are never
+ * evicted.  Since levels are walked top-down, the pages closest to the root,
+ * which descents read most often, are cached first.
+ */
+static void
+bt_page_cache_create(BtreeCheckState *state)
+{
+	HASHCTL		hctl;
+
+	state->pagecachemax = state->structuremem / 2 / BLCKSZ;
+	if (state->pagecachemax <= 0)
+		return;
+
+	state->pagecachecontext = AllocSetContextCreate(CurrentMemoryContext,
+													"amcheck page cache context",
+#if PG_VERSION_NUM >= 110000
+													ALLOCSET_DEFAULT_SIZES);
+#else
+													ALLOCSET_DEFAULT_MINSIZE,
+													ALLOCSET_DEFAULT_INITSIZE,
+													ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+	memset(&hctl, 0, sizeof(hctl));
+	hctl.keysize = sizeof(BlockNumber);
+	hctl.entrysize = sizeof(BtreeCachedPage);
+	hctl.hash = tag_hash;
+	hctl.hcxt = state->pagecachecontext;
+	state->pagecache = hash_create("amcheck page cache",
+								   Min(state->pagecachemax, 1024), &hctl,
+								   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+}
+
+/*
+ * Add copy of internal page that passed palloc_btree_page() checks to state's
+ * page cache, unless cache is full
+ */
+static void
+bt_page_cache_add(BtreeCheckState *state, BlockNumber blocknum, Page page)
+{
+	BtreeCachedPage *cached;
+	bool		found;
+
+	if (blocknum == BTREE_METAPAGE ||
+		hash_get_num_entries(state->pagecache) >= state->pagecachemax ||
+		state->structureused + BLCKSZ > state->structuremem)
+		return;
+
+	cached = hash_search(state->pagecache, &blocknum, HASH_ENTER, &found);
+	if (!found)
+	{
+		cached->page = MemoryContextAlloc(state->pagecachecontext, BLCKSZ);
+		memcpy(cached->page, page, BLCKSZ);
+		state->structureused += BLCKSZ;
+	}
+}